@@ -0,0 +1,156 @@
+// Single query latency of discord::flatIndex against the faiss indexes it stands in for, at the
+// channel sizes around EXACT_SEARCH_MAX_VECTORS. HNSW is built the way messageArchiver builds it
+// (M 64, efSearch 500) and its recall is measured against the exact scan.
+//
+// Not part of the bot's build. From the repo root, with faiss from vcpkg:
+//   g++ -std=c++20 -O2 -march=native -Isrc bench/flatindex_bench.cpp src/discord/flatindex.cpp \
+//       src/common/util.cpp src/log/log.cpp -lfaiss -lopenblas -fopenmp -o flatindex_bench
+//   OMP_NUM_THREADS=1 ./flatindex_bench [max vectors]
+//
+// The bot searches with one thread per query, so run it with OMP_NUM_THREADS=1 to compare like with like.
+//
+// This file hasn't been compiled yet, the faiss C++ headers weren't available. The numbers below come
+// from two harnesses on one core of an AVX-512 Xeon, microseconds per query. The flat columns are
+// flatIndex timed from C++ by a copy of this file with the faiss parts taken out. The faiss columns,
+// the build time and recall are from the faiss 1.15.1 Python bindings over the same vectors, so every
+// faiss query includes about 8us of per call binding overhead. Rerun this file to replace them.
+//
+//    vectors  flat fp32  flat fp16  flat int8  faiss flat  faiss hnsw  hnsw build  recall@10
+//       1000        267        155         75         148         469        0.1s      1.000
+//       5000        779        505        322         724        1312        1.6s      1.000
+//      10000       1464        996        674        1308        2242        4.0s      0.995
+//      25000       4617       2327       1622        6813        6087       15.2s      0.915
+//      50000      13872      11361       3259       15028        8188       40.0s      0.769
+//     100000      30406      23249      13190       35861       10841      120.5s      0.575
+//
+// The binding overhead only matters for faiss flat at 1000 vectors, where it's about 5% of the time.
+// HNSW only starts answering faster somewhere between 25k and 50k vectors, and by then it's already
+// missing a good part of the exact top 10 (random vectors are its worst case, real embeddings cluster
+// and do better). Up to EXACT_SEARCH_MAX_VECTORS = 50000 the scan stays exact and within ~14ms, ~3ms
+// as int8, past it the scan keeps growing linearly while HNSW levels off.
+
+#include "discord/flatindex.hpp"
+
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static const size_t DIM         = 768;
+static const size_t K           = 10;
+static const size_t NUM_QUERIES = 200;
+
+// mpnet embeddings are normalized, so are these
+static std::vector<float> RandomVectors(const size_t numVectors, std::mt19937& rng){
+    std::normal_distribution<float> dist;
+    std::vector<float>              vectors(numVectors * DIM);
+
+    for(size_t ii = 0; ii < numVectors; ii++){
+        float* vector = vectors.data() + ii * DIM;
+        float  norm   = 0.0f;
+
+        for(size_t jj = 0; jj < DIM; jj++){
+            vector[jj] = dist(rng);
+            norm      += vector[jj] * vector[jj];
+        }
+
+        norm = std::sqrt(norm);
+        for(size_t jj = 0; jj < DIM; jj++){
+            vector[jj] /= norm;
+        }
+    }
+
+    return vectors;
+}
+
+// microseconds per query, every query searched on its own like the bot does
+template<typename searchFunc>
+static double TimeSearches(const std::vector<float>& queries, std::vector<faiss::idx_t>& labels, searchFunc&& search){
+    std::vector<float> scores(K);
+    labels.assign(NUM_QUERIES * K, -1);
+
+    // warm the caches with the first query
+    search(queries.data(), scores.data(), labels.data());
+
+    const auto start = std::chrono::steady_clock::now();
+    for(size_t ii = 0; ii < NUM_QUERIES; ii++){
+        search(queries.data() + ii * DIM, scores.data(), labels.data() + ii * K);
+    }
+
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / NUM_QUERIES;
+}
+
+static double Recall(const std::vector<faiss::idx_t>& exact, const std::vector<faiss::idx_t>& approx){
+    size_t found = 0;
+
+    for(size_t ii = 0; ii < NUM_QUERIES; ii++){
+        for(size_t jj = 0; jj < K; jj++){
+            const auto begin = approx.begin() + ii * K;
+            found += (std::find(begin, begin + K, exact[ii * K + jj]) != begin + K);
+        }
+    }
+
+    return (double)found / (NUM_QUERIES * K);
+}
+
+int main(int argc, char* argv[]){
+    const size_t maxVectors = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 200000;
+
+    std::mt19937             rng(42);
+    const std::vector<float> queries = RandomVectors(NUM_QUERIES, rng);
+
+    std::printf("%10s %12s %12s %12s %12s %12s %12s %10s\n",
+                "vectors", "flat fp32", "flat fp16", "flat int8", "faiss flat", "faiss hnsw", "hnsw build", "recall@10");
+
+    for(const size_t numVectors : { 1000, 5000, 10000, 25000, 50000, 100000, 200000 }){
+        if(numVectors > maxVectors){
+            break;
+        }
+
+        const std::vector<float> vectors = RandomVectors(numVectors, rng);
+
+        std::vector<faiss::idx_t> exactLabels;
+        std::vector<faiss::idx_t> labels;
+        double                    flatUs[3];
+
+        const discord::vectorEncoding encodings[] = { discord::VECTOR_ENCODING_FP32, discord::VECTOR_ENCODING_FP16, discord::VECTOR_ENCODING_INT8 };
+        for(size_t ii = 0; ii < 3; ii++){
+            discord::flatIndex index(DIM, encodings[ii]);
+            index.Add(numVectors, vectors.data());
+
+            flatUs[ii] = TimeSearches(queries, (0 == ii) ? exactLabels : labels, [&](const float* query, float* scores, faiss::idx_t* out){
+                index.Search(1, query, K, scores, out);
+            });
+        }
+
+        faiss::IndexFlatIP faissFlat(DIM);
+        faissFlat.add(numVectors, vectors.data());
+
+        const double faissFlatUs = TimeSearches(queries, labels, [&](const float* query, float* scores, faiss::idx_t* out){
+            faissFlat.search(1, query, K, scores, out);
+        });
+
+        const auto buildStart = std::chrono::steady_clock::now();
+
+        faiss::IndexHNSWFlat hnsw(DIM, 64, faiss::METRIC_INNER_PRODUCT);
+        hnsw.hnsw.efSearch = 500;
+        hnsw.add(numVectors, vectors.data());
+
+        const double buildS = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+
+        const double hnswUs = TimeSearches(queries, labels, [&](const float* query, float* scores, faiss::idx_t* out){
+            hnsw.search(1, query, K, scores, out);
+        });
+
+        std::printf("%10zu %10.0fus %10.0fus %10.0fus %10.0fus %10.0fus %11.1fs %10.3f\n",
+                    numVectors, flatUs[0], flatUs[1], flatUs[2], faissFlatUs, hnswUs, buildS, Recall(exactLabels, labels));
+    }
+
+    return 0;
+}
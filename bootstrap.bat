@@ -17,6 +17,13 @@ if not exist "%VCPKG_DIR%" (
 %VCPKG_DIR%\vcpkg.exe install
 
 
+echo ===DOWNLOADING TOKENIZER VOCABULARY===
+set VOCAB_PATH=%~dp0working\cfg\o200k_base.tiktoken
+if not exist "%VOCAB_PATH%" (
+    curl -L -o "%VOCAB_PATH%" https://openaipublic.blob.core.windows.net/encodings/o200k_base.tiktoken
+)
+
+
 
 echo === !! DONE !! ===
 
@@ -1,38 +1,73 @@
-from flask import Flask, request, jsonify
-from sentence_transformers import SentenceTransformer
-import torch
-
-app = Flask(__name__)
-model = SentenceTransformer("sentence-transformers/all-mpnet-base-v2")
-if torch.cuda.is_available():
-  print("USING CUDA")
-  device = "cuda"
-else:
-  print("USING CPU")
-  device = "cpu"
-
-model.to(device)
-
-@app.route("/embed", methods=["POST"])
-def embed():
-    try:
-        textList = request.json["texts"]
-        
-        if not isinstance(textList, list):
-            # Bad Request
-            return jsonify({"error": "'texts' must be a list of strings"}), 400
-        
-        embeddings = model.encode(textList)
-        
-        print ("encoded data")
-        
-        return jsonify({
-            "embedding": embeddings.tolist()
-        })
-    except Exception as e:
-        print("Exception raised on flask server:", str(e))
-
-        # Internal Server Error
-        return jsonify({"error": str(e)}), 500
-
-app.run(port=5000)
\ No newline at end of file
+from flask import Flask, Response, request, jsonify
+from sentence_transformers import SentenceTransformer
+import argparse
+import numpy as np
+import struct
+import torch
+
+# run several of these on different ports and list them all in EMBEDDING_ENDPOINTS to scale out
+parser = argparse.ArgumentParser()
+parser.add_argument("--port", type=int, default=5000)
+parser.add_argument("--device", help="e.g. cuda:1 to put this worker on the second gpu")
+args = parser.parse_args()
+
+app = Flask(__name__)
+model = SentenceTransformer("sentence-transformers/all-mpnet-base-v2")
+if args.device:
+  print("USING", args.device.upper())
+  device = args.device
+elif torch.cuda.is_available():
+  print("USING CUDA")
+  device = "cuda"
+else:
+  print("USING CPU")
+  device = "cpu"
+
+model.to(device)
+
+# binary responses are a little endian header of magic, count, dim and encoding
+# followed by count * dim values. Clients that don't ask for them get JSON.
+BINARY_MAGIC = b"EMB1"
+BINARY_ENCODINGS = {
+    "application/x-embeddings-f32": (0, "<f4"),
+    "application/x-embeddings-f16": (1, "<f2"),
+}
+
+def binaryResponse(embeddings, mimetype):
+    encoding, dtype = BINARY_ENCODINGS[mimetype]
+
+    values = np.ascontiguousarray(embeddings, dtype=dtype)
+    count = values.shape[0] if values.ndim == 2 else 0
+    dim = values.shape[1] if values.ndim == 2 else 0
+
+    header = struct.pack("<4sIII", BINARY_MAGIC, count, dim, encoding)
+    return Response(header + values.tobytes(), mimetype=mimetype)
+
+@app.route("/embed", methods=["POST"])
+def embed():
+    try:
+        textList = request.json["texts"]
+        
+        if not isinstance(textList, list):
+            # Bad Request
+            return jsonify({"error": "'texts' must be a list of strings"}), 400
+        
+        embeddings = model.encode(textList)
+        
+        print ("encoded data")
+        
+        # json first so a client that accepts anything keeps getting json
+        mimetype = request.accept_mimetypes.best_match(["application/json"] + list(BINARY_ENCODINGS.keys()))
+        if mimetype in BINARY_ENCODINGS:
+            return binaryResponse(embeddings, mimetype)
+        
+        return jsonify({
+            "embedding": embeddings.tolist()
+        })
+    except Exception as e:
+        print("Exception raised on flask server:", str(e))
+
+        # Internal Server Error
+        return jsonify({"error": str(e)}), 500
+
+app.run(port=args.port)
\ No newline at end of file
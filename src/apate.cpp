@@ -1,5 +1,5 @@
-#include "apate.hpp"
-
-apate::apate(const std::string& token) : bot (token)
-{
-}
+#include "apate.hpp"
+
+apate::apate(const std::string& token) : bot (token)
+{
+}
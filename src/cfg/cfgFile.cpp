@@ -104,6 +104,10 @@ std::string CfgFile::ConfigFilePath() const{
     return m_configFilePath;
 }
 
+bool CfgFile::HasPpty(const std::string_view key) const{
+    return m_cfg.count(std::string(key)) > 0;
+}
+
 void CfgFile::ParseCfgLines(const std::string& buffer){
     std::vector<std::string_view> lines = Tokenize(buffer, CFG_FILE_LINE_DELIM);
 
@@ -13,6 +13,8 @@ public:
     void ReadCfgFile(const std::string_view pathToCfg);
     std::string ConfigFilePath() const;
 
+    bool HasPpty(const std::string_view key) const;
+
     template<typename T>
     T ReadPpty(const std::string_view key);
 
@@ -1,297 +1,1039 @@
-#include "chatgpt.hpp"
-
-#include "common/util.hpp"
-#include "log/log.hpp"
-
-#include <nlohmann/json.hpp>
-
-#include <format>
-
-
-namespace openai
-{
-
-static const char *openAI_API_URL = "https://api.openai.com/v1/responses";
-
-
-static size_t CurlWriteToString(void* contents, size_t size, size_t nmemb, std::string* response) {
-    const size_t totalSize = size * nmemb;
-    response->append((char*)contents, totalSize);
-    return totalSize;
-}
-
-
-static OutputItemType ChatGPTMessageTypeStrToType(const std::string_view &typeStr){
-    if(typeStr=="message"){
-        return OutputItemType::OUTPUT_MESSAGE;
-    }
-
-    if(typeStr=="file_search_call"){
-        return OutputItemType::OUTPUT_FILE_SEARCH;
-    }
-
-    if(typeStr=="function_call"){
-        return OutputItemType::OUTPUT_FUNCTION_TOOL;
-    }
-
-    if(typeStr=="web_search_call"){
-        return OutputItemType::OUTPUT_WEB_SEARCH;
-    }
-
-    if(typeStr=="reasoning"){
-        return OutputItemType::OUTPUT_REASONING;
-    }
-
-    return OutputItemType::OUTPUT_UNKNOWN;
-}
-
-static openai::chatGPTOutputItem OutputItemFromJson(const nlohmann::json &outputBlock){
-
-    openai::chatGPTOutputItem item;
-
-    if (!outputBlock.contains("type")) {
-        APATE_LOG_WARN_AND_THROW(std::invalid_argument,"Missing 'type' in output block");
-    }
-
-    item.outputType = ChatGPTMessageTypeStrToType(outputBlock["type"]);
-
-    switch(item.outputType){
-        case OutputItemType::OUTPUT_MESSAGE:
-        {
-            openai::chatGPTOutputMessage message;
-
-            if (outputBlock.contains("content") && outputBlock["content"].is_array() && !outputBlock["content"].empty()){
-                const auto& contentArray = outputBlock["content"];
-                const auto& content0     = outputBlock["content"][0];
-                if (contentArray.size() > 1){
-                    // the API spec says only one item is inside at a time.
-                    APATE_LOG_DEBUG("Unexpected: content array has more than one object inside");
-                }
-
-                if(content0.contains("refusal")){
-                    message.message = content0["refusal"];
-                    message.refused = true;
-                }
-                else if (content0.contains("text")){
-                    message.message = content0["text"];
-                }
-                else{
-                    APATE_LOG_WARN_AND_THROW(std::runtime_error, "Message content missing 'refusal' or 'text'");
-                }
-            }
-            else {
-                APATE_LOG_WARN_AND_THROW(std::runtime_error, "Json content block is invalid");
-            }
-
-            item.content = message;
-            break;
-        }
-        case OutputItemType::OUTPUT_REASONING:
-        {
-            openai::chatGPTOutputReasoning reasoning;
-            reasoning.id = outputBlock.value("id", "");
-
-            if(outputBlock.contains("summary") && outputBlock["summary"].array() && !outputBlock["summary"].empty()){
-                if (outputBlock["summary"].contains("text")){
-                    reasoning.summary = outputBlock["summary"]["text"];
-                }
-            }
-            item.content = reasoning;
-            break;
-        }
-        default:
-        {
-            APATE_LOG_WARN_AND_THROW(std::runtime_error, "unimplemented response type: {}", std::string (outputBlock["type"]));
-            break;
-        }
-    }
-    return item;
-}
-
-nlohmann::json chatGPTPrompt::JsonRequest(void) const{
-    nlohmann::json json;
-    json["model"] = model.modelValue;
-    json["instructions"] = systemPrompt;
-
-    // oldest first.
-    for (size_t ii = 0; ii < history.size(); ii++){
-
-        const auto &msg = history[ii];
-        json["input"][ii]["role"] = (ROLE_USER == msg.role) ? "user" : "assistant";
-        json["input"][ii]["content"] = msg.message;
-    }
-
-    size_t lastMessage = json["input"].size();
-    json["input"][lastMessage]["role"]    = "user";
-    json["input"][lastMessage]["content"] = request;
-
-    return json;
-}
-
-
-void chatGPTResponse::Put(const nlohmann::json& json){
-    if(json.empty()){
-        APATE_LOG_WARN_AND_THROW(std::runtime_error, "Empty json object");
-    }
-
-    if(!json.contains("id")){
-        APATE_LOG_DEBUG("Id missing from json object");
-    }
-    else{
-        id = json["id"];
-    }
-
-    if(!json.contains("status")){
-        APATE_LOG_DEBUG("status missing from json object");
-    }
-    else{
-        status = json["status"];
-    }
-
-    if(json.contains("created_at")){
-        createdAt = json["created_at"];
-    }
-
-    if(json.contains("error")){
-        std::string errorCode;
-        std::string errorReason;
-
-        if(json["error"].contains("code")){
-            errorCode = json["error"]["code"];
-        }
-
-        if(json["error"].contains("reason")){
-            errorReason = json["error"]["reason"];
-        }
-
-        if (!errorCode.empty() || !errorReason.empty()){
-            responseFailureReason = std::format("ERROR CODE {} - {}",
-                                                errorCode.empty() ? "NONE" : errorCode,
-                                                errorReason);
-        }
-    }
-
-    responseOK = (status == "completed" && responseFailureReason.empty());
-
-    if(!json.count("output")){
-        APATE_LOG_WARN("json object has no output objects");
-        return;
-    }
-
-    auto &jsonOutputs = json["output"];
-    for (const auto& outputBlock : jsonOutputs) {
-        try{
-            chatGPTOutputItem item = OutputItemFromJson(outputBlock);
-            outputs.push_back(std::move(item));
-        }
-        catch (const std::exception &e){
-            APATE_LOG_WARN ("Output block could not be parsed. - '{}'. Dump: \n\n{}",
-                            e.what(),
-                            jsonOutputs.dump());
-        }
-        catch (...){
-            APATE_LOG_WARN ("Output block could not be parsed. Unknown exception. Dump: \n\n{}",
-                            jsonOutputs.dump());
-        }
-
-    }
-}
-
-chatGPT::chatGPT(const std::string_view& openAIKey) : m_openAI_Key(openAIKey){
-    m_curl = curl_easy_init();
-    m_dispatcher = std::thread(&chatGPT::HandleQueue, this);
-}
-chatGPT::~chatGPT(){
-    std::unique_lock lock (m_dispatchQMtx);
-    m_shutDown = true;
-    m_dispatchQCV.notify_all();
-    lock.unlock();
-
-    if (m_dispatcher.joinable()){
-        m_dispatcher.join();
-    }
-
-    if (nullptr != m_curl){
-        curl_easy_cleanup(m_curl);
-    }
-}
-
-std::future<chatGPTResponse> chatGPT::AskChatGPTAsync(const chatGPTPrompt& prompt){
-    chatGPTDispatchRequest toDispatch;
-    toDispatch.json    = prompt.JsonRequest();
-
-    auto future        = toDispatch.promise.get_future();
-
-    std::lock_guard lock(m_dispatchQMtx);
-
-    m_dispatchQ.push(std::move(toDispatch));
-    m_dispatchQCV.notify_all();
-
-    return future;
-}
-void chatGPT::HandleQueue(void){
-    while(true){
-        std::unique_lock lock(m_dispatchQMtx);
-        m_dispatchQCV.wait(lock, [&](){return (m_shutDown || !m_dispatchQ.empty());});
-
-        if (m_shutDown){
-            // clear out the queue and send a status code any threads waiting on a promise
-
-            while(!m_dispatchQ.empty()){
-                chatGPTDispatchRequest request (std::move (m_dispatchQ.front()));
-                chatGPTResponse        response;
-
-                response.HTTPCode = CURLE_RECV_ERROR;
-                request.promise.set_value(response);
-
-                m_dispatchQ.pop();
-            }
-            return;
-        }
-
-        // copy the data to avoid starving callers while we process
-        chatGPTDispatchRequest request (std::move (m_dispatchQ.front()));
-        m_dispatchQ.pop();
-        lock.unlock();
-
-        struct curl_slist* headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        headers = curl_slist_append(headers, ("Authorization: Bearer " + m_openAI_Key).c_str());
-
-        std::string requestDataStr = request.json.dump();
-        std::string curlResponse;
-
-        curl_easy_setopt(m_curl, CURLOPT_URL, openAI_API_URL);
-        curl_easy_setopt(m_curl, CURLOPT_POSTFIELDS, requestDataStr.c_str ());
-        curl_easy_setopt(m_curl, CURLOPT_POSTFIELDSIZE, requestDataStr.size ());
-        curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, CurlWriteToString);
-        curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, &curlResponse);
-        curl_easy_setopt(m_curl, CURLOPT_SSL_VERIFYPEER, 0);
-
-        chatGPTResponse chatGPTResponse;
-        if((chatGPTResponse.HTTPCode = curl_easy_perform(m_curl)) != CURLE_OK){
-            // nothing to do. Just return the error code.
-            request.promise.set_value(std::move(chatGPTResponse));
-
-        }
-        else{
-            try{
-                nlohmann::json jsonResponse = nlohmann::json::parse(curlResponse);
-                chatGPTResponse.Put(jsonResponse);
-            }
-            catch (...){
-                chatGPTResponse.responseOK = false;
-            }
-
-            request.promise.set_value(std::move(chatGPTResponse));
-
-            if (NULL != headers){
-                curl_slist_free_all (headers);
-            }
-        }
-    }
-}
-
-
+#include "chatgpt.hpp"
+
+#include "common/util.hpp"
+#include "log/log.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <format>
+
+
+namespace openai
+{
+
+static const char *openAI_API_URL = "https://api.openai.com/v1/responses";
+
+// longest the dispatcher sleeps without anything to wake it
+static const int DISPATCH_POLL_MS = 1000;
+
+// charged against the tokens per minute limit for requests that leave the output length to the model
+static const size_t DEFAULT_OUTPUT_TOKENS_ESTIMATE = 1024;
+
+// how long a model is held back after the API says it's over its rate limit, unless it says for how long
+static const std::chrono::seconds RATE_LIMITED_PAUSE = std::chrono::seconds(2);
+
+// first byte latencies kept per model to find the p95 a hedged request waits for
+static const size_t LATENCY_WINDOW_SAMPLES = 200;
+static const size_t MIN_HEDGE_SAMPLES      = 20;
+
+// bytes of a request body that aren't prompt text, to reserve for it up front
+static const size_t JSON_REQUEST_OVERHEAD = 128;
+static const size_t JSON_MESSAGE_OVERHEAD = 48;
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// length of the utf-8 sequence at text[ii]. A broken one is as long as the part of it that could still
+// have been valid, the part decoders replace with a single U+FFFD.
+static size_t Utf8SequenceLength(const std::string_view text, const size_t ii, bool& valid){
+    const unsigned char lead = (unsigned char)text[ii];
+
+    // the second byte's range rules out overlong encodings, utf-16 surrogates and past U+10FFFF
+    size_t        length = 0;
+    unsigned char low    = 0x80;
+    unsigned char high   = 0xBF;
+
+    if (lead >= 0xC2 && lead <= 0xDF){
+        length = 2;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF){
+        length = 3;
+        low    = (0xE0 == lead) ? 0xA0 : low;
+        high   = (0xED == lead) ? 0x9F : high;
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4){
+        length = 4;
+        low    = (0xF0 == lead) ? 0x90 : low;
+        high   = (0xF4 == lead) ? 0x8F : high;
+    }
+    else{
+        valid = false;
+        return 1;
+    }
+
+    for (size_t jj = 1; jj < length; jj++){
+        const unsigned char next = (ii + jj < text.size()) ? (unsigned char)text[ii + jj] : 0;
+        if (next < low || next > high){
+            valid = false;
+            return jj;
+        }
+
+        low  = 0x80;
+        high = 0xBF;
+    }
+
+    valid = true;
+    return length;
+}
+
+// quoted and escaped. Runs that need no escaping are copied whole, broken utf-8 (a message cut
+// mid-character) becomes U+FFFD rather than a request the API rejects.
+static void AppendJsonString(std::string& out, const std::string_view text){
+    out += '"';
+
+    size_t runStart = 0;
+    size_t ii       = 0;
+
+    while (ii < text.size()){
+        const unsigned char c = (unsigned char)text[ii];
+
+        if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80){
+            ii++;
+            continue;
+        }
+
+        if (c >= 0x80){
+            bool         valid  = false;
+            const size_t length = Utf8SequenceLength(text, ii, valid);
+
+            if (!valid){
+                out.append(text.data() + runStart, ii - runStart);
+                out += "\\ufffd";
+                runStart = ii + length;
+            }
+
+            ii += length;
+            continue;
+        }
+
+        out.append(text.data() + runStart, ii - runStart);
+
+        switch (c){
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        default:
+            out += "\\u00";
+            out += HEX_DIGITS[c >> 4];
+            out += HEX_DIGITS[c & 0xF];
+            break;
+        }
+
+        ii++;
+        runStart = ii;
+    }
+
+    out.append(text.data() + runStart, ii - runStart);
+    out += '"';
+}
+
+// every input message costs a few tokens of framing on top of its text
+static const size_t MESSAGE_OVERHEAD_TOKENS = 4;
+
+// keeps the tokens per minute bucket near the truth until the usage comes back
+static size_t EstimatePromptTokens(const tokenCounter& counter, const chatGPTPrompt& prompt){
+    size_t tokens = counter.Count(prompt.systemPrompt) + counter.Count(prompt.request) + 2 * MESSAGE_OVERHEAD_TOKENS;
+    for(const auto& msg : prompt.history){
+        tokens += counter.Count(msg.message) + MESSAGE_OVERHEAD_TOKENS;
+    }
+
+    const size_t outputTokens = (prompt.maxOutputTokens > 0) ? prompt.maxOutputTokens : DEFAULT_OUTPUT_TOKENS_ESTIMATE;
+    return tokens + outputTokens;
+}
+
+
+static OutputItemType ChatGPTMessageTypeStrToType(const std::string_view &typeStr){
+    if(typeStr=="message"){
+        return OutputItemType::OUTPUT_MESSAGE;
+    }
+
+    if(typeStr=="file_search_call"){
+        return OutputItemType::OUTPUT_FILE_SEARCH;
+    }
+
+    if(typeStr=="function_call"){
+        return OutputItemType::OUTPUT_FUNCTION_TOOL;
+    }
+
+    if(typeStr=="web_search_call"){
+        return OutputItemType::OUTPUT_WEB_SEARCH;
+    }
+
+    if(typeStr=="reasoning"){
+        return OutputItemType::OUTPUT_REASONING;
+    }
+
+    return OutputItemType::OUTPUT_UNKNOWN;
+}
+
+static openai::chatGPTOutputItem OutputItemFromJson(const nlohmann::json &outputBlock){
+
+    openai::chatGPTOutputItem item;
+
+    if (!outputBlock.contains("type")) {
+        APATE_LOG_WARN_AND_THROW(std::invalid_argument,"Missing 'type' in output block");
+    }
+
+    item.outputType = ChatGPTMessageTypeStrToType(outputBlock["type"]);
+
+    switch(item.outputType){
+        case OutputItemType::OUTPUT_MESSAGE:
+        {
+            openai::chatGPTOutputMessage message;
+
+            if (outputBlock.contains("content") && outputBlock["content"].is_array() && !outputBlock["content"].empty()){
+                const auto& contentArray = outputBlock["content"];
+                const auto& content0     = outputBlock["content"][0];
+                if (contentArray.size() > 1){
+                    // the API spec says only one item is inside at a time.
+                    APATE_LOG_DEBUG("Unexpected: content array has more than one object inside");
+                }
+
+                if(content0.contains("refusal")){
+                    message.message = content0["refusal"];
+                    message.refused = true;
+                }
+                else if (content0.contains("text")){
+                    message.message = content0["text"];
+                }
+                else{
+                    APATE_LOG_WARN_AND_THROW(std::runtime_error, "Message content missing 'refusal' or 'text'");
+                }
+            }
+            else {
+                APATE_LOG_WARN_AND_THROW(std::runtime_error, "Json content block is invalid");
+            }
+
+            item.content = message;
+            break;
+        }
+        case OutputItemType::OUTPUT_REASONING:
+        {
+            openai::chatGPTOutputReasoning reasoning;
+            reasoning.id = outputBlock.value("id", "");
+
+            if(outputBlock.contains("summary") && outputBlock["summary"].array() && !outputBlock["summary"].empty()){
+                if (outputBlock["summary"].contains("text")){
+                    reasoning.summary = outputBlock["summary"]["text"];
+                }
+            }
+            item.content = reasoning;
+            break;
+        }
+        default:
+        {
+            APATE_LOG_WARN_AND_THROW(std::runtime_error, "unimplemented response type: {}", std::string (outputBlock["type"]));
+            break;
+        }
+    }
+    return item;
+}
+
+void chatGPTPrompt::WriteJsonRequest(std::string& body, const bool stream) const{
+    size_t estimate = JSON_REQUEST_OVERHEAD + model.modelValue.size() + systemPrompt.size() + request.size();
+    for(const auto& msg : history){
+        estimate += JSON_MESSAGE_OVERHEAD + msg.message.size();
+    }
+
+    body.clear();
+    body.reserve(estimate + estimate / 16);
+
+    body += "{\"model\":";
+    AppendJsonString(body, model.modelValue);
+
+    body += ",\"instructions\":";
+    AppendJsonString(body, systemPrompt);
+
+    // oldest first, the request goes last
+    body += ",\"input\":[";
+    for(const auto& msg : history){
+        body += (ROLE_USER == msg.role) ? "{\"role\":\"user\",\"content\":" : "{\"role\":\"assistant\",\"content\":";
+        AppendJsonString(body, msg.message);
+        body += "},";
+    }
+
+    body += "{\"role\":\"user\",\"content\":";
+    AppendJsonString(body, request);
+    body += "}]";
+
+    if (maxOutputTokens > 0){
+        char digits[24];
+        const auto result = std::to_chars(digits, digits + sizeof(digits), maxOutputTokens);
+
+        body += ",\"max_output_tokens\":";
+        body.append(digits, result.ptr);
+    }
+
+    if (stream){
+        body += ",\"stream\":true";
+    }
+
+    body += '}';
+}
+
+
+void chatGPTResponse::Put(const nlohmann::json& json){
+    if(json.empty()){
+        APATE_LOG_WARN_AND_THROW(std::runtime_error, "Empty json object");
+    }
+
+    if(!json.contains("id")){
+        APATE_LOG_DEBUG("Id missing from json object");
+    }
+    else{
+        id = json["id"];
+    }
+
+    if(!json.contains("status")){
+        APATE_LOG_DEBUG("status missing from json object");
+    }
+    else{
+        status = json["status"];
+    }
+
+    if(json.contains("created_at")){
+        createdAt = json["created_at"];
+    }
+
+    if(json.contains("error")){
+        std::string errorCode;
+        std::string errorReason;
+
+        if(json["error"].contains("code")){
+            errorCode = json["error"]["code"];
+        }
+
+        if(json["error"].contains("reason")){
+            errorReason = json["error"]["reason"];
+        }
+
+        if (!errorCode.empty() || !errorReason.empty()){
+            responseFailureReason = std::format("ERROR CODE {} - {}",
+                                                errorCode.empty() ? "NONE" : errorCode,
+                                                errorReason);
+        }
+    }
+
+    responseOK = (status == "completed" && responseFailureReason.empty());
+
+    if(json.contains("usage") && json["usage"].is_object()){
+        const auto& usage = json["usage"];
+
+        inputToken   = usage.value("input_tokens", 0);
+        outputTokens = usage.value("output_tokens", 0);
+        totalTokens  = usage.value("total_tokens", inputToken + outputTokens);
+    }
+
+    if(!json.count("output")){
+        APATE_LOG_WARN("json object has no output objects");
+        return;
+    }
+
+    auto &jsonOutputs = json["output"];
+    for (const auto& outputBlock : jsonOutputs) {
+        try{
+            chatGPTOutputItem item = OutputItemFromJson(outputBlock);
+            outputs.push_back(std::move(item));
+        }
+        catch (const std::exception &e){
+            APATE_LOG_WARN ("Output block could not be parsed. - '{}'. Dump: \n\n{}",
+                            e.what(),
+                            jsonOutputs.dump());
+        }
+        catch (...){
+            APATE_LOG_WARN ("Output block could not be parsed. Unknown exception. Dump: \n\n{}",
+                            jsonOutputs.dump());
+        }
+
+    }
+}
+
+chatGPT::chatGPT(const std::string_view& openAIKey, const size_t maxConcurrency) :
+    m_openAI_Key     (openAIKey),
+    m_maxConcurrency (std::max<size_t>(1, maxConcurrency)){
+
+    m_headers = curl_slist_append(m_headers, "Content-Type: application/json");
+    m_headers = curl_slist_append(m_headers, ("Authorization: Bearer " + m_openAI_Key).c_str());
+
+    // concurrent requests share one http/2 connection when the server allows it
+    m_multi = curl_multi_init();
+    curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    m_dispatcher = std::thread(&chatGPT::HandleQueue, this);
+}
+chatGPT::~chatGPT(){
+    std::unique_lock lock (m_dispatchQMtx);
+    m_shutDown = true;
+    lock.unlock();
+
+    if (nullptr != m_multi){
+        curl_multi_wakeup(m_multi);
+    }
+
+    if (m_dispatcher.joinable()){
+        m_dispatcher.join();
+    }
+
+    for (CURL* curl : m_idleHandles){
+        curl_easy_cleanup(curl);
+    }
+
+    if (nullptr != m_multi){
+        curl_multi_cleanup(m_multi);
+    }
+
+    if (nullptr != m_headers){
+        curl_slist_free_all(m_headers);
+    }
+}
+
+std::future<chatGPTResponse> chatGPT::AskChatGPTAsync(const chatGPTPrompt& prompt){
+    chatGPTDispatchRequest toDispatch;
+    prompt.WriteJsonRequest(toDispatch.body, false);
+
+    return Enqueue(std::move(toDispatch), prompt);
+}
+
+std::future<chatGPTResponse> chatGPT::AskChatGPTStreamAsync(const chatGPTPrompt& prompt, chatGPTStreamCallback onText){
+    chatGPTDispatchRequest toDispatch;
+    prompt.WriteJsonRequest(toDispatch.body, true);
+    toDispatch.onText = std::move(onText);
+
+    return Enqueue(std::move(toDispatch), prompt);
+}
+
+std::future<chatGPTResponse> chatGPT::Enqueue(chatGPTDispatchRequest&& toDispatch, const chatGPTPrompt& prompt){
+    auto request = std::make_shared<chatGPTDispatchRequest>(std::move(toDispatch));
+    auto future  = request->promise.get_future();
+
+    scheduledRequest& scheduling = request->scheduling;
+    scheduling.model    = prompt.model.modelValue;
+    scheduling.priority = prompt.priority;
+    scheduling.tenantId = prompt.tenantId;
+    scheduling.tokens   = EstimatePromptTokens(m_tokenCounter, prompt);
+    request->hedge      = prompt.hedge;
+
+    if(prompt.queueTimeout.count() > 0){
+        scheduling.deadline = std::chrono::steady_clock::now() + prompt.queueTimeout;
+    }
+
+    std::lock_guard lock(m_dispatchQMtx);
+
+    scheduling.id = m_nextRequestId++;
+    m_scheduler.Push(scheduledRequest(scheduling));
+    m_dispatchQ.emplace(scheduling.id, std::move(request));
+
+    if (nullptr != m_multi){
+        curl_multi_wakeup(m_multi);
+    }
+
+    return future;
+}
+
+void chatGPT::SetMaxConcurrency(const size_t maxConcurrency){
+    m_maxConcurrency = std::max<size_t>(1, maxConcurrency);
+
+    if (nullptr != m_multi){
+        curl_multi_wakeup(m_multi);
+    }
+}
+
+void chatGPT::SetRateLimits(const std::string_view model, const size_t requestsPerMinute, const size_t tokensPerMinute){
+    std::lock_guard lock(m_dispatchQMtx);
+    m_scheduler.SetLimits(model, requestsPerMinute, tokensPerMinute);
+
+    if (nullptr != m_multi){
+        curl_multi_wakeup(m_multi);
+    }
+}
+
+void chatGPT::SetRetryPolicy(const size_t maxRetries, const std::chrono::milliseconds baseDelay, const std::chrono::milliseconds maxDelay){
+    m_maxRetries     = maxRetries;
+    m_retryBaseDelay = std::max(baseDelay, std::chrono::milliseconds(1));
+    m_retryMaxDelay  = std::max(maxDelay, baseDelay);
+}
+
+void chatGPT::HandleQueue(void){
+    while(true){
+        // start as many queued requests as there's room for and the rate limits allow
+        std::vector<std::shared_ptr<chatGPTDispatchRequest>> toStart;
+        std::vector<std::shared_ptr<chatGPTDispatchRequest>> expired;
+
+        std::unique_lock lock(m_dispatchQMtx);
+        if (m_shutDown){
+            break;
+        }
+
+        const auto now  = std::chrono::steady_clock::now();
+        auto nextEvent  = std::chrono::steady_clock::time_point::max();
+
+        // retries that have waited out their backoff get back in line
+        while (!m_retries.empty() && m_retries.begin()->first <= now){
+            std::shared_ptr<chatGPTDispatchRequest> retry = std::move(m_retries.begin()->second);
+            m_retries.erase(m_retries.begin());
+
+            m_scheduler.Push(scheduledRequest(retry->scheduling));
+            m_dispatchQ.emplace(retry->scheduling.id, std::move(retry));
+        }
+
+        if (!m_retries.empty()){
+            nextEvent = m_retries.begin()->first;
+        }
+
+        for (const auto& scheduling : m_scheduler.TakeExpired(now)){
+            auto node = m_dispatchQ.extract(scheduling.id);
+            expired.push_back(std::move(node.mapped()));
+        }
+
+        while(m_transfers.size() + toStart.size() < m_maxConcurrency){
+            std::optional<scheduledRequest> next = m_scheduler.Pop(now);
+            if (!next){
+                break;
+            }
+
+            auto node = m_dispatchQ.extract(next->id);
+            toStart.push_back(std::move(node.mapped()));
+        }
+
+        // a hedged request that's slower to answer than the model usually is gets a second copy
+        for (const auto& request : toStart){
+            const auto hedgeDelay = HedgeDelay(*request);
+            if (hedgeDelay.count() > 0){
+                nextEvent = std::min(nextEvent, now + hedgeDelay);
+            }
+        }
+
+        for (const auto& [curl, transfer] : m_transfers){
+            auto& request = transfer->request;
+
+            const auto hedgeDelay = HedgeDelay(*request);
+            if (0 == hedgeDelay.count()){
+                continue;
+            }
+
+            const auto hedgeAt = transfer->startedAt + hedgeDelay;
+            if (hedgeAt > now){
+                nextEvent = std::min(nextEvent, hedgeAt);
+            }
+            else if (m_transfers.size() + toStart.size() < m_maxConcurrency && m_scheduler.TrySend(request->scheduling, now)){
+                request->hedged = true;
+                toStart.push_back(request);
+            }
+        }
+
+        // with room to spare, wake up when the limits let the next request through
+        if (m_transfers.size() + toStart.size() < m_maxConcurrency){
+            nextEvent = std::min(nextEvent, m_scheduler.NextEvent(now));
+        }
+        else{
+            nextEvent = std::min(nextEvent, m_scheduler.NextDeadline());
+        }
+
+        if (!expired.empty()){
+            m_numExpired += expired.size();
+            APATE_LOG_WARN("Dropped '{}' OpenAI requests that waited too long in the queue, '{}' so far",
+                           expired.size(),
+                           m_numExpired);
+        }
+        lock.unlock();
+
+        for (auto& request : expired){
+            chatGPTResponse response;
+            response.HTTPCode              = CURLE_OPERATION_TIMEDOUT;
+            response.status                = "expired";
+            response.responseFailureReason = "Dropped after waiting too long in the queue";
+            request->promise.set_value(std::move(response));
+        }
+
+        for (auto& request : toStart){
+            StartTransfer(std::move(request));
+        }
+
+        int running = 0;
+        curl_multi_perform(m_multi, &running);
+
+        bool finished = false;
+        int  pending  = 0;
+        while (CURLMsg* msg = curl_multi_info_read(m_multi, &pending)){
+            if (CURLMSG_DONE == msg->msg){
+                FinishTransfer(msg->easy_handle, msg->data.result);
+                finished = true;
+            }
+        }
+
+        DropClaimedCopies();
+
+        // a finished request may have made room for a queued one
+        if (!finished){
+            int timeoutMs = DISPATCH_POLL_MS;
+            if (nextEvent != std::chrono::steady_clock::time_point::max()){
+                const auto untilNext = std::chrono::ceil<std::chrono::milliseconds>(nextEvent - std::chrono::steady_clock::now());
+                timeoutMs = (int)std::clamp<long long>(untilNext.count(), 0, DISPATCH_POLL_MS);
+            }
+
+            // sleeps until a socket is ready, the next queued request is due, or AskChatGPTAsync wakes it up
+            curl_multi_poll(m_multi, NULL, 0, timeoutMs, NULL);
+        }
+    }
+
+    // clear out the queue and send a status code any threads waiting on a promise
+    std::lock_guard lock(m_dispatchQMtx);
+
+    // both copies of a hedged request share its promise
+    std::vector<std::shared_ptr<chatGPTDispatchRequest>> unanswered;
+
+    for (auto& [curl, transfer] : m_transfers){
+        curl_multi_remove_handle(m_multi, curl);
+        m_idleHandles.push_back(curl);
+
+        if (std::find(unanswered.begin(), unanswered.end(), transfer->request) == unanswered.end()){
+            unanswered.push_back(transfer->request);
+        }
+    }
+    m_transfers.clear();
+
+    for (auto& [retryAt, request] : m_retries){
+        unanswered.push_back(request);
+    }
+    m_retries.clear();
+
+    m_scheduler.TakeAll();
+    for (auto& [id, request] : m_dispatchQ){
+        unanswered.push_back(request);
+    }
+    m_dispatchQ.clear();
+
+    for (auto& request : unanswered){
+        chatGPTResponse response;
+
+        response.HTTPCode = CURLE_RECV_ERROR;
+        request->promise.set_value(response);
+    }
+}
+
+void chatGPT::StartTransfer(std::shared_ptr<chatGPTDispatchRequest> request){
+    auto transfer = std::make_unique<chatGPTTransfer>();
+    transfer->request   = std::move(request);
+    transfer->startedAt = std::chrono::steady_clock::now();
+
+    // the other copy of a hedged request is still on the wire and will answer it
+    const bool otherCopy = (transfer->request->transfers > 0);
+
+    if (!m_idleHandles.empty()){
+        transfer->curl = m_idleHandles.back();
+        m_idleHandles.pop_back();
+    }
+    else if ((transfer->curl = curl_easy_init()) == nullptr){
+        if (!otherCopy){
+            chatGPTResponse response;
+            response.HTTPCode = CURLE_FAILED_INIT;
+            transfer->request->promise.set_value(std::move(response));
+        }
+        return;
+    }
+
+    CURL* curl = transfer->curl;
+    curl_easy_setopt(curl, CURLOPT_URL, openAI_API_URL);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, transfer->request->body.c_str ());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, transfer->request->body.size ());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, m_headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, transfer->request->onText ? CurlWriteStream : CurlWriteResponse);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, transfer.get());
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, CurlHeader);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, transfer.get());
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    CURLMcode rc = CURLM_OK;
+    if ((rc = curl_multi_add_handle(m_multi, curl)) != CURLM_OK){
+        APATE_LOG_WARN("curl_multi_add_handle failed - {}", curl_multi_strerror(rc));
+
+        m_idleHandles.push_back(curl);
+
+        if (!otherCopy){
+            chatGPTResponse response;
+            response.HTTPCode = CURLE_FAILED_INIT;
+            transfer->request->promise.set_value(std::move(response));
+        }
+        return;
+    }
+
+    transfer->request->transfers++;
+    m_transfers.emplace(curl, std::move(transfer));
+}
+
+void chatGPT::FinishTransfer(CURL* curl, const CURLcode result){
+    auto it = m_transfers.find(curl);
+    if (it == m_transfers.end()){
+        APATE_LOG_WARN("Finished a request that isn't being tracked");
+        return;
+    }
+
+    std::unique_ptr<chatGPTTransfer> transfer = std::move(it->second);
+    m_transfers.erase(it);
+
+    curl_multi_remove_handle(m_multi, curl);
+    m_idleHandles.push_back(curl);
+
+    auto& request = transfer->request;
+    request->transfers--;
+
+    // the other copy heard back first, or failed copies leave it to the one still going, which settles
+    if (!transfer->claimed && (request->claimed || request->transfers > 0)){
+        std::lock_guard lock(m_dispatchQMtx);
+        m_scheduler.Refund(request->scheduling.model, request->scheduling.tokens);
+        return;
+    }
+
+    // the twin has lost, and has to be gone before a retry could make the request claimable again
+    if (transfer->claimed){
+        DropClaimedCopies();
+    }
+
+    // stopped transfers count too, streaming prefilters are stopped as soon as they've decided
+    if (transfer->claimed && transfer->firstByteAt > transfer->startedAt){
+        RecordFirstByte(request->scheduling.model, std::chrono::duration_cast<std::chrono::milliseconds>(transfer->firstByteAt - transfer->startedAt));
+    }
+
+    chatGPTResponse chatGPTResponse;
+
+    if (transfer->stopped){
+        // aborting the transfer is how it was stopped, not an error
+        chatGPTOutputMessage message;
+        message.message = transfer->streamedText;
+
+        chatGPTResponse.HTTPCode     = CURLE_OK;
+        chatGPTResponse.status       = "stopped";
+        chatGPTResponse.stoppedEarly = true;
+        chatGPTResponse.responseOK   = true;
+        chatGPTResponse.outputs.push_back({ OUTPUT_MESSAGE, message });
+
+        request->promise.set_value(std::move(chatGPTResponse));
+        return;
+    }
+
+    if((chatGPTResponse.HTTPCode = result) == CURLE_OK){
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &chatGPTResponse.HTTPStatus);
+
+        try{
+            if (!request->onText || !transfer->sawEvent){
+                // errors come back as plain json even when streaming was asked for
+                nlohmann::json jsonResponse = nlohmann::json::parse(transfer->response);
+                chatGPTResponse.Put(jsonResponse);
+            }
+            else if (!transfer->finalResponse.is_null()){
+                chatGPTResponse.Put(transfer->finalResponse);
+            }
+            else{
+                APATE_LOG_WARN("Response stream ended without a final response");
+                chatGPTResponse.responseOK = false;
+            }
+        }
+        catch (...){
+            chatGPTResponse.responseOK = false;
+        }
+    }
+
+    const scheduledRequest& scheduling = request->scheduling;
+    const auto              now        = std::chrono::steady_clock::now();
+
+    std::unique_lock lock(m_dispatchQMtx);
+    m_scheduler.Settle(scheduling.model, scheduling.tokens, chatGPTResponse.totalTokens);
+
+    if (429 == chatGPTResponse.HTTPStatus){
+        const auto pause = (transfer->retryAfter.count() > 0) ? transfer->retryAfter : std::chrono::duration_cast<std::chrono::milliseconds>(RATE_LIMITED_PAUSE);
+
+        APATE_LOG_WARN("OpenAI rate limited '{}', holding its requests back for {}", scheduling.model, pause);
+        m_scheduler.Pause(scheduling.model, now + pause);
+    }
+    lock.unlock();
+
+    if (ShouldRetry(*transfer, chatGPTResponse) && request->attempts < m_maxRetries){
+        const auto delay = RetryDelay(request->attempts, transfer->retryAfter);
+
+        // no point waiting out a backoff the request would expire during
+        if (now + delay < scheduling.deadline){
+            APATE_LOG_DEBUG("Retrying OpenAI request in {} after attempt '{}' failed with curl code '{}', HTTP status '{}'",
+                            delay,
+                            request->attempts + 1,
+                            (int)chatGPTResponse.HTTPCode,
+                            chatGPTResponse.HTTPStatus);
+
+            request->attempts++;
+            request->claimed = false;
+            request->hedged  = false;
+            m_retries.emplace(now + delay, request);
+            return;
+        }
+    }
+
+    request->promise.set_value(std::move(chatGPTResponse));
+}
+
+void chatGPT::DropClaimedCopies(void){
+    for (auto it = m_transfers.begin(); it != m_transfers.end();){
+        chatGPTTransfer& transfer = *it->second;
+
+        if (transfer.request->claimed && !transfer.claimed){
+            curl_multi_remove_handle(m_multi, it->first);
+            m_idleHandles.push_back(it->first);
+
+            // only the copy that claimed it settles, this one's charge goes back
+            std::lock_guard lock(m_dispatchQMtx);
+            m_scheduler.Refund(transfer.request->scheduling.model, transfer.request->scheduling.tokens);
+
+            transfer.request->transfers--;
+            it = m_transfers.erase(it);
+        }
+        else{
+            ++it;
+        }
+    }
+}
+
+bool chatGPT::ShouldRetry(const chatGPTTransfer& transfer, const chatGPTResponse& response){
+    // text already handed to the stream callback can't be taken back
+    if (transfer.stopped || !transfer.streamedText.empty()){
+        return false;
+    }
+
+    switch (response.HTTPCode){
+    case CURLE_OK:
+        break;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
+    }
+
+    switch (response.HTTPStatus){
+    case 429:
+        // out of credit isn't going to change in a few seconds
+        return (response.responseFailureReason.find("insufficient_quota") == std::string::npos);
+    case 408:
+    case 409:
+    case 500:
+    case 502:
+    case 503:
+    case 504:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::chrono::milliseconds chatGPT::RetryDelay(const size_t attempt, const std::chrono::milliseconds retryAfter){
+    const std::chrono::milliseconds baseDelay = m_retryBaseDelay;
+    const std::chrono::milliseconds maxDelay  = m_retryMaxDelay;
+
+    // doubles every attempt, and somewhere in its upper half so retries from many requests don't line up
+    const long long backoff = std::min<long long>(maxDelay.count(), baseDelay.count() << std::min<size_t>(attempt, 20));
+    std::uniform_int_distribution<long long> jitter(backoff / 2, backoff);
+
+    return std::max(std::chrono::milliseconds(jitter(m_jitter)), retryAfter);
+}
+
+std::chrono::milliseconds chatGPT::HedgeDelay(const chatGPTDispatchRequest& request) const{
+    if (!m_hedging || !request.hedge || request.hedged || request.claimed){
+        return std::chrono::milliseconds(0);
+    }
+
+    auto latency = m_firstByteLatency.find(request.scheduling.model);
+    return (latency == m_firstByteLatency.end()) ? std::chrono::milliseconds(0) : latency->second.p95;
+}
+
+void chatGPT::RecordFirstByte(const std::string& model, const std::chrono::milliseconds latency){
+    latencyWindow& window = m_firstByteLatency[model];
+
+    window.samples.push_back(latency);
+    if (window.samples.size() > LATENCY_WINDOW_SAMPLES){
+        window.samples.pop_front();
+    }
+
+    // too few to tell what's slow, don't hedge yet
+    if (window.samples.size() < MIN_HEDGE_SAMPLES){
+        return;
+    }
+
+    std::vector<std::chrono::milliseconds> sorted(window.samples.begin(), window.samples.end());
+    const size_t p95 = sorted.size() * 95 / 100;
+
+    std::nth_element(sorted.begin(), sorted.begin() + p95, sorted.end());
+    window.p95 = sorted[p95];
+}
+
+bool chatGPT::Claim(chatGPTTransfer& transfer){
+    if (transfer.claimed){
+        return true;
+    }
+
+    if (transfer.request->claimed){
+        return false;
+    }
+
+    transfer.request->claimed = true;
+    transfer.claimed          = true;
+    transfer.firstByteAt      = std::chrono::steady_clock::now();
+    return true;
+}
+
+size_t chatGPT::CurlWriteResponse(void* contents, size_t size, size_t nmemb, chatGPTTransfer* transfer){
+    const size_t totalSize = size * nmemb;
+
+    if (!Claim(*transfer)){
+        return 0;
+    }
+
+    transfer->response.append((char*)contents, totalSize);
+    return totalSize;
+}
+
+size_t chatGPT::CurlHeader(char* buffer, size_t size, size_t nitems, chatGPTTransfer* transfer){
+    const size_t totalSize = size * nitems;
+
+    std::string_view header(buffer, totalSize);
+    const size_t colon = header.find(':');
+
+    if (colon != std::string_view::npos){
+        const std::string name = ToLowercase(header.substr(0, colon));
+
+        std::string_view value = header.substr(colon + 1);
+        while (!value.empty() && std::isspace((unsigned char)value.front())){
+            value.remove_prefix(1);
+        }
+
+        // only the delay in seconds form, the http-date one isn't worth parsing here
+        long long amount = 0;
+        const bool numeric = (!value.empty() && std::isdigit((unsigned char)value.front()));
+        if (numeric){
+            std::from_chars(value.data(), value.data() + value.size(), amount);
+        }
+
+        if (numeric && name == "retry-after-ms"){
+            transfer->retryAfter = std::chrono::milliseconds(amount);
+        }
+        else if (numeric && name == "retry-after" && 0 == transfer->retryAfter.count()){
+            transfer->retryAfter = std::chrono::seconds(amount);
+        }
+    }
+
+    return totalSize;
+}
+
+size_t chatGPT::CurlWriteStream(void* contents, size_t size, size_t nmemb, chatGPTTransfer* transfer){
+    const size_t totalSize = size * nmemb;
+
+    if (transfer->stopped || !Claim(*transfer)){
+        return 0;
+    }
+
+    // events are separated by a blank line, carriage returns only get in the way of finding it
+    std::string& buffer = transfer->response;
+    for (const char c : std::string_view((const char*)contents, totalSize)){
+        if (c != '\r'){
+            buffer.push_back(c);
+        }
+    }
+
+    size_t consumed = 0;
+    size_t eventEnd = std::string::npos;
+    while ((eventEnd = buffer.find("\n\n", consumed)) != std::string::npos){
+        const std::string_view event(buffer.data() + consumed, eventEnd - consumed);
+        consumed = eventEnd + 2;
+
+        // only data lines matter, the event name is repeated in the payload's type
+        std::string data;
+        size_t lineBegin = 0;
+        while (lineBegin < event.size()){
+            size_t lineEnd = event.find('\n', lineBegin);
+            if (lineEnd == std::string_view::npos){
+                lineEnd = event.size();
+            }
+
+            std::string_view line = event.substr(lineBegin, lineEnd - lineBegin);
+            if (line.starts_with("data:")){
+                line.remove_prefix(5);
+                if (line.starts_with(' ')){
+                    line.remove_prefix(1);
+                }
+
+                if (!data.empty()){
+                    data.push_back('\n');
+                }
+                data += line;
+            }
+            lineBegin = lineEnd + 1;
+        }
+
+        if (!data.empty() && data != "[DONE]"){
+            transfer->sawEvent = true;
+
+            bool keepGoing = true;
+            try{
+                keepGoing = HandleStreamEvent(*transfer, data);
+            }
+            catch (const std::exception& e){
+                APATE_LOG_WARN("Failed to handle stream event - {}", e.what());
+            }
+
+            if (!keepGoing){
+                transfer->stopped = true;
+                return 0;
+            }
+        }
+    }
+
+    buffer.erase(0, consumed);
+    return totalSize;
+}
+
+bool chatGPT::HandleStreamEvent(chatGPTTransfer& transfer, const std::string_view data){
+    nlohmann::json event = nlohmann::json::parse(data, nullptr, false);
+    if (event.is_discarded() || !event.contains("type")){
+        APATE_LOG_DEBUG("Skipping unparseable stream event: {}", data);
+        return true;
+    }
+
+    const std::string type = event["type"].get<std::string>();
+
+    if (type == "response.output_text.delta"){
+        const std::string delta = event.value("delta", "");
+        transfer.streamedText += delta;
+
+        if (transfer.request->onText){
+            return transfer.request->onText(delta, transfer.streamedText);
+        }
+    }
+    else if (type == "response.completed" || type == "response.failed" || type == "response.incomplete"){
+        if (event.contains("response")){
+            transfer.finalResponse = std::move(event["response"]);
+        }
+    }
+    else if (type == "error"){
+        transfer.finalResponse          = nlohmann::json::object();
+        transfer.finalResponse["error"] = { { "code",   event.value("code", "") },
+                                            { "reason", event.value("message", "") } };
+    }
+
+    return true;
+}
+
+
 }
\ No newline at end of file
@@ -1,17 +1,26 @@
 #ifndef OPENAI_HPP
 #define OPENAI_HPP
 
+#include "chatgptscheduler.hpp"
+#include "tokencounter.hpp"
+
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
 
 #include <atomic>
-#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <future>
+#include <map>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <mutex>
-#include <queue>
+#include <random>
 #include <thread>
 #include <variant>
+#include <vector>
 
 namespace openai{
 
@@ -53,7 +62,20 @@ struct chatGPTPrompt{
     std::vector<chatGPTMessage> history;
     std::string request;
 
-    nlohmann::json JsonRequest(void) const;
+    // 0 leaves it to the model. The API won't take less than 16.
+    size_t maxOutputTokens = 0;
+
+    // how the request is queued behind the rate limits. Requests are shared out fairly between tenants,
+    // the bot uses guild ids. A request still queued after queueTimeout is dropped, 0 waits for good.
+    requestPriority           priority     = REQUEST_PRIORITY_RESPONSE;
+    uint64_t                  tenantId     = 0;
+    std::chrono::milliseconds queueTimeout = std::chrono::milliseconds(0);
+
+    // latency critical and cheap enough to send twice if the first copy is slower than usual to answer
+    bool hedge = false;
+
+    // the request body, written straight into body so its capacity can be reused
+    void WriteJsonRequest(std::string& body, const bool stream) const;
 };
 
 
@@ -83,6 +105,7 @@ struct chatGPTOutputItem{
 struct chatGPTResponse{
 
     CURLcode HTTPCode = CURLE_OK;
+    long HTTPStatus   = 0;
     bool responseOK   = false;
     std::string status;
     std::string responseFailureReason;
@@ -96,13 +119,33 @@ struct chatGPTResponse{
     size_t outputTokens = 0;
     size_t totalTokens = 0;
 
+    // a stream callback cut the response short, outputs hold the text up to that point
+    bool stoppedEarly = false;
+
     void Put(const nlohmann::json& json);
 
 };
 
+// called from the dispatcher thread as a streamed response arrives, so keep it quick. delta is the
+// newly arrived text and text everything so far. Returning false stops the response there.
+typedef std::function<bool(const std::string_view delta, const std::string& text)> chatGPTStreamCallback;
+
 struct chatGPTDispatchRequest{
     std::promise<chatGPTResponse> promise;
-    nlohmann::json                json;
+    chatGPTStreamCallback         onText;
+
+    // serialized once, every transfer of the request (retries, hedged copies) posts it as it is
+    std::string                   body;
+
+    // its place in the queue, and the token estimate the model was charged
+    scheduledRequest              scheduling;
+
+    // dispatcher state. A hedged request is on the wire twice, the first copy to hear back claims it.
+    bool   hedge     = false;
+    bool   hedged    = false;
+    bool   claimed   = false;
+    size_t attempts  = 0;
+    size_t transfers = 0;
 };
 
 class chatGPT{
@@ -113,25 +156,113 @@ public:
     chatGPT& operator=(const chatGPT&)  = delete;
     chatGPT& operator=(const chatGPT&&) = delete;
 
-    chatGPT(const std::string_view& openAIKey);
+    // up to maxConcurrency requests are in flight at once, sharing connections where the server allows
+    chatGPT(const std::string_view& openAIKey, const size_t maxConcurrency = 8);
     ~chatGPT();
 
     std::future<chatGPTResponse> AskChatGPTAsync (const chatGPTPrompt& prompt);
 
-private:
+    // the response is streamed and onText sees the text as it arrives. The future completes with the
+    // whole response as AskChatGPTAsync would, or with the text so far if onText stopped it.
+    std::future<chatGPTResponse> AskChatGPTStreamAsync (const chatGPTPrompt& prompt, chatGPTStreamCallback onText);
+
+    void SetMaxConcurrency(const size_t maxConcurrency);
+
+    // requests and tokens per minute for a model, 0 for no limit
+    void SetRateLimits(const std::string_view model, const size_t requestsPerMinute, const size_t tokensPerMinute);
 
+    // transient failures are retried up to maxRetries times, backing off exponentially from baseDelay
+    // up to maxDelay with jitter, or as long as the API's Retry-After asks
+    void SetRetryPolicy(const size_t maxRetries, const std::chrono::milliseconds baseDelay, const std::chrono::milliseconds maxDelay);
+
+    // hedged prompts get a second copy sent once the first has waited longer than the model's p95 to answer
+    void SetHedging(const bool enabled) { m_hedging = enabled; }
+
+    // a tiktoken vocabulary for counting prompt tokens, load it before asking anything. Without one
+    // counts are estimates.
+    bool   LoadTokenizer(const std::filesystem::path& vocabPath) { return m_tokenCounter.Load(vocabPath); }
+    size_t CountTokens(const std::string_view text) const { return m_tokenCounter.Count(text); }
+
+private:
+    // a request on the multi handle, owned by the dispatcher until it completes
+    struct chatGPTTransfer{
+        std::shared_ptr<chatGPTDispatchRequest> request;
+        std::string                             response;
+        CURL*                                   curl = nullptr;
+
+        std::chrono::steady_clock::time_point   startedAt;
+        std::chrono::steady_clock::time_point   firstByteAt;
+        std::chrono::milliseconds               retryAfter = std::chrono::milliseconds(0);
+
+        // this copy heard back first and answers the request, the other copy is dropped
+        bool                                    claimed = false;
+
+        // streaming only. response holds server sent events that haven't been handled yet.
+        std::string            streamedText;
+        nlohmann::json         finalResponse;
+        bool                   sawEvent = false;
+        bool                   stopped  = false;
+    };
+
+    // first byte of (a copy of) a response. False if the other copy already claimed it.
+    static bool   Claim(chatGPTTransfer& transfer);
+    static size_t CurlWriteResponse(void* contents, size_t size, size_t nmemb, chatGPTTransfer* transfer);
+    static size_t CurlWriteStream(void* contents, size_t size, size_t nmemb, chatGPTTransfer* transfer);
+    static size_t CurlHeader(char* buffer, size_t size, size_t nitems, chatGPTTransfer* transfer);
+
+    static bool ShouldRetry(const chatGPTTransfer& transfer, const chatGPTResponse& response);
+
+    // false once the stream callback asks to stop
+    static bool HandleStreamEvent(chatGPTTransfer& transfer, const std::string_view data);
+
+    // all requests run on one thread, driven by the multi handle
     void HandleQueue(void);
+    std::future<chatGPTResponse> Enqueue(chatGPTDispatchRequest&& request, const chatGPTPrompt& prompt);
+    void StartTransfer(std::shared_ptr<chatGPTDispatchRequest> request);
+    void FinishTransfer(CURL* curl, const CURLcode result);
+    void DropClaimedCopies(void);
+
+    std::chrono::milliseconds RetryDelay(const size_t attempt, const std::chrono::milliseconds retryAfter);
+    std::chrono::milliseconds HedgeDelay(const chatGPTDispatchRequest& request) const;  // 0 if it won't be hedged
+    void                      RecordFirstByte(const std::string& model, const std::chrono::milliseconds latency);
+
+    std::string  m_openAI_Key;
+    tokenCounter m_tokenCounter;
 
-    std::string m_openAI_Key;
+    CURLM*             m_multi   = nullptr;
+    struct curl_slist* m_headers = nullptr;
 
-    CURL*       m_curl = nullptr;
+    // only touched by the dispatcher. Idle handles are reused for the next request.
+    std::map<CURL*, std::unique_ptr<chatGPTTransfer>> m_transfers;
+    std::vector<CURL*>                                m_idleHandles;
+
+    // also the dispatcher's. Failed requests wait here out their backoff, and recent first byte
+    // latencies per model decide when a hedged request gets its second copy.
+    struct latencyWindow{
+        std::deque<std::chrono::milliseconds> samples;
+        std::chrono::milliseconds             p95 = std::chrono::milliseconds(0);
+    };
+
+    std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<chatGPTDispatchRequest>> m_retries;
+    std::map<std::string, latencyWindow>                                                          m_firstByteLatency;
+    std::mt19937                                                                                  m_jitter{ std::random_device{}() };
+
+    std::atomic<size_t>                    m_maxRetries     = 3;
+    std::atomic<std::chrono::milliseconds> m_retryBaseDelay = std::chrono::milliseconds(500);
+    std::atomic<std::chrono::milliseconds> m_retryMaxDelay  = std::chrono::milliseconds(20000);
+    std::atomic<bool>                      m_hedging        = true;
+
+    std::atomic<size_t>              m_maxConcurrency = 8;
 
-    // to do, use a thread pool?
     std::thread                      m_dispatcher;
-    std::condition_variable          m_dispatchQCV;
-    std::queue<chatGPTDispatchRequest> m_dispatchQ;
     std::mutex                       m_dispatchQMtx;
 
+    // queued requests by id, m_scheduler decides which goes next
+    std::map<uint64_t, std::shared_ptr<chatGPTDispatchRequest>> m_dispatchQ;
+    requestScheduler                                            m_scheduler;
+    uint64_t                                                    m_nextRequestId = 0;
+    size_t                                                      m_numExpired    = 0;
+
     std::atomic<bool>                m_shutDown = false;
 };
 }
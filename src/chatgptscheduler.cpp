@@ -0,0 +1,273 @@
+#include "chatgptscheduler.hpp"
+
+#include "log/log.hpp"
+
+#include <iterator>
+#include <set>
+
+// buckets hold this share of a minute's budget, the provider doesn't take a whole minute's worth at once
+static const double BURST_FRACTION = 1.0 / 6.0;
+
+namespace openai{
+
+tokenBucket::tokenBucket(const double capacity, const double ratePerSecond) :
+    m_capacity      (capacity),
+    m_ratePerSecond (ratePerSecond),
+    m_tokens        (capacity){
+}
+
+void tokenBucket::Refill(const std::chrono::steady_clock::time_point now){
+    if(now <= m_lastRefill){
+        return;
+    }
+
+    const double elapsed = std::chrono::duration<double>(now - m_lastRefill).count();
+    m_tokens     = std::min(m_capacity, m_tokens + elapsed * m_ratePerSecond);
+    m_lastRefill = now;
+}
+
+bool tokenBucket::CanTake(const double amount, const std::chrono::steady_clock::time_point now){
+    if(!Limited()){
+        return true;
+    }
+
+    Refill(now);
+
+    // more than the bucket holds goes out once it's full and leaves it in debt
+    return m_tokens >= std::min(amount, m_capacity);
+}
+
+void tokenBucket::Take(const double amount){
+    if(Limited()){
+        m_tokens -= amount;
+    }
+}
+
+std::chrono::steady_clock::time_point tokenBucket::Available(const double amount, const std::chrono::steady_clock::time_point now){
+    if(CanTake(amount, now)){
+        return now;
+    }
+
+    const double missing = std::min(amount, m_capacity) - m_tokens;
+    return now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(missing / m_ratePerSecond));
+}
+
+void requestScheduler::SetLimits(const std::string_view model, const size_t requestsPerMinute, const size_t tokensPerMinute){
+    modelLimits limits;
+
+    if(requestsPerMinute > 0){
+        limits.requests = tokenBucket(std::max(1.0, requestsPerMinute * BURST_FRACTION), requestsPerMinute / 60.0);
+    }
+
+    if(tokensPerMinute > 0){
+        limits.tokens = tokenBucket(tokensPerMinute * BURST_FRACTION, tokensPerMinute / 60.0);
+    }
+
+    auto it = m_limits.find(model);
+    if(it == m_limits.end()){
+        m_limits.emplace(std::string(model), std::move(limits));
+    }
+    else{
+        it->second = std::move(limits);
+    }
+
+    APATE_LOG_INFO("Rate limits for '{}': '{}' requests and '{}' tokens per minute",
+                   model,
+                   requestsPerMinute,
+                   tokensPerMinute);
+}
+
+void requestScheduler::Push(scheduledRequest&& toQueue){
+    priorityClass& queue = m_classes[toQueue.priority];
+
+    auto& tenant = queue.tenants[toQueue.tenantId];
+    if(tenant.empty()){
+        queue.turns.push_back(toQueue.tenantId);
+    }
+
+    tenant.push_back(std::move(toQueue));
+    m_numQueued++;
+}
+
+bool requestScheduler::CanSend(const scheduledRequest& candidate, const std::chrono::steady_clock::time_point now){
+    auto it = m_limits.find(candidate.model);
+    if(it == m_limits.end()){
+        return true;
+    }
+
+    modelLimits& limits = it->second;
+    return (now >= limits.pausedUntil && limits.requests.CanTake(1.0, now) && limits.tokens.CanTake((double)candidate.tokens, now));
+}
+
+std::optional<scheduledRequest> requestScheduler::Pop(const std::chrono::steady_clock::time_point now){
+    // a request held back by its model's limits holds back everything after it for that model,
+    // otherwise a stream of small requests could keep a big one waiting forever
+    std::set<std::string, std::less<>> blockedModels;
+
+    for(priorityClass& queue : m_classes){
+        for(size_t turn = 0; turn < queue.turns.size(); turn++){
+            const uint64_t tenantId = queue.turns[turn];
+            auto&          tenant   = queue.tenants[tenantId];
+
+            const scheduledRequest& head = tenant.front();
+            if(blockedModels.contains(head.model)){
+                continue;
+            }
+
+            if(!CanSend(head, now)){
+                blockedModels.insert(head.model);
+                continue;
+            }
+
+            scheduledRequest next = std::move(tenant.front());
+            tenant.pop_front();
+            m_numQueued--;
+
+            if(auto it = m_limits.find(next.model); it != m_limits.end()){
+                it->second.requests.Take(1.0);
+                it->second.tokens.Take((double)next.tokens);
+            }
+
+            // the tenant goes to the back of the line
+            queue.turns.erase(queue.turns.begin() + turn);
+            if(tenant.empty()){
+                queue.tenants.erase(tenantId);
+            }
+            else{
+                queue.turns.push_back(tenantId);
+            }
+
+            return next;
+        }
+    }
+
+    return std::nullopt;
+}
+
+bool requestScheduler::TrySend(const scheduledRequest& request, const std::chrono::steady_clock::time_point now){
+    if(!CanSend(request, now)){
+        return false;
+    }
+
+    if(auto it = m_limits.find(request.model); it != m_limits.end()){
+        it->second.requests.Take(1.0);
+        it->second.tokens.Take((double)request.tokens);
+    }
+    return true;
+}
+
+std::vector<scheduledRequest> requestScheduler::TakeExpired(const std::chrono::steady_clock::time_point now){
+    std::vector<scheduledRequest> expired;
+
+    for(priorityClass& queue : m_classes){
+        for(auto it = queue.tenants.begin(); it != queue.tenants.end();){
+            auto& tenant = it->second;
+
+            for(auto request = tenant.begin(); request != tenant.end();){
+                if(request->deadline <= now){
+                    expired.push_back(std::move(*request));
+                    request = tenant.erase(request);
+                    m_numQueued--;
+                }
+                else{
+                    ++request;
+                }
+            }
+
+            if(tenant.empty()){
+                std::erase(queue.turns, it->first);
+                it = queue.tenants.erase(it);
+            }
+            else{
+                ++it;
+            }
+        }
+    }
+
+    return expired;
+}
+
+std::vector<scheduledRequest> requestScheduler::TakeAll(void){
+    std::vector<scheduledRequest> all;
+    all.reserve(m_numQueued);
+
+    for(priorityClass& queue : m_classes){
+        for(auto& [tenantId, tenant] : queue.tenants){
+            std::move(tenant.begin(), tenant.end(), std::back_inserter(all));
+        }
+
+        queue.tenants.clear();
+        queue.turns.clear();
+    }
+
+    m_numQueued = 0;
+    return all;
+}
+
+void requestScheduler::Settle(const std::string_view model, const size_t estimatedTokens, const size_t usedTokens){
+    auto it = m_limits.find(model);
+    if(it == m_limits.end() || 0 == usedTokens){
+        return;
+    }
+
+    it->second.tokens.Adjust((double)usedTokens - (double)estimatedTokens);
+}
+
+void requestScheduler::Refund(const std::string_view model, const size_t estimatedTokens){
+    auto it = m_limits.find(model);
+    if(it == m_limits.end()){
+        return;
+    }
+
+    it->second.tokens.Adjust(-(double)estimatedTokens);
+}
+
+void requestScheduler::Pause(const std::string_view model, const std::chrono::steady_clock::time_point until){
+    auto it = m_limits.find(model);
+    if(it == m_limits.end()){
+        it = m_limits.emplace(std::string(model), modelLimits{}).first;
+    }
+
+    it->second.pausedUntil = std::max(it->second.pausedUntil, until);
+}
+
+std::chrono::steady_clock::time_point requestScheduler::NextEvent(const std::chrono::steady_clock::time_point now){
+    auto next = std::chrono::steady_clock::time_point::max();
+
+    for(priorityClass& queue : m_classes){
+        for(auto& [tenantId, tenant] : queue.tenants){
+            for(const auto& request : tenant){
+                next = std::min(next, request.deadline);
+            }
+
+            const scheduledRequest& head = tenant.front();
+
+            auto it = m_limits.find(head.model);
+            if(it == m_limits.end()){
+                return now;
+            }
+
+            modelLimits& limits = it->second;
+            next = std::min(next, std::max({ limits.pausedUntil,
+                                             limits.requests.Available(1.0, now),
+                                             limits.tokens.Available((double)head.tokens, now) }));
+        }
+    }
+
+    return next;
+}
+
+std::chrono::steady_clock::time_point requestScheduler::NextDeadline(void) const{
+    auto next = std::chrono::steady_clock::time_point::max();
+
+    for(const priorityClass& queue : m_classes){
+        for(const auto& [tenantId, tenant] : queue.tenants){
+            for(const auto& request : tenant){
+                next = std::min(next, request.deadline);
+            }
+        }
+    }
+
+    return next;
+}
+}
@@ -0,0 +1,121 @@
+#ifndef CHATGPTSCHEDULER_HPP
+#define CHATGPTSCHEDULER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace openai{
+
+// requests of a higher class always go first, the prefilter can wait on a reply that's already decided
+enum requestPriority{
+    REQUEST_PRIORITY_RESPONSE,
+    REQUEST_PRIORITY_PREFILTER,
+    REQUEST_PRIORITY_COUNT
+};
+
+// Refills at ratePerSecond up to capacity. Taking may leave it negative, which is how a request bigger
+// than the whole bucket still gets through once the debt is paid off.
+class tokenBucket{
+public:
+    tokenBucket(void) = default;
+    tokenBucket(const double capacity, const double ratePerSecond);
+
+    bool Limited(void) const { return m_ratePerSecond > 0.0; }
+
+    bool CanTake(const double amount, const std::chrono::steady_clock::time_point now);
+    void Take(const double amount);
+
+    // for corrections once the real cost is known, negative gives back
+    void Adjust(const double amount) { m_tokens = std::min(m_capacity, m_tokens - amount); }
+    void Drain(void) { m_tokens = std::min(m_tokens, 0.0); }
+
+    // when CanTake(amount) will next be true
+    std::chrono::steady_clock::time_point Available(const double amount, const std::chrono::steady_clock::time_point now);
+
+private:
+    void Refill(const std::chrono::steady_clock::time_point now);
+
+    double m_capacity      = 0.0;
+    double m_ratePerSecond = 0.0;
+    double m_tokens        = 0.0;
+
+    std::chrono::steady_clock::time_point m_lastRefill = std::chrono::steady_clock::now();
+};
+
+// what the scheduler needs to know about a queued request, the request itself stays with the caller
+struct scheduledRequest{
+    uint64_t                              id       = 0;
+    std::string                           model;
+    requestPriority                       priority = REQUEST_PRIORITY_RESPONSE;
+    uint64_t                              tenantId = 0;
+    size_t                                tokens   = 0;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
+// Orders queued OpenAI requests for the dispatcher. Every model has requests and tokens per minute
+// buckets, requests go out by priority class and within a class round robin between tenants (guilds)
+// so a busy one can't starve the rest. Requests still queued past their deadline are expired.
+class requestScheduler{
+public:
+    // 0 leaves that limit off. Models without limits are never held back.
+    void SetLimits(const std::string_view model, const size_t requestsPerMinute, const size_t tokensPerMinute);
+
+    void Push(scheduledRequest&& toQueue);
+
+    // the next request the limits allow, if any
+    std::optional<scheduledRequest> Pop(const std::chrono::steady_clock::time_point now);
+
+    // charges for a request that skips the queue, such as a hedged copy, if the limits allow it now
+    bool TrySend(const scheduledRequest& request, const std::chrono::steady_clock::time_point now);
+
+    std::vector<scheduledRequest> TakeExpired(const std::chrono::steady_clock::time_point now);
+    std::vector<scheduledRequest> TakeAll(void);
+
+    // once a request completes, charges the model for what it actually used instead of the estimate
+    void Settle(const std::string_view model, const size_t estimatedTokens, const size_t usedTokens);
+
+    // gives back the estimate of a copy that was charged but never answered, like the loser of a hedge
+    void Refund(const std::string_view model, const size_t estimatedTokens);
+
+    // the provider said slow down, nothing more goes out for the model until the pause is over
+    void Pause(const std::string_view model, const std::chrono::steady_clock::time_point until);
+
+    // when Pop or TakeExpired could next give something, max if nothing is queued
+    std::chrono::steady_clock::time_point NextEvent(const std::chrono::steady_clock::time_point now);
+
+    // when TakeExpired could next give something, for when there's no room to send anyway
+    std::chrono::steady_clock::time_point NextDeadline(void) const;
+
+    bool   Empty(void) const { return 0 == m_numQueued; }
+    size_t Size(void) const { return m_numQueued; }
+
+private:
+    struct modelLimits{
+        tokenBucket                           requests;
+        tokenBucket                           tokens;
+        std::chrono::steady_clock::time_point pausedUntil;
+    };
+
+    struct priorityClass{
+        std::map<uint64_t, std::deque<scheduledRequest>> tenants;
+
+        // tenants with something queued, the front one goes next
+        std::deque<uint64_t> turns;
+    };
+
+    bool CanSend(const scheduledRequest& candidate, const std::chrono::steady_clock::time_point now);
+
+    std::map<std::string, modelLimits, std::less<>> m_limits;
+    priorityClass                                   m_classes[REQUEST_PRIORITY_COUNT];
+    size_t                                          m_numQueued = 0;
+};
+}
+
+#endif
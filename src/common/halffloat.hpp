@@ -0,0 +1,86 @@
+#ifndef HALFFLOAT_HPP
+#define HALFFLOAT_HPP
+
+#include <cstdint>
+#include <cstring>
+
+// IEEE 754 binary16 <-> binary32, round to nearest even
+
+inline uint16_t FloatToHalf(const float value){
+    uint32_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    const uint32_t sign     = (bits >> 16) & 0x8000;
+    const uint32_t rawExp   = (bits >> 23) & 0xff;
+    uint32_t       mantissa = bits & 0x7fffff;
+    const int32_t  exponent = (int32_t)rawExp - 127 + 15;
+
+    if(rawExp == 0xff){
+        // inf stays inf, nan stays nan
+        return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    }
+    if(exponent >= 0x1f){
+        return (uint16_t)(sign | 0x7c00);
+    }
+    if(exponent <= 0){
+        if(exponent < -10){
+            return (uint16_t)sign;
+        }
+
+        // subnormal half, shift the implicit bit down into the mantissa
+        mantissa |= 0x800000;
+        const uint32_t shift     = 14 - exponent;
+        uint32_t       half      = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway   = 1u << (shift - 1);
+
+        if(remainder > halfway || (remainder == halfway && (half & 1))){
+            half++;
+        }
+        return (uint16_t)(sign | half);
+    }
+
+    uint32_t       half      = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1fff;
+
+    // round to nearest even. A carry into the exponent is the correct result.
+    if(remainder > 0x1000 || (remainder == 0x1000 && (half & 1))){
+        half++;
+    }
+    return (uint16_t)(sign | half);
+}
+
+inline float HalfToFloat(const uint16_t half){
+    const uint32_t sign     = (uint32_t)(half & 0x8000) << 16;
+    uint32_t       exponent = (half >> 10) & 0x1f;
+    uint32_t       mantissa = half & 0x3ff;
+    uint32_t       bits     = 0;
+
+    if(exponent == 0x1f){
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else if(exponent == 0){
+        if(!mantissa){
+            bits = sign;
+        }
+        else{
+            // subnormal half, normalize it
+            exponent = 127 - 15 + 1;
+            while(!(mantissa & 0x400)){
+                mantissa <<= 1;
+                exponent--;
+            }
+            mantissa &= 0x3ff;
+            bits = sign | (exponent << 23) | (mantissa << 13);
+        }
+    }
+    else{
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float value = 0.0f;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef LRUCACHE_HPP
 #define LRUCACHE_HPP
 
+#include <cstddef>
 #include <list>
 #include <unordered_map>
 #include <utility>
@@ -28,6 +29,7 @@ public:
             m_cacheQueue.splice(m_cacheQueue.begin(), m_cacheQueue, it->second);
 
             obj = (it->second)->second;
+            found = true;
         }
         else{
             // cache miss
@@ -0,0 +1,46 @@
+#include "threadpool.hpp"
+
+threadPool::threadPool(const size_t numThreads){
+    const size_t actualThreads = std::max<size_t>(1, numThreads);
+
+    m_workers.reserve(actualThreads);
+    for(size_t ii = 0; ii < actualThreads; ii++){
+        m_workers.emplace_back(&threadPool::HandleQueue, this);
+    }
+}
+
+threadPool::~threadPool(){
+    std::unique_lock lock(m_workQMtx);
+    m_shutDown = true;
+    m_workQCV.notify_all();
+    lock.unlock();
+
+    for(auto& worker : m_workers){
+        if(worker.joinable()){
+            worker.join();
+        }
+    }
+}
+
+size_t threadPool::NumThreads(void) const{
+    return m_workers.size();
+}
+
+void threadPool::HandleQueue(void){
+    while(true){
+        std::unique_lock lock(m_workQMtx);
+        m_workQCV.wait(lock, [&](){ return (m_shutDown || !m_workQ.empty()); });
+
+        // drain whatever is left so nobody is left waiting on a broken promise
+        if(m_shutDown && m_workQ.empty()){
+            return;
+        }
+
+        std::function<void()> work(std::move(m_workQ.front()));
+        m_workQ.pop();
+        lock.unlock();
+
+        // packaged_task captures exceptions into the future
+        work();
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class threadPool{
+public:
+    threadPool(const size_t numThreads = std::max(2u, std::thread::hardware_concurrency() / 2));
+    ~threadPool();
+
+    threadPool(threadPool&) = delete;
+    threadPool(threadPool&&) = delete;
+    threadPool& operator=(threadPool&) = delete;
+    threadPool& operator=(threadPool&&) = delete;
+
+    template <typename FUNC_T>
+    std::future<std::invoke_result_t<FUNC_T>> Submit(FUNC_T&& func){
+        typedef std::invoke_result_t<FUNC_T> result_t;
+
+        // std::function needs to be copyable, so the task lives on the heap
+        auto task   = std::make_shared<std::packaged_task<result_t()>>(std::forward<FUNC_T>(func));
+        auto future = task->get_future();
+
+        std::lock_guard lock(m_workQMtx);
+        m_workQ.push([task](){ (*task)(); });
+        m_workQCV.notify_one();
+
+        return future;
+    }
+
+    size_t NumThreads(void) const;
+
+private:
+    void HandleQueue(void);
+
+    std::vector<std::thread>          m_workers;
+    std::condition_variable           m_workQCV;
+    std::queue<std::function<void()>> m_workQ;
+    std::mutex                        m_workQMtx;
+
+    std::atomic<bool>                 m_shutDown = false;
+};
+
+#endif
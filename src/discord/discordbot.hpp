@@ -2,15 +2,22 @@
 #define DISCORDBOT_HPP
 
 #include "discord/messagearchiver.hpp"
+#include "discord/replygate.hpp"
+#include "discord/replyscheduler.hpp"
+#include "discord/responsecache.hpp"
+#include "discord/transcriptcache.hpp"
 
 #include <dpp/cluster.h>
 
 #include <chatgpt.hpp>
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string_view>
 #include <thread>
 
 #define DEFAULT_AI_MODEL      "chatgpt-4o-latest"
@@ -37,13 +44,44 @@ public:
     void SetWorkingDir(const std::filesystem::path dir);
     void SetChatGPT(std::unique_ptr<openai::chatGPT> &&chatGPT);
 
+    // number of channels per guild whose vector index is prebuilt once archiving finishes
+    void SetIndexWarmupChannels(const size_t numChannels);
+
+    // channels up to maxVectors embeddings are brute-force searched in the given encoding
+    void SetExactSearchOptions(const size_t maxVectors, const vectorEncoding encoding);
+
+    // once the bot has decided to reply, a cached answer from the same channel is reused for questions
+    // at least this similar, so long as the channel has seen no more than maxNewMessages since
+    void SetResponseCacheOptions(const float similarity, const std::chrono::minutes ttl, const size_t maxNewMessages);
+
+    // identifies the embedding model so cached embeddings from a different one are never reused
+    void SetEmbeddingModelId(const std::string_view modelId);
+
+    // how much a message's age counts against it when picking context, see messageArchiver
+    void SetRecencyOptions(const float weight, const std::chrono::hours halfLife);
+    void SetChunkingOptions(const size_t maxTokens, const size_t overlapTokens);
+
+    // see replyGate, the bot is part of a conversation if it spoke within the last activeMessages and activeAge
+    void SetReplyGateOptions(const bool enabled, const size_t activeMessages, const std::chrono::minutes activeAge);
+    void SetReplyGateTopics(std::vector<std::string> topics, const float minSimilarity);
+
+    // a channel's messages are answered once it has been quiet for quietWindow, or maxDelay after the first
+    void SetReplyDebounceOptions(const std::chrono::milliseconds quietWindow, const std::chrono::milliseconds maxDelay);
+
+    // how many tokens of channel messages go into a prompt for the model, newest context first and then
+    // the most relevant older messages while there's room
+    void SetPromptBudget(const std::string_view model, const size_t tokens);
+
 private:
     void HandleOnSlashCommand(const dpp::slashcommand_t& event);
     void HandleOnReady(const dpp::ready_t& event);
     void HandleMessageEvent(const dpp::message_create_t &event);
+    void HandleReplyPipeline(const std::vector<dpp::message>& burst, replyTicket& ticket);
 
     void StartArchiving(const dpp::ready_t& event);
 
+    size_t PromptBudget(const std::string_view model) const;
+
     std::string  m_model = DEFAULT_AI_MODEL;
 
 
@@ -61,6 +99,13 @@ private:
 
     messageArchiver m_messageArchiver;
 
+    semanticResponseCache m_responseCache;
+    size_t                m_responseCacheMaxNewMessages = 30;
+
+    replyGate m_replyGate;
+
+    std::map<std::string, size_t, std::less<>> m_promptBudgets;
+
     size_t m_OnStartFetchAmount = 5;
 
     // hard limit via discord API
@@ -68,6 +113,13 @@ private:
     size_t m_chatGPTMessageContextRequirement = 15;
     size_t m_chatGPTPrefilterContextRequirement = 50;
     size_t m_chatGPTLongTermContextRequirement = 15000;
+    size_t m_indexWarmupChannels = 5;
+
+    // the prefilter's context of every channel, formatted as messages come in
+    transcriptCache m_transcripts;
+
+    // last so its pipelines are done before anything they use goes away
+    replyScheduler m_replyScheduler;
 };
 }
 
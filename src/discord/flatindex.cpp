@@ -0,0 +1,534 @@
+#include "flatindex.hpp"
+
+#include "common/halffloat.hpp"
+#include "common/util.hpp"
+#include "log/log.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    // msvc lets intrinsics be used without /arch, the runtime check keeps us honest
+    #define APATE_TARGET_AVX2
+    #define APATE_TARGET_AVX512
+#else
+    #include <immintrin.h>
+    #define APATE_TARGET_AVX2   __attribute__((target("avx2,fma,f16c")))
+    #define APATE_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+// the all-mpnet embedding size, this is the one worth unrolling for
+static const size_t SPECIALIZED_DIM = 768;
+
+// vectors scored per query before the results are merged into the heaps. Small enough that
+// the block stays in L2 while every query in a batch walks over it.
+static const size_t SEARCH_BLOCK_SIZE = 64;
+
+enum simdLevel{
+    SIMD_SCALAR,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+static simdLevel DetectSimdLevel(void){
+#if defined(_MSC_VER)
+    int info[4] = { 0 };
+
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    const bool fma     = info[2] & (1 << 12);
+    const bool osxsave = info[2] & (1 << 27);
+    const bool avx     = info[2] & (1 << 28);
+    const bool f16c    = info[2] & (1 << 29);
+
+    if(!osxsave || !avx || maxLeaf < 7){
+        return SIMD_SCALAR;
+    }
+
+    // make sure the OS actually saves the wide registers
+    const unsigned long long xcr0 = _xgetbv(0);
+    const bool ymmEnabled = (xcr0 & 0x06) == 0x06;
+    const bool zmmEnabled = (xcr0 & 0xE6) == 0xE6;
+
+    __cpuidex(info, 7, 0);
+    const bool avx2    = info[1] & (1 << 5);
+    const bool avx512f = info[1] & (1 << 16);
+
+    if(avx512f && zmmEnabled){
+        return SIMD_AVX512;
+    }
+    if(avx2 && fma && f16c && ymmEnabled){
+        return SIMD_AVX2;
+    }
+    return SIMD_SCALAR;
+#else
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx512f")){
+        return SIMD_AVX512;
+    }
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")){
+        return SIMD_AVX2;
+    }
+    return SIMD_SCALAR;
+#endif
+}
+
+// ---------------------------------------------------------------------------------------------
+// scalar kernels. DIM == 0 means the dimension is only known at runtime.
+// ---------------------------------------------------------------------------------------------
+
+template <size_t DIM>
+static inline float DotFp32Scalar(const float* query, const float* vec, const size_t dim){
+    const size_t n = DIM ? DIM : dim;
+
+    float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    size_t ii = 0;
+    for(; ii + 4 <= n; ii += 4){
+        acc[0] += query[ii]     * vec[ii];
+        acc[1] += query[ii + 1] * vec[ii + 1];
+        acc[2] += query[ii + 2] * vec[ii + 2];
+        acc[3] += query[ii + 3] * vec[ii + 3];
+    }
+    for(; ii < n; ii++){
+        acc[0] += query[ii] * vec[ii];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+template <size_t DIM>
+static inline float DotFp16Scalar(const float* query, const uint16_t* vec, const size_t dim){
+    const size_t n = DIM ? DIM : dim;
+
+    float acc = 0.0f;
+    for(size_t ii = 0; ii < n; ii++){
+        acc += query[ii] * HalfToFloat(vec[ii]);
+    }
+    return acc;
+}
+
+template <size_t DIM>
+static inline float DotInt8Scalar(const float* query, const int8_t* vec, const size_t dim){
+    const size_t n = DIM ? DIM : dim;
+
+    float acc = 0.0f;
+    for(size_t ii = 0; ii < n; ii++){
+        acc += query[ii] * (float)vec[ii];
+    }
+    return acc;
+}
+
+// ---------------------------------------------------------------------------------------------
+// AVX2 + FMA + F16C kernels
+// ---------------------------------------------------------------------------------------------
+
+APATE_TARGET_AVX2 static inline float HorizontalSumAvx2(const __m256 vec){
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(vec), _mm256_extractf128_ps(vec, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+    return _mm_cvtss_f32(sum);
+}
+
+template <size_t DIM>
+APATE_TARGET_AVX2 static inline float DotFp32Avx2(const float* query, const float* vec, const size_t dim){
+    const size_t n = DIM ? DIM : dim;
+
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+
+    size_t ii = 0;
+    for(; ii + 32 <= n; ii += 32){
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii),      _mm256_loadu_ps(vec + ii),      acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii + 8),  _mm256_loadu_ps(vec + ii + 8),  acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii + 16), _mm256_loadu_ps(vec + ii + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii + 24), _mm256_loadu_ps(vec + ii + 24), acc3);
+    }
+    for(; ii + 8 <= n; ii += 8){
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii), _mm256_loadu_ps(vec + ii), acc0);
+    }
+
+    float sum = HorizontalSumAvx2(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for(; ii < n; ii++){
+        sum += query[ii] * vec[ii];
+    }
+    return sum;
+}
+
+template <size_t DIM>
+APATE_TARGET_AVX2 static inline float DotFp16Avx2(const float* query, const uint16_t* vec, const size_t dim){
+    const size_t n = DIM ? DIM : dim;
+
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+
+    size_t ii = 0;
+    for(; ii + 16 <= n; ii += 16){
+        const __m256 vec0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(vec + ii)));
+        const __m256 vec1 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(vec + ii + 8)));
+
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii),     vec0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii + 8), vec1, acc1);
+    }
+
+    for(; ii + 8 <= n; ii += 8){
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(vec + ii))), acc0);
+    }
+    if(ii < n){
+        // zero pad the tail rather than calling back into scalar code from the vector unit
+        uint16_t vecTail[8]   = { 0 };
+        float    queryTail[8] = { 0.0f };
+        for(; ii < n; ii++){
+            vecTail[ii % 8]   = vec[ii];
+            queryTail[ii % 8] = query[ii];
+        }
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(queryTail), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)vecTail)), acc0);
+    }
+
+    return HorizontalSumAvx2(_mm256_add_ps(acc0, acc1));
+}
+
+template <size_t DIM>
+APATE_TARGET_AVX2 static inline float DotInt8Avx2(const float* query, const int8_t* vec, const size_t dim){
+    const size_t n = DIM ? DIM : dim;
+
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+
+    size_t ii = 0;
+    for(; ii + 16 <= n; ii += 16){
+        const __m256 vec0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(vec + ii))));
+        const __m256 vec1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(vec + ii + 8))));
+
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii),     vec0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(query + ii + 8), vec1, acc1);
+    }
+
+    float sum = HorizontalSumAvx2(_mm256_add_ps(acc0, acc1));
+    for(; ii < n; ii++){
+        sum += query[ii] * (float)vec[ii];
+    }
+    return sum;
+}
+
+// ---------------------------------------------------------------------------------------------
+// AVX-512F kernels
+// ---------------------------------------------------------------------------------------------
+
+template <size_t DIM>
+APATE_TARGET_AVX512 static inline float DotFp32Avx512(const float* query, const float* vec, const size_t dim){
+    const size_t n = DIM ? DIM : dim;
+
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps();
+    __m512 acc3 = _mm512_setzero_ps();
+
+    size_t ii = 0;
+    for(; ii + 64 <= n; ii += 64){
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii),      _mm512_loadu_ps(vec + ii),      acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii + 16), _mm512_loadu_ps(vec + ii + 16), acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii + 32), _mm512_loadu_ps(vec + ii + 32), acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii + 48), _mm512_loadu_ps(vec + ii + 48), acc3);
+    }
+    for(; ii + 16 <= n; ii += 16){
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii), _mm512_loadu_ps(vec + ii), acc0);
+    }
+
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+    for(; ii < n; ii++){
+        sum += query[ii] * vec[ii];
+    }
+    return sum;
+}
+
+template <size_t DIM>
+APATE_TARGET_AVX512 static inline float DotFp16Avx512(const float* query, const uint16_t* vec, const size_t dim){
+    const size_t n = DIM ? DIM : dim;
+
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+
+    size_t ii = 0;
+    for(; ii + 32 <= n; ii += 32){
+        const __m512 vec0 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(vec + ii)));
+        const __m512 vec1 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(vec + ii + 16)));
+
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii),      vec0, acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii + 16), vec1, acc1);
+    }
+
+    for(; ii + 16 <= n; ii += 16){
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii), _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(vec + ii))), acc0);
+    }
+    if(ii < n){
+        // zero pad the tail rather than calling back into scalar code from the vector unit
+        uint16_t vecTail[16]   = { 0 };
+        float    queryTail[16] = { 0.0f };
+        for(; ii < n; ii++){
+            vecTail[ii % 16]   = vec[ii];
+            queryTail[ii % 16] = query[ii];
+        }
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(queryTail), _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)vecTail)), acc0);
+    }
+
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+template <size_t DIM>
+APATE_TARGET_AVX512 static inline float DotInt8Avx512(const float* query, const int8_t* vec, const size_t dim){
+    const size_t n = DIM ? DIM : dim;
+
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+
+    size_t ii = 0;
+    for(; ii + 32 <= n; ii += 32){
+        const __m512 vec0 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(vec + ii))));
+        const __m512 vec1 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(vec + ii + 16))));
+
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii),      vec0, acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(query + ii + 16), vec1, acc1);
+    }
+
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for(; ii < n; ii++){
+        sum += query[ii] * (float)vec[ii];
+    }
+    return sum;
+}
+
+// ---------------------------------------------------------------------------------------------
+// block scorers. The loop lives alongside the kernel so the dot product inlines under the same target.
+// ---------------------------------------------------------------------------------------------
+
+#define APATE_DEFINE_SCORE_BLOCKS(_suffix, _target)                                                              \
+    template <size_t DIM>                                                                                        \
+    _target static void ScoreBlockFp32##_suffix(const float* query, const void* codes, const float* scales,     \
+                                                const size_t begin, const size_t end, const size_t dim,          \
+                                                float* out){                                                     \
+        const size_t n       = DIM ? DIM : dim;                                                                  \
+        const float* vectors = static_cast<const float*>(codes);                                                 \
+        for(size_t ii = begin; ii < end; ii++){                                                                  \
+            out[ii - begin] = DotFp32##_suffix<DIM>(query, vectors + ii * n, n);                                 \
+        }                                                                                                        \
+    }                                                                                                            \
+    template <size_t DIM>                                                                                        \
+    _target static void ScoreBlockFp16##_suffix(const float* query, const void* codes, const float* scales,     \
+                                                const size_t begin, const size_t end, const size_t dim,          \
+                                                float* out){                                                     \
+        const size_t    n       = DIM ? DIM : dim;                                                               \
+        const uint16_t* vectors = static_cast<const uint16_t*>(codes);                                           \
+        for(size_t ii = begin; ii < end; ii++){                                                                  \
+            out[ii - begin] = DotFp16##_suffix<DIM>(query, vectors + ii * n, n);                                 \
+        }                                                                                                        \
+    }                                                                                                            \
+    template <size_t DIM>                                                                                        \
+    _target static void ScoreBlockInt8##_suffix(const float* query, const void* codes, const float* scales,     \
+                                                const size_t begin, const size_t end, const size_t dim,          \
+                                                float* out){                                                     \
+        const size_t  n       = DIM ? DIM : dim;                                                                 \
+        const int8_t* vectors = static_cast<const int8_t*>(codes);                                               \
+        for(size_t ii = begin; ii < end; ii++){                                                                  \
+            out[ii - begin] = scales[ii] * DotInt8##_suffix<DIM>(query, vectors + ii * n, n);                    \
+        }                                                                                                        \
+    }
+
+APATE_DEFINE_SCORE_BLOCKS(Scalar, )
+APATE_DEFINE_SCORE_BLOCKS(Avx2,   APATE_TARGET_AVX2)
+APATE_DEFINE_SCORE_BLOCKS(Avx512, APATE_TARGET_AVX512)
+
+#undef APATE_DEFINE_SCORE_BLOCKS
+
+template <size_t DIM>
+static discord::flatIndex::scoreBlockFunc SelectScoreBlock(const discord::vectorEncoding encoding, const simdLevel level){
+    switch(encoding){
+        case discord::VECTOR_ENCODING_FP16:
+            return (level == SIMD_AVX512) ? ScoreBlockFp16Avx512<DIM> :
+                   (level == SIMD_AVX2)   ? ScoreBlockFp16Avx2<DIM>   :
+                                            ScoreBlockFp16Scalar<DIM>;
+        case discord::VECTOR_ENCODING_INT8:
+            return (level == SIMD_AVX512) ? ScoreBlockInt8Avx512<DIM> :
+                   (level == SIMD_AVX2)   ? ScoreBlockInt8Avx2<DIM>   :
+                                            ScoreBlockInt8Scalar<DIM>;
+        case discord::VECTOR_ENCODING_FP32:
+        default:
+            return (level == SIMD_AVX512) ? ScoreBlockFp32Avx512<DIM> :
+                   (level == SIMD_AVX2)   ? ScoreBlockFp32Avx2<DIM>   :
+                                            ScoreBlockFp32Scalar<DIM>;
+    }
+}
+
+namespace discord{
+
+vectorEncoding VectorEncodingFromString(const std::string_view str){
+    const std::string lower = ToLowercase(str);
+
+    if(lower == "fp16"){
+        return VECTOR_ENCODING_FP16;
+    }
+    if(lower == "int8"){
+        return VECTOR_ENCODING_INT8;
+    }
+    if(lower != "fp32"){
+        APATE_LOG_WARN("Unknown vector encoding '{}', using fp32", str);
+    }
+    return VECTOR_ENCODING_FP32;
+}
+
+flatIndex::flatIndex(const size_t dim, const vectorEncoding encoding) : m_dim(dim), m_encoding(encoding){
+    if(!m_dim){
+        APATE_LOG_WARN_AND_THROW(std::invalid_argument, "Vector dimension must be non-zero");
+    }
+
+    static const simdLevel level = DetectSimdLevel();
+
+    m_scoreBlock = (m_dim == SPECIALIZED_DIM) ? SelectScoreBlock<SPECIALIZED_DIM>(m_encoding, level) :
+                                                SelectScoreBlock<0>(m_encoding, level);
+}
+
+void flatIndex::Add(const size_t numVectors, const float* vectors){
+    if(!numVectors){
+        return;
+    }
+
+    switch(m_encoding){
+        case VECTOR_ENCODING_FP16:
+        {
+            m_fp16Codes.reserve(m_fp16Codes.size() + numVectors * m_dim);
+            for(size_t ii = 0; ii < numVectors * m_dim; ii++){
+                m_fp16Codes.push_back(FloatToHalf(vectors[ii]));
+            }
+            break;
+        }
+        case VECTOR_ENCODING_INT8:
+        {
+            // symmetric per-vector quantization, the scale folds back in at scoring time
+            m_int8Codes.reserve(m_int8Codes.size() + numVectors * m_dim);
+            m_int8Scales.reserve(m_int8Scales.size() + numVectors);
+
+            for(size_t ii = 0; ii < numVectors; ii++){
+                const float* vec = vectors + ii * m_dim;
+
+                float maxAbs = 0.0f;
+                for(size_t jj = 0; jj < m_dim; jj++){
+                    maxAbs = std::max(maxAbs, std::fabs(vec[jj]));
+                }
+
+                const float scale    = (maxAbs > 0.0f) ? maxAbs / 127.0f : 1.0f;
+                const float invScale = 1.0f / scale;
+
+                for(size_t jj = 0; jj < m_dim; jj++){
+                    const float quantized = std::round(vec[jj] * invScale);
+                    m_int8Codes.push_back((int8_t)std::clamp(quantized, -127.0f, 127.0f));
+                }
+                m_int8Scales.push_back(scale);
+            }
+            break;
+        }
+        case VECTOR_ENCODING_FP32:
+        default:
+        {
+            m_fp32Codes.insert(m_fp32Codes.end(), vectors, vectors + numVectors * m_dim);
+            break;
+        }
+    }
+
+    m_size += numVectors;
+}
+
+void flatIndex::Search(const size_t   numQueries,
+                       const float*   queries,
+                       const size_t   k,
+                       float*         scores,
+                       faiss::idx_t*  labels) const{
+
+    std::fill(scores, scores + numQueries * k, -std::numeric_limits<float>::infinity());
+    std::fill(labels, labels + numQueries * k, -1);
+
+    if(!numQueries || !k || !m_size){
+        return;
+    }
+
+    typedef std::pair<float, faiss::idx_t> heapEntry;
+
+    // min-heap on score, so the front is the weakest of the current top k
+    auto worseFirst = [](const heapEntry& lhs, const heapEntry& rhs){ return lhs.first > rhs.first; };
+
+    std::vector<std::vector<heapEntry>> heaps(numQueries);
+    for(auto& heap : heaps){
+        heap.reserve(std::min(k, m_size));
+    }
+
+    const void*  codes  = Codes();
+    const float* scales = m_int8Scales.data();
+
+    float blockScores[SEARCH_BLOCK_SIZE];
+
+    for(size_t begin = 0; begin < m_size; begin += SEARCH_BLOCK_SIZE){
+        const size_t end = std::min(begin + SEARCH_BLOCK_SIZE, m_size);
+
+        for(size_t qq = 0; qq < numQueries; qq++){
+            m_scoreBlock(queries + qq * m_dim, codes, scales, begin, end, m_dim, blockScores);
+
+            auto& heap = heaps[qq];
+            for(size_t ii = begin; ii < end; ii++){
+                const float score = blockScores[ii - begin];
+
+                if(heap.size() < k){
+                    heap.emplace_back(score, (faiss::idx_t)ii);
+                    std::push_heap(heap.begin(), heap.end(), worseFirst);
+                }
+                else if(score > heap.front().first){
+                    std::pop_heap(heap.begin(), heap.end(), worseFirst);
+                    heap.back() = heapEntry(score, (faiss::idx_t)ii);
+                    std::push_heap(heap.begin(), heap.end(), worseFirst);
+                }
+            }
+        }
+    }
+
+    for(size_t qq = 0; qq < numQueries; qq++){
+        auto& heap = heaps[qq];
+
+        // best first
+        std::sort_heap(heap.begin(), heap.end(), worseFirst);
+
+        for(size_t ii = 0; ii < heap.size(); ii++){
+            scores[qq * k + ii] = heap[ii].first;
+            labels[qq * k + ii] = heap[ii].second;
+        }
+    }
+}
+
+size_t flatIndex::Size(void) const{
+    return m_size;
+}
+
+size_t flatIndex::Dim(void) const{
+    return m_dim;
+}
+
+vectorEncoding flatIndex::Encoding(void) const{
+    return m_encoding;
+}
+
+const void* flatIndex::Codes(void) const{
+    switch(m_encoding){
+        case VECTOR_ENCODING_FP16:
+            return m_fp16Codes.data();
+        case VECTOR_ENCODING_INT8:
+            return m_int8Codes.data();
+        case VECTOR_ENCODING_FP32:
+        default:
+            return m_fp32Codes.data();
+    }
+}
+}
@@ -0,0 +1,72 @@
+#ifndef FLATINDEX_HPP
+#define FLATINDEX_HPP
+
+#include <faiss/Index.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace discord{
+
+enum vectorEncoding{
+    VECTOR_ENCODING_FP32,
+    VECTOR_ENCODING_FP16,
+    VECTOR_ENCODING_INT8
+};
+
+vectorEncoding VectorEncodingFromString(const std::string_view str);
+
+// Exact inner product search over one contiguous block of vectors. For small and medium channels
+// a straight scan beats walking an HNSW graph, and it doesn't pay for the graph's memory.
+// The scan kernel is picked once at construction: AVX-512, AVX2 or scalar, specialized for 768 dims.
+class flatIndex{
+public:
+    // scores vectors [begin, end) against one query into out[0, end - begin)
+    typedef void (*scoreBlockFunc)(const float* query,
+                                   const void*  codes,
+                                   const float* scales,
+                                   const size_t begin,
+                                   const size_t end,
+                                   const size_t dim,
+                                   float*       out);
+
+    flatIndex(const size_t dim = 768, const vectorEncoding encoding = VECTOR_ENCODING_FP32);
+
+    flatIndex(flatIndex&) = delete;
+    flatIndex(flatIndex&&) = delete;
+    flatIndex& operator=(flatIndex&) = delete;
+    flatIndex& operator=(flatIndex&&) = delete;
+
+    void Add(const size_t numVectors, const float* vectors);
+
+    // row-major [numQueries x k] results, best first. Slots past the index size get label -1.
+    void Search(const size_t   numQueries,
+                const float*   queries,
+                const size_t   k,
+                float*         scores,
+                faiss::idx_t*  labels) const;
+
+    size_t         Size(void) const;
+    size_t         Dim(void) const;
+    vectorEncoding Encoding(void) const;
+
+private:
+    const void* Codes(void) const;
+
+    size_t         m_dim;
+    vectorEncoding m_encoding;
+    size_t         m_size = 0;
+
+    // only the one matching m_encoding is populated
+    std::vector<float>    m_fp32Codes;
+    std::vector<uint16_t> m_fp16Codes;
+    std::vector<int8_t>   m_int8Codes;
+    std::vector<float>    m_int8Scales;
+
+    scoreBlockFunc m_scoreBlock = nullptr;
+};
+}
+
+#endif
@@ -1,232 +1,611 @@
-#include "messagearchiver.hpp"
-
-#include "common/util.hpp"
-#include "embed/embed.hpp"
-#include "log/log.hpp"
-
-#include <format>
-
-static const size_t MIN_MESSAGE_LEN_FOR_EMBEDDING = 10;
-
-static std::string GenerateEmbeddingString(const dpp::message& message){
-
-    // keep the time as part of the embedding for temporal awareness
-    std::string embeddingString = std::format("{} {} {}",
-                                              SnowflakeFriendly (message.id),
-                                              message.author.global_name,
-                                              message.content);
-
-    return embeddingString;
-}
-
-
-namespace discord{
-
-messageArchiver::messageArchiver(const std::filesystem::path& persistenceDir) : m_persistenceDir (persistenceDir) {
-}
-
-
-messageArchiver::messageArchiver(void){
-    // default
-
-    m_persistenceDir = GetDirectory(DIRECTORY_EXE);
-}
-
-void messageArchiver::SetPersistenceDir(const std::filesystem::path& dir){
-    m_persistenceDir = dir;
-    m_persistenceDir.remove_filename();
-
-
-}
-
-void messageArchiver::RecordLatestMessage(const dpp::message& message){
-    dpp::message_map map;
-    map.emplace(message.id, message);
-
-    BatchRecordLatestMessages(message.guild_id, message.channel_id, map);
-
-}
-
-void messageArchiver::BatchRecordLatestMessages(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::message_map& messages){
-
-    auto& persistenceWrapper = GetGuildPersistence(guildId);
-    std::unique_lock lock(persistenceWrapper.mutex);
-    persistenceWrapper.persistence.RecordLatestMessages(messages);
-
-    std::vector<std::string>    embeddingsToGenerate;
-    std::vector<dpp::snowflake> messageIDsToGenerate;
-
-    for (const auto &[messageID, message] : messages){
-
-        if (message.content.size () < MIN_MESSAGE_LEN_FOR_EMBEDDING){
-            continue;
-        }
-
-        if(!persistenceWrapper.persistence.HasEmbedding(channelId, messageID)){
-            embeddingsToGenerate.push_back(GenerateEmbeddingString(message));
-            messageIDsToGenerate.push_back(messageID);
-        }
-    }
-    lock.unlock();
-    if(!embeddingsToGenerate.empty()){
-        auto future = TransformSentences(embeddingsToGenerate);
-
-        std::future_status rc = std::future_status::ready;
-        if ((rc = future.wait_for(std::chrono::seconds(120))) != std::future_status::ready){
-            APATE_LOG_WARN("Failed to get '{}' embeddings for channel {} - {}",
-                           embeddingsToGenerate.size(),
-                           channelId.str(),
-                           (int)rc);
-        }
-        else{
-            auto embeddings = future.get();
-            if(embeddings.size() != embeddingsToGenerate.size()){
-                APATE_LOG_WARN("Embeddings size = '{}' mismatches inputs {} for channel {}",
-                               embeddings.size(),
-                               embeddingsToGenerate.size(),
-                               channelId.str());
-            }
-            else{
-                lock.lock();
-                for(size_t ii = 0; ii<embeddings.size(); ii++){
-                    persistenceWrapper.persistence.SaveEmbedding(channelId,
-                                                                 messageIDsToGenerate[ii],
-                                                                 embeddings[ii]);
-                }
-            }
-        }
-    }
-
-}
-
-size_t messageArchiver::CountContinousMessages(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::snowflake since){
-    auto& persistenceWrapper = GetGuildPersistence(guildId);
-    std::lock_guard lock(persistenceWrapper.mutex);
-    return persistenceWrapper.persistence.CountContinuousMessages(channelId, since);
-}
-
-dpp::snowflake messageArchiver::GetOldestContinuousTimestamp(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::snowflake since){
-    auto& persistenceWrapper = GetGuildPersistence(guildId);
-    std::lock_guard lock(persistenceWrapper.mutex);
-    return persistenceWrapper.persistence.GetOldestContinuousTimestamp(channelId, since);
-}
-
-messageRecord messageArchiver::FindMessage(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::snowflake messageId){
-
-    messageRecord msg;
-
-    auto& persistenceWrapper = GetGuildPersistence(guildId);
-    std::lock_guard lock(persistenceWrapper.mutex);
-    persistenceWrapper.persistence.FindMessage (channelId, messageId, msg);
-
-    return msg;
-
-}
-
-
-std::vector<messageRecord> messageArchiver::GetContinousMessages(const dpp::snowflake guildId,
-                                                                 const dpp::snowflake channelId,
-                                                                 const size_t         numMessages){
-    auto& persistenceWrapper = GetGuildPersistence(guildId);
-    std::lock_guard lock(persistenceWrapper.mutex);
-    return persistenceWrapper.persistence.GetContinousMessagesByChannel(channelId, numMessages);
-}
-
-std::vector<messageRecord> messageArchiver::GetContextRelevantMessages(const dpp::message& message, const size_t numMessages){
-    std::vector<messageRecord> relevant;
-    auto future = TransformSentences({ message.content });
-
-    std::future_status rc = std::future_status::ready;
-    if ((rc = future.wait_for(std::chrono::seconds(30))) != std::future_status::ready){
-        APATE_LOG_WARN("Failed to get embeddings for channel {} - {}",
-                       message.channel_id.str(),
-                       message.content,
-                       (int)rc);
-    }
-    else{
-        auto embeddedVector = future.get();
-
-        if (embeddedVector.size () != 1){
-            APATE_LOG_WARN("Embedding vector size not expected = {}",
-                           embeddedVector.size ());
-        }
-        else{
-            auto faiss = GetFaiss (message.guild_id, message.channel_id);
-            std::lock_guard lock(faiss->mutex);
-
-            std::vector<faiss::idx_t> indexes(numMessages);
-            std::vector<float> similarityScores(numMessages);
-
-            faiss->flatFaiss.search(1, // thing to query
-                                    embeddedVector[0].data (),
-                                    numMessages,
-                                    similarityScores.data(),
-                                    indexes.data());
-
-            for(size_t ii = 0; ii < indexes.size (); ii++){
-                auto result = indexes[ii];
-                auto similarity = similarityScores[ii];
-
-                auto messageId = faiss->faissSnowflakes[result];
-                auto foundMsg = FindMessage(message.guild_id, message.channel_id, messageId);
-
-                if(!foundMsg.snowflake.empty()){
-                    relevant.push_back(foundMsg);
-
-                }
-            }
-        }
-    }
-    return relevant;
-}
-
-messageArchiver::serverPersistenceWrapper& discord::messageArchiver::GetGuildPersistence(const dpp::snowflake& guildID){
-    std::lock_guard lock(m_persistenceDictMtx);
-
-    if(m_persistenceByGuild.count(guildID)<=0){
-        std::filesystem::path guildDir = m_persistenceDir;
-        guildDir.append(guildID.str() + "\\");
-
-        serverPersistence persistence;
-        persistence.SetBaseDirectory(guildDir);
-
-        auto [it,_] = m_persistenceByGuild.emplace(guildID, std::move(persistence));
-        return(it->second);
-
-    }
-    else{
-        return m_persistenceByGuild[guildID];
-    }
-}
-std::shared_ptr<messageArchiver::faissIndexWrapper> messageArchiver::GetFaiss(const dpp::snowflake& guildID, const dpp::snowflake channelId){
-    std::lock_guard lock(m_faissDictMtx);
-    if (m_faissByChannel.count(channelId) > 0){
-        return m_faissByChannel[channelId];
-    }
-    else{
-        // make a new FAISS
-
-
-
-        std::shared_ptr<faissIndexWrapper> newFaiss = std::make_shared<faissIndexWrapper>();
-        std::vector<embeddingRecord> embeddings;
-
-        auto& persistenceWrapper = GetGuildPersistence(guildID);
-        {
-            std::lock_guard lock(persistenceWrapper.mutex);
-            embeddings = persistenceWrapper.persistence.GetVectorEmbeddings(channelId);
-        }
-
-        for (const auto embedding : embeddings){
-
-            // remember the snowflakes for later
-            newFaiss->faissSnowflakes.push_back(embedding.messageId);
-            newFaiss->flatFaiss.add(1, embedding.embedding.data());
-        }
-        
-        newFaiss->flatFaiss.hnsw.efSearch = 500;
-        m_faissByChannel.emplace(channelId, newFaiss);
-        return newFaiss;
-    }
-}
-}
+#include "messagearchiver.hpp"
+
+#include "common/util.hpp"
+#include "embed/embed.hpp"
+#include "embed/embedbatcher.hpp"
+#include "embed/embeddingcache.hpp"
+#include "embed/textchunker.hpp"
+#include "log/log.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <format>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+
+static const size_t MIN_MESSAGE_LEN_FOR_EMBEDDING = 10;
+
+// how far past numMessages a search reaches so recency has something to reorder
+static const size_t RECENCY_OVERFETCH = 2;
+
+// ingest gives up and defers rather than hold up backfill, the reply path gives up sooner still
+static const std::chrono::seconds INGEST_EMBED_TIMEOUT   = std::chrono::seconds(30);
+static const std::chrono::seconds QUERY_EMBED_TIMEOUT    = std::chrono::seconds(5);
+static const std::chrono::seconds CATCH_UP_EMBED_TIMEOUT = std::chrono::seconds(120);
+
+// deferred embeddings are retried this often, and the oldest are dropped past the cap
+static const std::chrono::seconds CATCH_UP_INTERVAL       = std::chrono::seconds(15);
+static const size_t               MAX_DEFERRED_EMBEDDINGS = 100000;
+
+static std::string GenerateEmbeddingString(const dpp::message& message){
+
+    // content only, so identical text shares one cached embedding no matter who posted it or when.
+    // Time is weighed in separately when searching.
+    return embeddingCache::NormalizeText(message.content);
+}
+
+namespace discord{
+
+messageArchiver::messageArchiver(const std::filesystem::path& persistenceDir) : m_persistenceDir (persistenceDir) {
+    m_ingestThread  = std::thread(&messageArchiver::HandleIngest, this);
+    m_catchUpThread = std::thread(&messageArchiver::HandleCatchUp, this);
+}
+
+
+messageArchiver::messageArchiver(void){
+    // default
+
+    m_persistenceDir = GetDirectory(DIRECTORY_EXE);
+    m_ingestThread  = std::thread(&messageArchiver::HandleIngest, this);
+    m_catchUpThread = std::thread(&messageArchiver::HandleCatchUp, this);
+}
+
+messageArchiver::~messageArchiver(void){
+    std::unique_lock ingestLock(m_ingestMtx);
+    std::unique_lock deferredLock(m_deferredMtx);
+    m_shutDown = true;
+    m_ingestCV.notify_all();
+    m_deferredCV.notify_all();
+    deferredLock.unlock();
+    ingestLock.unlock();
+
+    if(m_ingestThread.joinable()){
+        m_ingestThread.join();
+    }
+    if(m_catchUpThread.joinable()){
+        m_catchUpThread.join();
+    }
+}
+
+void messageArchiver::SetPersistenceDir(const std::filesystem::path& dir){
+    m_persistenceDir = dir;
+    m_persistenceDir.remove_filename();
+
+    std::filesystem::path cacheFile = m_persistenceDir;
+    cacheFile.append("embeddingcache.db");
+    m_embeddingCache.Open(cacheFile);
+
+}
+
+void messageArchiver::SetExactSearchOptions(const size_t maxVectors, const vectorEncoding encoding){
+    m_exactSearchMaxVectors = maxVectors;
+    m_exactSearchEncoding   = encoding;
+}
+
+void messageArchiver::SetEmbeddingModelId(const std::string_view modelId){
+    m_embeddingCache.SetModelId(modelId);
+}
+
+void messageArchiver::SetRecencyOptions(const float weight, const std::chrono::hours halfLife){
+    m_recencyWeight   = std::clamp(weight, 0.0f, 1.0f);
+    m_recencyHalfLife = halfLife;
+}
+
+void messageArchiver::SetChunkingOptions(const size_t maxTokens, const size_t overlapTokens){
+    m_chunkTokens        = maxTokens;
+    m_chunkOverlapTokens = overlapTokens;
+}
+
+void messageArchiver::RecordLatestMessage(const dpp::message& message){
+    dpp::message_map map;
+    map.emplace(message.id, message);
+
+    // the event thread only waits for the message to be saved, its embedding follows from the ingest thread
+    deferredEmbeddings pending = RecordMessages(message.guild_id, message.channel_id, map);
+    if(pending.texts.empty()){
+        return;
+    }
+
+    std::lock_guard lock(m_ingestMtx);
+    m_ingest.push_back(std::move(pending));
+    m_ingestCV.notify_one();
+}
+
+void messageArchiver::BatchRecordLatestMessages(const dpp::snowflake    guildId,
+                                                const dpp::snowflake    channelId,
+                                                const dpp::message_map& messages,
+                                                const embeddingPriority priority){
+
+    deferredEmbeddings pending = RecordMessages(guildId, channelId, messages);
+    if(pending.texts.empty()){
+        return;
+    }
+
+    auto embeddings = EmbedTexts(pending.texts, INGEST_EMBED_TIMEOUT, priority);
+
+    if(embeddings.Rows() != pending.texts.size()){
+        // the messages are already saved, their embeddings can catch up later
+        DeferEmbeddings(std::move(pending));
+    }
+    else{
+        SaveEmbeddings(pending, embeddings);
+    }
+}
+
+messageArchiver::deferredEmbeddings messageArchiver::RecordMessages(const dpp::snowflake    guildId,
+                                                                    const dpp::snowflake    channelId,
+                                                                    const dpp::message_map& messages){
+    deferredEmbeddings pending{ guildId, channelId, {}, {} };
+
+    auto& persistenceWrapper = GetGuildPersistence(guildId);
+    std::lock_guard lock(persistenceWrapper.mutex);
+    persistenceWrapper.persistence.RecordLatestMessages(messages);
+
+    for (const auto &[messageID, message] : messages){
+
+        if (message.content.size () < MIN_MESSAGE_LEN_FOR_EMBEDDING){
+            continue;
+        }
+
+        if(!persistenceWrapper.persistence.HasEmbedding(channelId, messageID)){
+            pending.texts.push_back(GenerateEmbeddingString(message));
+            pending.messageIds.push_back(messageID);
+        }
+    }
+
+    return pending;
+}
+
+void messageArchiver::SaveEmbeddings(const deferredEmbeddings& pending, const embeddingMatrix& embeddings){
+    auto& persistenceWrapper = GetGuildPersistence(pending.guildId);
+    std::lock_guard lock(persistenceWrapper.mutex);
+    persistenceWrapper.persistence.SaveEmbeddings(pending.channelId,
+                                                  pending.messageIds,
+                                                  embeddings);
+}
+
+size_t messageArchiver::CountContinousMessages(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::snowflake since){
+    auto& persistenceWrapper = GetGuildPersistence(guildId);
+    std::lock_guard lock(persistenceWrapper.mutex);
+    return persistenceWrapper.persistence.CountContinuousMessages(channelId, since);
+}
+
+dpp::snowflake messageArchiver::GetOldestContinuousTimestamp(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::snowflake since){
+    auto& persistenceWrapper = GetGuildPersistence(guildId);
+    std::lock_guard lock(persistenceWrapper.mutex);
+    return persistenceWrapper.persistence.GetOldestContinuousTimestamp(channelId, since);
+}
+
+messageRecord messageArchiver::FindMessage(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::snowflake messageId){
+
+    messageRecord msg;
+
+    auto& persistenceWrapper = GetGuildPersistence(guildId);
+    std::lock_guard lock(persistenceWrapper.mutex);
+    persistenceWrapper.persistence.FindMessage (channelId, messageId, msg);
+
+    return msg;
+
+}
+
+
+std::vector<messageRecord> messageArchiver::GetContinousMessages(const dpp::snowflake guildId,
+                                                                 const dpp::snowflake channelId,
+                                                                 const size_t         numMessages){
+    auto& persistenceWrapper = GetGuildPersistence(guildId);
+    std::lock_guard lock(persistenceWrapper.mutex);
+    return persistenceWrapper.persistence.GetContinousMessagesByChannel(channelId, numMessages);
+}
+
+embeddingMatrix messageArchiver::EmbedTexts(const std::vector<std::string>& texts,
+                                            const std::chrono::seconds      timeout,
+                                            const embeddingPriority         priority){
+    embeddingMatrix     hits;
+    std::vector<size_t> hitIndexes;
+
+    const std::vector<size_t> missIndexes = m_embeddingCache.Lookup(texts, hits, hitIndexes);
+    if(missIndexes.empty()){
+        return hits;
+    }
+
+    // long texts go out as several overlapping chunks in the same request and are pooled back into one row
+    const textChunker chunker(m_chunkTokens, m_chunkOverlapTokens);
+
+    std::vector<std::string> missTexts;
+    std::vector<std::string> chunks;
+    std::vector<size_t>      chunkCounts;
+    missTexts.reserve(missIndexes.size());
+    chunkCounts.reserve(missIndexes.size());
+    for(const size_t index : missIndexes){
+        missTexts.push_back(texts[index]);
+
+        auto textChunks = chunker.Chunk(texts[index]);
+        chunkCounts.push_back(textChunks.size());
+        std::move(textChunks.begin(), textChunks.end(), std::back_inserter(chunks));
+    }
+
+    auto future = TransformSentences(chunks, priority);
+
+    std::future_status rc = std::future_status::ready;
+    if ((rc = future.wait_for(timeout)) != std::future_status::ready){
+        APATE_LOG_WARN("Timed out waiting for '{}' embeddings - {}",
+                       chunks.size(),
+                       (int)rc);
+        return embeddingMatrix();
+    }
+
+    embeddingMatrix chunkEmbeddings = future.get();
+    if(chunkEmbeddings.Rows() != chunks.size()){
+        APATE_LOG_WARN("Embeddings size = '{}' mismatches inputs {}",
+                       chunkEmbeddings.Rows(),
+                       chunks.size());
+        return embeddingMatrix();
+    }
+
+    embeddingMatrix generated = (chunks.size() == missTexts.size()) ? std::move(chunkEmbeddings)
+                                                                    : textChunker::PoolChunks(chunkEmbeddings, chunkCounts);
+
+    m_embeddingCache.Store(missTexts, generated);
+
+    if(hitIndexes.empty()){
+        return generated;
+    }
+
+    if(hits.Dim() != generated.Dim()){
+        APATE_LOG_WARN("Cached embeddings of dimension {} don't match the server's {}",
+                       hits.Dim(),
+                       generated.Dim());
+        return embeddingMatrix();
+    }
+
+    // stitch cached and fresh rows back into input order
+    embeddingMatrix result(texts.size(), generated.Dim());
+    for(size_t ii = 0; ii < hitIndexes.size(); ii++){
+        const auto row = hits.Row(ii);
+        std::copy(row.begin(), row.end(), result.Row(hitIndexes[ii]).begin());
+    }
+    for(size_t ii = 0; ii < missIndexes.size(); ii++){
+        const auto row = generated.Row(ii);
+        std::copy(row.begin(), row.end(), result.Row(missIndexes[ii]).begin());
+    }
+    return result;
+}
+
+void messageArchiver::DeferEmbeddings(deferredEmbeddings&& deferred){
+    std::lock_guard lock(m_deferredMtx);
+
+    APATE_LOG_WARN("Deferring '{}' embeddings for channel {}",
+                   deferred.texts.size(),
+                   deferred.channelId.str());
+
+    m_numDeferred += deferred.texts.size();
+    m_deferred.push_back(std::move(deferred));
+
+    while(m_numDeferred > MAX_DEFERRED_EMBEDDINGS && m_deferred.size() > 1){
+        APATE_LOG_WARN("Dropping '{}' deferred embeddings for channel {}, too many waiting",
+                       m_deferred.front().texts.size(),
+                       m_deferred.front().channelId.str());
+
+        m_numDeferred -= m_deferred.front().texts.size();
+        m_deferred.pop_front();
+    }
+}
+
+void messageArchiver::HandleIngest(void){
+    while(true){
+        std::unique_lock lock(m_ingestMtx);
+        m_ingestCV.wait(lock, [&](){ return m_shutDown.load() || !m_ingest.empty(); });
+
+        if(m_shutDown){
+            return;
+        }
+
+        // whatever came in while the last round was out goes to the server together
+        std::deque<deferredEmbeddings> pending;
+        pending.swap(m_ingest);
+
+        std::vector<std::string> texts;
+        for(const auto& entry : pending){
+            texts.insert(texts.end(), entry.texts.begin(), entry.texts.end());
+        }
+
+        std::promise<void> done;
+        m_ingestTexts = std::unordered_set<std::string>(texts.begin(), texts.end());
+        m_ingestDone  = done.get_future().share();
+        lock.unlock();
+
+        const embeddingMatrix embeddings = EmbedTexts(texts, INGEST_EMBED_TIMEOUT, EMBEDDING_PRIORITY_INGEST);
+
+        lock.lock();
+        m_ingestTexts.clear();
+        lock.unlock();
+        done.set_value();
+
+        size_t firstRow = 0;
+        for(auto& entry : pending){
+            if(embeddings.Rows() != texts.size()){
+                // the messages are already saved, their embeddings can catch up later
+                DeferEmbeddings(std::move(entry));
+                continue;
+            }
+
+            SaveEmbeddings(entry, embeddings.Slice(firstRow, entry.texts.size()));
+            firstRow += entry.texts.size();
+        }
+    }
+}
+
+void messageArchiver::HandleCatchUp(void){
+    while(true){
+        std::unique_lock lock(m_deferredMtx);
+        m_deferredCV.wait_for(lock, CATCH_UP_INTERVAL, [&](){ return m_shutDown.load(); });
+
+        if(m_shutDown){
+            return;
+        }
+
+        // one entry at a time, and stop at the first failure so a struggling server isn't piled on
+        while(!m_shutDown && !m_deferred.empty() && embeddingBatcher::GetInstance().Available()){
+            deferredEmbeddings deferred = std::move(m_deferred.front());
+            m_deferred.pop_front();
+            m_numDeferred -= deferred.texts.size();
+            lock.unlock();
+
+            auto embeddings = EmbedTexts(deferred.texts, CATCH_UP_EMBED_TIMEOUT, EMBEDDING_PRIORITY_BACKFILL);
+
+            if(embeddings.Rows() != deferred.texts.size()){
+                lock.lock();
+                m_numDeferred += deferred.texts.size();
+                m_deferred.push_front(std::move(deferred));
+                break;
+            }
+
+            SaveEmbeddings(deferred, embeddings);
+
+            APATE_LOG_INFO("Caught up on '{}' embeddings for channel {}",
+                           deferred.texts.size(),
+                           deferred.channelId.str());
+            lock.lock();
+        }
+    }
+}
+
+std::vector<float> messageArchiver::EmbedQuery(const dpp::message& message){
+    std::vector<float> embedding;
+    std::string        text = GenerateEmbeddingString(message);
+
+    // the message itself was usually embedded on the way in, in which case this is a cache hit. If the
+    // ingest thread has it out right now, asking the server again would only race it.
+    std::shared_future<void> ingested;
+    {
+        std::lock_guard lock(m_ingestMtx);
+        if(m_ingestTexts.contains(text)){
+            ingested = m_ingestDone;
+        }
+    }
+
+    if(ingested.valid() && ingested.wait_for(QUERY_EMBED_TIMEOUT) != std::future_status::ready){
+        APATE_LOG_WARN("Timed out waiting for the ingest embedding of the query in channel {}",
+                       message.channel_id.str());
+        return embedding;
+    }
+
+    auto embeddedVector = EmbedTexts({ std::move(text) }, QUERY_EMBED_TIMEOUT, EMBEDDING_PRIORITY_QUERY);
+
+    if (embeddedVector.Rows () != 1){
+        APATE_LOG_WARN("Failed to get query embedding for channel {}",
+                       message.channel_id.str());
+    }
+    else{
+        const auto row = embeddedVector.Row(0);
+        embedding.assign(row.begin(), row.end());
+    }
+    return embedding;
+}
+
+std::vector<messageRecord> messageArchiver::GetContextRelevantMessages(const dpp::message& message, const size_t numMessages){
+    return GetContextRelevantMessages(message, EmbedQuery(message), numMessages);
+}
+
+std::vector<messageRecord> messageArchiver::GetContextRelevantMessages(const dpp::message&      message,
+                                                                       const std::vector<float>& queryEmbedding,
+                                                                       const size_t              numMessages){
+    std::vector<messageRecord> relevant;
+
+    if(queryEmbedding.empty()){
+        return relevant;
+    }
+
+    std::shared_ptr<faissIndexWrapper> faiss;
+    try{
+        faiss = GetFaiss (message.guild_id, message.channel_id);
+    } catch(const std::exception& e){
+        APATE_LOG_WARN("Failed to build index for channel {} - {}",
+                       message.channel_id.str(),
+                       e.what());
+        return relevant;
+    }
+
+    std::vector<searchHit> hits;
+    try{
+        hits = faiss->broker.Search(queryEmbedding, m_recencyWeight > 0.0f ? numMessages * RECENCY_OVERFETCH : numMessages);
+    } catch(const std::exception& e){
+        APATE_LOG_WARN("Failed to search index for channel {} - {}",
+                       message.channel_id.str(),
+                       e.what());
+        return relevant;
+    }
+
+    std::vector<dpp::snowflake> messageIds;
+    messageIds.reserve(hits.size());
+    {
+        std::lock_guard lock(faiss->mutex);
+        for(const auto& hit : hits){
+            messageIds.push_back(faiss->faissSnowflakes[hit.label]);
+        }
+    }
+
+    if(m_recencyWeight > 0.0f){
+        // blend similarity with an exponential decay on the message's age
+        const double nowMs      = (double)SnowflakeToUnix(SnowflakeNow());
+        const double halfLifeMs = (double)std::chrono::duration_cast<std::chrono::milliseconds>(m_recencyHalfLife).count();
+
+        std::vector<std::pair<float, dpp::snowflake>> ranked;
+        ranked.reserve(hits.size());
+
+        for(size_t ii = 0; ii < hits.size(); ii++){
+            const double ageMs   = std::max(0.0, nowMs - (double)SnowflakeToUnix(messageIds[ii]));
+            const double recency = (halfLifeMs > 0.0) ? std::exp2(-ageMs / halfLifeMs) : 0.0;
+
+            ranked.emplace_back((1.0f - m_recencyWeight) * hits[ii].score + m_recencyWeight * (float)recency,
+                                messageIds[ii]);
+        }
+
+        std::stable_sort(ranked.begin(), ranked.end(), [](const auto& lhs, const auto& rhs){ return lhs.first > rhs.first; });
+
+        messageIds.clear();
+        for(size_t ii = 0; ii < ranked.size() && ii < numMessages; ii++){
+            messageIds.push_back(ranked[ii].second);
+        }
+    }
+
+    for(const auto& messageId : messageIds){
+        auto foundMsg = FindMessage(message.guild_id, message.channel_id, messageId);
+
+        if(!foundMsg.snowflake.empty()){
+            relevant.push_back(foundMsg);
+
+        }
+    }
+    return relevant;
+}
+
+size_t messageArchiver::CountMessagesSince(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::snowflake since){
+    auto& persistenceWrapper = GetGuildPersistence(guildId);
+    std::lock_guard lock(persistenceWrapper.mutex);
+    return persistenceWrapper.persistence.CountMessagesSince(channelId, since);
+}
+
+messageArchiver::serverPersistenceWrapper& discord::messageArchiver::GetGuildPersistence(const dpp::snowflake& guildID){
+    std::lock_guard lock(m_persistenceDictMtx);
+
+    if(m_persistenceByGuild.count(guildID)<=0){
+        std::filesystem::path guildDir = m_persistenceDir;
+        guildDir.append(guildID.str() + "\\");
+
+        serverPersistence persistence;
+        persistence.SetBaseDirectory(guildDir);
+
+        auto [it,_] = m_persistenceByGuild.emplace(guildID, std::move(persistence));
+        return(it->second);
+
+    }
+    else{
+        return m_persistenceByGuild[guildID];
+    }
+}
+std::shared_ptr<messageArchiver::faissIndexWrapper> messageArchiver::GetFaiss(const dpp::snowflake& guildID, const dpp::snowflake channelId){
+    // blocks only on this channel's build, not everyone else's
+    return GetFaissAsync(guildID, channelId).get();
+}
+
+messageArchiver::faissFuture messageArchiver::GetFaissAsync(const dpp::snowflake& guildID, const dpp::snowflake channelId){
+    std::lock_guard lock(m_faissDictMtx);
+
+    auto it = m_faissByChannel.find(channelId);
+    if (it != m_faissByChannel.end()){
+        return it->second;
+    }
+
+    faissFuture future = m_indexBuildPool.Submit([this, guildID, channelId](){
+        try{
+            return BuildFaiss(guildID, channelId);
+        } catch(...){
+            // forget the failed build so the next caller gets to retry
+            std::lock_guard lock(m_faissDictMtx);
+            m_faissByChannel.erase(channelId);
+            throw;
+        }
+    }).share();
+
+    m_faissByChannel.emplace(channelId, future);
+    return future;
+}
+
+std::shared_ptr<messageArchiver::faissIndexWrapper> messageArchiver::BuildFaiss(const dpp::snowflake guildID, const dpp::snowflake channelId){
+    embeddingRecords records;
+
+    auto& persistenceWrapper = GetGuildPersistence(guildID);
+    {
+        std::lock_guard lock(persistenceWrapper.mutex);
+        records = persistenceWrapper.persistence.GetVectorEmbeddings(channelId);
+    }
+
+    const size_t numEmbeddings = records.embeddings.Rows();
+
+    std::shared_ptr<faissIndexWrapper> newFaiss = std::make_shared<faissIndexWrapper>(numEmbeddings,
+                                                                                      m_exactSearchMaxVectors,
+                                                                                      m_exactSearchEncoding);
+
+    if(numEmbeddings && records.embeddings.Dim() != newFaiss->dim){
+        APATE_LOG_WARN_AND_THROW(std::runtime_error,
+                                 "Channel {} has embeddings of dimension {}, expected {}",
+                                 channelId.str(),
+                                 records.embeddings.Dim(),
+                                 newFaiss->dim);
+    }
+
+    std::lock_guard lock(newFaiss->mutex);
+
+    // remember the snowflakes for later, label ii is row ii
+    newFaiss->faissSnowflakes = std::move(records.messageIds);
+    if(numEmbeddings){
+        newFaiss->Add(numEmbeddings, records.embeddings.Data());
+    }
+
+    APATE_LOG_DEBUG("Built {} index for channel {} with '{}' embeddings",
+                    newFaiss->exactIndex ? "exact" : "hnsw",
+                    channelId.str(),
+                    numEmbeddings);
+    return newFaiss;
+}
+
+void messageArchiver::WarmupIndexes(const dpp::snowflake guildId, const std::vector<dpp::snowflake>& channelIds, const size_t numChannels){
+    if(channelIds.empty() || !numChannels){
+        return;
+    }
+
+    // rank by how much was said in the last week
+    static const unsigned long long ACTIVITY_WINDOW_S = 7 * 24 * 60 * 60;
+    const dpp::snowflake activitySince = UnixToSnowflake(std::time(0) - ACTIVITY_WINDOW_S);
+
+    std::vector<std::pair<size_t, dpp::snowflake>> activityByChannel;
+    activityByChannel.reserve(channelIds.size());
+
+    auto& persistenceWrapper = GetGuildPersistence(guildId);
+    {
+        std::lock_guard lock(persistenceWrapper.mutex);
+        for(const auto& channelId : channelIds){
+            activityByChannel.emplace_back(persistenceWrapper.persistence.CountMessagesSince(channelId, activitySince),
+                                           channelId);
+        }
+    }
+
+    std::sort(activityByChannel.begin(), activityByChannel.end(), std::greater<>());
+
+    const size_t numToWarm = std::min(numChannels, activityByChannel.size());
+    for(size_t ii = 0; ii < numToWarm; ii++){
+        const auto& [activity, channelId] = activityByChannel[ii];
+        if(!activity){
+            break;
+        }
+
+        APATE_LOG_DEBUG("Warming up index for channel {} - '{}' recent messages",
+                        channelId.str(),
+                        activity);
+        GetFaissAsync(guildId, channelId);
+    }
+}
+}
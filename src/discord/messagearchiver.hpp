@@ -1,12 +1,29 @@
 #ifndef MESSAGEARCHIVER_HPP
 #define MESSAGEARCHIVER_HPP
 
+#include <common/threadpool.hpp>
+#include <discord/flatindex.hpp>
+#include <discord/searchbroker.hpp>
 #include <discord/serverpersistence.hpp>
+#include <embed/embedbatcher.hpp>
+#include <embed/embeddingcache.hpp>
 
 #include <faiss/IndexHNSW.h>
 #include <dpp/dpp.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <future>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 namespace discord{
@@ -28,11 +45,31 @@ private:
     };
 
     struct faissIndexWrapper{
-        // standard size for all mpnet
-        faissIndexWrapper(size_t vecDim = 768,
-                          int nearestNeighbors = 64,
+        // standard size for all mpnet. Channels up to exactSearchMaxVectors get a brute-force scan,
+        // anything bigger gets an HNSW graph.
+        faissIndexWrapper(size_t            expectedVectors,
+                          size_t            exactSearchMaxVectors,
+                          vectorEncoding    exactSearchEncoding = VECTOR_ENCODING_FP32,
+                          size_t            vecDim = 768,
+                          int               nearestNeighbors = 64,
                           faiss::MetricType mType = faiss::MetricType::METRIC_INNER_PRODUCT) :
-            flatFaiss (vecDim, nearestNeighbors, mType) {
+            dim       (vecDim),
+            broker    (vecDim, [this](const size_t numQueries, const float* queries, const size_t k, float* scores, faiss::idx_t* labels){
+                            std::lock_guard lock(mutex);
+                            if(exactIndex){
+                                exactIndex->Search(numQueries, queries, k, scores, labels);
+                            }
+                            else{
+                                hnswFaiss->search(numQueries, queries, k, scores, labels);
+                            }
+                        }) {
+            if(expectedVectors <= exactSearchMaxVectors){
+                exactIndex = std::make_unique<flatIndex>(vecDim, exactSearchEncoding);
+            }
+            else{
+                hnswFaiss = std::make_unique<faiss::IndexHNSWFlat>(vecDim, nearestNeighbors, mType);
+                hnswFaiss->hnsw.efSearch = 500;
+            }
         }
 
         faissIndexWrapper(faissIndexWrapper&) = delete;
@@ -40,9 +77,24 @@ private:
         faissIndexWrapper& operator=(faissIndexWrapper&) = delete;
         faissIndexWrapper& operator=(faissIndexWrapper&& rhs) = delete;
 
-        std::vector<dpp::snowflake> faissSnowflakes;
-        faiss::IndexHNSWFlat flatFaiss;
-        std::mutex           mutex;
+        // caller holds mutex
+        void Add(const size_t numVectors, const float* vectors){
+            if(exactIndex){
+                exactIndex->Add(numVectors, vectors);
+            }
+            else{
+                hnswFaiss->add(numVectors, vectors);
+            }
+        }
+
+        size_t                                dim;
+        std::vector<dpp::snowflake>           faissSnowflakes;
+        std::unique_ptr<flatIndex>            exactIndex;
+        std::unique_ptr<faiss::IndexHNSWFlat> hnswFaiss;
+        std::mutex                            mutex;
+
+        // concurrent queries from different conversations are searched together
+        searchBroker                          broker;
     };
 
 public:
@@ -52,11 +104,31 @@ public:
     messageArchiver(messageArchiver&&) = delete;
     messageArchiver& operator=(messageArchiver&) = delete;
     messageArchiver& operator=(messageArchiver&&) = delete;
-    ~messageArchiver(void) = default;
+    ~messageArchiver(void);
 
     void SetPersistenceDir(const std::filesystem::path& dir);
+
+    // channels with at most maxVectors embeddings are searched exactly instead of through HNSW.
+    // Only applies to indexes built after the call.
+    void SetExactSearchOptions(const size_t maxVectors, const vectorEncoding encoding);
+
+    // cached embeddings are only reused for the model they came from
+    void SetEmbeddingModelId(const std::string_view modelId);
+
+    // search scores are blended with 0.5^(age / halfLife) by weight. 0 ranks on similarity alone.
+    void SetRecencyOptions(const float weight, const std::chrono::hours halfLife);
+
+    // texts longer than maxTokens are embedded as overlapping chunks and pooled into one vector
+    void SetChunkingOptions(const size_t maxTokens, const size_t overlapTokens);
+
+    // saves the message and returns, its embedding is generated in the background
     void RecordLatestMessage(const dpp::message& message);
-    void BatchRecordLatestMessages(const dpp::snowflake guildId,const dpp::snowflake channelId, const dpp::message_map& messages);
+    // waits for the embeddings, backfill has its own thread to do it on. It passes
+    // EMBEDDING_PRIORITY_BACKFILL so it doesn't hold up live messages and queries.
+    void BatchRecordLatestMessages(const dpp::snowflake    guildId,
+                                   const dpp::snowflake    channelId,
+                                   const dpp::message_map& messages,
+                                   const embeddingPriority priority = EMBEDDING_PRIORITY_INGEST);
 
     size_t CountContinousMessages(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::snowflake since);
 
@@ -68,20 +140,97 @@ public:
                                                     const dpp::snowflake channelId,
                                                     const size_t         numMessages);
 
+    // messages recorded after since, not counting since itself
+    size_t CountMessagesSince(const dpp::snowflake guildId, const dpp::snowflake channelId, const dpp::snowflake since);
+
+    // the message's own ingest embedding is reused through the embedding cache, waiting for the ingest
+    // thread if it's embedding it right now. Empty if the embedding server couldn't be reached in time,
+    // retrieval carries on without it.
+    std::vector<float> EmbedQuery(const dpp::message& message);
+
     std::vector<messageRecord> GetContextRelevantMessages (const dpp::message  &message,
                                                            const size_t         numMessages);
+    std::vector<messageRecord> GetContextRelevantMessages (const dpp::message       &message,
+                                                           const std::vector<float> &queryEmbedding,
+                                                           const size_t              numMessages);
+
+    // kicks off background index builds for the busiest of the given channels. Does not wait for them.
+    void WarmupIndexes(const dpp::snowflake               guildId,
+                       const std::vector<dpp::snowflake>& channelIds,
+                       const size_t                       numChannels);
 private:
+    typedef std::shared_future<std::shared_ptr<faissIndexWrapper>> faissFuture;
+
+    // messages that were recorded before their embeddings were generated
+    struct deferredEmbeddings{
+        dpp::snowflake              guildId;
+        dpp::snowflake              channelId;
+        std::vector<dpp::snowflake> messageIds;
+        std::vector<std::string>    texts;
+    };
+
+    // saves the messages, what comes back are the ones that still need embedding
+    deferredEmbeddings RecordMessages(const dpp::snowflake    guildId,
+                                      const dpp::snowflake    channelId,
+                                      const dpp::message_map& messages);
+    void               SaveEmbeddings(const deferredEmbeddings& pending, const embeddingMatrix& embeddings);
+
+    void DeferEmbeddings(deferredEmbeddings&& deferred);
+
+    // embeds live messages queued by RecordLatestMessage, batching whatever piled up in the meantime
+    void HandleIngest(void);
+
+    // retries deferred embeddings whenever the embedding server is available
+    void HandleCatchUp(void);
+
+    // one row per text in input order, empty on failure. Only texts missing from the cache go to the server.
+    embeddingMatrix EmbedTexts(const std::vector<std::string>& texts,
+                               const std::chrono::seconds      timeout,
+                               const embeddingPriority         priority);
 
     serverPersistenceWrapper& GetGuildPersistence(const dpp::snowflake& guildID);
     std::shared_ptr<faissIndexWrapper> GetFaiss (const dpp::snowflake& guildID, const dpp::snowflake channelId);
+    faissFuture GetFaissAsync (const dpp::snowflake& guildID, const dpp::snowflake channelId);
+    std::shared_ptr<faissIndexWrapper> BuildFaiss (const dpp::snowflake guildID, const dpp::snowflake channelId);
 
     std::mutex                                         m_persistenceDictMtx;
     std::map<dpp::snowflake, serverPersistenceWrapper> m_persistenceByGuild;
 
+    // only held for lookup and insert, the builds themselves run on m_indexBuildPool
     std::mutex                                                          m_faissDictMtx;
-    std::map<dpp::snowflake, std::shared_ptr<faissIndexWrapper>>        m_faissByChannel;
+    std::map<dpp::snowflake, faissFuture>                               m_faissByChannel;
     std::filesystem::path                                               m_persistenceDir;
 
+    embeddingCache                                                      m_embeddingCache;
+
+    float                                                               m_recencyWeight   = 0.1f;
+    std::chrono::hours                                                  m_recencyHalfLife = std::chrono::hours(24 * 30);
+
+    // estimated tokens, kept under all-mpnet-base-v2's 384 token window
+    size_t                                                              m_chunkTokens        = 320;
+    size_t                                                              m_chunkOverlapTokens = 64;
+
+    size_t                                                              m_exactSearchMaxVectors = 50000;
+    vectorEncoding                                                      m_exactSearchEncoding   = VECTOR_ENCODING_FP32;
+
+    std::mutex                                                          m_ingestMtx;
+    std::condition_variable                                             m_ingestCV;
+    std::deque<deferredEmbeddings>                                      m_ingest;
+    std::thread                                                         m_ingestThread;
+
+    // what the ingest thread is embedding right now, ready once the results are in the cache
+    std::unordered_set<std::string>                                     m_ingestTexts;
+    std::shared_future<void>                                            m_ingestDone;
+
+    std::mutex                                                          m_deferredMtx;
+    std::condition_variable                                             m_deferredCV;
+    std::deque<deferredEmbeddings>                                      m_deferred;
+    size_t                                                              m_numDeferred = 0;
+    std::atomic<bool>                                                   m_shutDown    = false;
+    std::thread                                                         m_catchUpThread;
+
+    // declared last so the workers are joined before anything they touch is destroyed
+    threadPool                                                          m_indexBuildPool;
 
 };
 }
@@ -0,0 +1,314 @@
+#include "replygate.hpp"
+
+#include "common/util.hpp"
+#include "embed/embed.hpp"
+#include "log/log.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+
+// fewer letters or digits than this and there's nothing to reply to
+static const size_t MIN_SUBSTANCE_CHARS = 3;
+
+// whole messages that never need the bot on their own
+static const std::array<std::string_view, 22> FILLER_MESSAGES = {
+    "lol", "lmao", "lmfao", "rofl", "haha", "hahaha", "xd", "ok", "okay", "kk", "ty", "thx",
+    "thanks", "nice", "yep", "yup", "nah", "same", "true", "fr", "based", "gg"
+};
+
+// leading words that make a message a question even without a question mark
+static const std::array<std::string_view, 17> QUESTION_WORDS = {
+    "who", "what", "when", "where", "why", "how", "which", "can", "could", "should",
+    "would", "is", "are", "do", "does", "did", "will"
+};
+
+static const std::chrono::seconds TOPIC_EMBED_TIMEOUT = std::chrono::seconds(5);
+static const size_t               STATS_LOG_EVERY     = 500;
+
+namespace{
+
+// letters and digits only, lowercase, with discord markup (<@id>, <:emoji:id>) and links left out.
+// Emoji don't count, letters from other scripts do.
+std::string SubstantiveText(const std::string_view content){
+    std::string text;
+    text.reserve(content.size());
+
+    size_t ii = 0;
+    while(ii < content.size()){
+        const unsigned char c = (unsigned char)content[ii];
+
+        if('<' == c){
+            const size_t close = content.find('>', ii);
+            if(close != std::string_view::npos){
+                ii = close + 1;
+                continue;
+            }
+        }
+
+        if(content.substr(ii).starts_with("http://") || content.substr(ii).starts_with("https://")){
+            while(ii < content.size() && !std::isspace((unsigned char)content[ii])){
+                ii++;
+            }
+            continue;
+        }
+
+        if(c < 0x80){
+            if(std::isalnum(c)){
+                text.push_back((char)std::tolower(c));
+            }
+            else if(std::isspace(c) && !text.empty() && text.back() != ' '){
+                text.push_back(' ');
+            }
+            ii++;
+            continue;
+        }
+
+        // four byte sequences are emoji, E2 covers general punctuation and symbols
+        size_t length = 1;
+        while(ii + length < content.size() && ((unsigned char)content[ii + length] & 0xC0) == 0x80){
+            length++;
+        }
+
+        if(c < 0xF0 && c != 0xE2){
+            text.append(content.substr(ii, length));
+        }
+        ii += length;
+    }
+
+    while(!text.empty() && text.back() == ' '){
+        text.pop_back();
+    }
+    return text;
+}
+
+// word as a whole word of text, or followed by an s. Both come from SubstantiveText.
+bool ContainsWord(const std::string_view text, const std::string_view word){
+    if(word.empty()){
+        return false;
+    }
+
+    for(size_t pos = text.find(word); pos != std::string_view::npos; pos = text.find(word, pos + 1)){
+        size_t end = pos + word.size();
+        if(end < text.size() && 's' == text[end]){
+            end++;
+        }
+
+        if((0 == pos || ' ' == text[pos - 1]) && (end == text.size() || ' ' == text[end])){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LooksLikeQuestion(const std::string_view content, const std::string_view text){
+    if(content.find('?') != std::string_view::npos){
+        return true;
+    }
+
+    const std::string_view firstWord = text.substr(0, text.find(' '));
+    return std::find(QUESTION_WORDS.begin(), QUESTION_WORDS.end(), firstWord) != QUESTION_WORDS.end();
+}
+
+}
+
+namespace discord{
+
+void replyGate::SetActiveConversation(const size_t maxMessages, const std::chrono::minutes maxAge){
+    m_activeMaxMessages = maxMessages;
+    m_activeMaxAge      = maxAge;
+}
+
+void replyGate::SetBotNames(const std::vector<std::string>& names){
+    std::vector<std::string> botNames;
+    for(const auto& name : names){
+        std::string normalized = SubstantiveText(name);
+        if(!normalized.empty()){
+            botNames.push_back(std::move(normalized));
+        }
+    }
+
+    std::lock_guard lock(m_namesMtx);
+    m_botNames = std::move(botNames);
+}
+
+void replyGate::SetTopics(std::vector<std::string> topics, const float minSimilarity){
+    std::lock_guard lock(m_topicsMtx);
+
+    m_topics             = std::move(topics);
+    m_topicMinSimilarity = minSimilarity;
+    m_topicEmbeddings.clear();
+    m_topicDim           = 0;
+    m_topicsGeneration++;
+}
+
+gateDecision replyGate::Screen(const gateFeatures& features){
+    if(!m_enabled){
+        Count(GATE_ASK_PREFILTER);
+        return GATE_ASK_PREFILTER;
+    }
+
+    const std::string text = SubstantiveText(features.content);
+
+    if(features.mentionsBot || features.repliesToBot || NamesBot(text)){
+        Count(GATE_RESPOND);
+        return GATE_RESPOND;
+    }
+
+    size_t numChars = 0;
+    for(const char c : text){
+        numChars += (c != ' ');
+    }
+
+    if(numChars < MIN_SUBSTANCE_CHARS || std::find(FILLER_MESSAGES.begin(), FILLER_MESSAGES.end(), text) != FILLER_MESSAGES.end()){
+        Count(GATE_IGNORE);
+        return GATE_IGNORE;
+    }
+
+    const bool activeConversation = (features.messagesSinceBot <= m_activeMaxMessages && features.timeSinceBot <= m_activeMaxAge);
+    if(activeConversation){
+        const gateDecision decision = LooksLikeQuestion(features.content, text) ? GATE_RESPOND : GATE_ASK_PREFILTER;
+        Count(decision);
+        return decision;
+    }
+
+    // the bot hasn't been part of this channel lately, only a message on one of its topics could change that
+    std::lock_guard lock(m_topicsMtx);
+    if(m_topics.empty()){
+        Count(GATE_IGNORE);
+        return GATE_IGNORE;
+    }
+    return GATE_CHECK_TOPICS;
+}
+
+gateDecision replyGate::CheckTopics(const std::span<const float> embedding){
+    // without something to compare, leave it to the prefilter rather than go quiet
+    const bool haveTopics = (!embedding.empty() && EnsureTopicEmbeddings());
+
+    std::unique_lock lock(m_topicsMtx);
+    if(!haveTopics || m_topicEmbeddings.empty() || embedding.size() != m_topicDim){
+        lock.unlock();
+        Count(GATE_ASK_PREFILTER);
+        return GATE_ASK_PREFILTER;
+    }
+
+    float messageNorm = 0.0f;
+    for(const float value : embedding){
+        messageNorm += value * value;
+    }
+    messageNorm = std::sqrt(messageNorm);
+
+    float bestSimilarity = -1.0f;
+    for(size_t topic = 0; topic < m_topicEmbeddings.size() / m_topicDim; topic++){
+        const float* topicEmbedding = m_topicEmbeddings.data() + topic * m_topicDim;
+
+        float similarity = 0.0f;
+        for(size_t ii = 0; ii < m_topicDim; ii++){
+            similarity += topicEmbedding[ii] * embedding[ii];
+        }
+        bestSimilarity = std::max(bestSimilarity, similarity / std::max(messageNorm, 1e-6f));
+    }
+
+    const gateDecision decision = (bestSimilarity >= m_topicMinSimilarity) ? GATE_ASK_PREFILTER : GATE_IGNORE;
+    lock.unlock();
+
+    Count(decision);
+    return decision;
+}
+
+bool replyGate::EnsureTopicEmbeddings(void){
+    std::unique_lock lock(m_topicsMtx);
+
+    // another message is already waiting on them, this one goes to the prefilter
+    if(!m_topicEmbeddings.empty() || m_embeddingTopics){
+        return !m_topicEmbeddings.empty();
+    }
+
+    const std::vector<std::string> topics     = m_topics;
+    const size_t                   generation = m_topicsGeneration;
+
+    m_embeddingTopics = true;
+    lock.unlock();
+
+    // tried again on the next message if the embedding server isn't answering yet
+    embeddingMatrix embeddings;
+
+    auto future = TransformSentences(topics, EMBEDDING_PRIORITY_QUERY);
+    if(future.wait_for(TOPIC_EMBED_TIMEOUT) == std::future_status::ready){
+        embeddings = future.get();
+    }
+
+    lock.lock();
+    m_embeddingTopics = false;
+
+    if(embeddings.Rows() != topics.size()){
+        APATE_LOG_WARN("Failed to embed '{}' reply gate topics in time", topics.size());
+        return false;
+    }
+
+    // SetTopics replaced them meanwhile, the next message embeds the new ones
+    if(generation != m_topicsGeneration){
+        return false;
+    }
+
+    // normalized up front so only the message's norm is left to divide by
+    for(size_t topic = 0; topic < embeddings.Rows(); topic++){
+        auto row = embeddings.Row(topic);
+
+        float norm = 0.0f;
+        for(const float value : row){
+            norm += value * value;
+        }
+        norm = std::sqrt(norm);
+
+        if(norm > 0.0f){
+            for(float& value : row){
+                value /= norm;
+            }
+        }
+    }
+
+    m_topicDim = embeddings.Dim();
+    m_topicEmbeddings.assign(embeddings.Data(), embeddings.Data() + embeddings.Rows() * embeddings.Dim());
+
+    APATE_LOG_INFO("Embedded '{}' reply gate topics", m_topics.size());
+    return true;
+}
+
+bool replyGate::NamesBot(const std::string_view text){
+    std::lock_guard lock(m_namesMtx);
+
+    for(const auto& name : m_botNames){
+        if(ContainsWord(text, name)){
+            return true;
+        }
+    }
+    return false;
+}
+
+void replyGate::Count(const gateDecision decision){
+    switch(decision){
+    case GATE_RESPOND:
+        m_numRespond++;
+        break;
+    case GATE_IGNORE:
+        m_numIgnore++;
+        break;
+    default:
+        m_numAsk++;
+        break;
+    }
+
+    const size_t numRespond = m_numRespond;
+    const size_t numIgnore  = m_numIgnore;
+    const size_t numAsk     = m_numAsk;
+
+    if((numRespond + numIgnore + numAsk) % STATS_LOG_EVERY == 0){
+        APATE_LOG_INFO("Reply gate: '{}' answered, '{}' ignored, '{}' sent to the prefilter",
+                       numRespond,
+                       numIgnore,
+                       numAsk);
+    }
+}
+}
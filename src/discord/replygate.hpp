@@ -0,0 +1,95 @@
+#ifndef REPLYGATE_HPP
+#define REPLYGATE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace discord{
+
+enum gateDecision{
+    GATE_RESPOND,           // skip the prefilter and reply
+    GATE_IGNORE,            // don't reply, don't ask
+    GATE_ASK_PREFILTER,     // can't tell, let the LLM prefilter decide
+    GATE_CHECK_TOPICS       // only worth asking if the message is close to one of the bot's topics
+};
+
+// what the gate knows about a new message and the channel it landed in
+struct gateFeatures{
+    std::string_view content;
+
+    bool mentionsBot  = false;
+    bool repliesToBot = false;
+
+    // how far back the bot last spoke in the recent context, SIZE_MAX if it didn't
+    size_t               messagesSinceBot = SIZE_MAX;
+    std::chrono::seconds timeSinceBot     = std::chrono::seconds::max();
+};
+
+// Decides from cheap features whether a message plainly does or doesn't need the bot, so that only the
+// ambiguous ones cost an LLM prefilter round trip. Mentions, replies to the bot, messages calling it by
+// name and questions in a conversation the bot is part of are answered. Near empty messages and channels the bot hasn't spoken
+// in lately are ignored, unless the message is close to one of the bot's topics.
+class replyGate{
+public:
+    replyGate(void) = default;
+
+    replyGate(replyGate&) = delete;
+    replyGate(replyGate&&) = delete;
+    replyGate& operator=(replyGate&) = delete;
+    replyGate& operator=(replyGate&&) = delete;
+
+    void SetEnabled(const bool enabled) { m_enabled = enabled; }
+
+    // the bot counts as part of the conversation if it spoke within both limits
+    void SetActiveConversation(const size_t maxMessages, const std::chrono::minutes maxAge);
+
+    // a message using one of these as a word is talking to the bot as much as a mention is.
+    // Case, punctuation and a trailing 's' are ignored, so "B-BOT" also matches "b-bot's".
+    void SetBotNames(const std::vector<std::string>& names);
+
+    // topics are embedded on first use without holding up Screen. Until they are, and while one message
+    // waits on them, CheckTopics leaves it to the prefilter. A message at least minSimilarity (cosine)
+    // to one goes to the prefilter.
+    void SetTopics(std::vector<std::string> topics, const float minSimilarity);
+
+    gateDecision Screen(const gateFeatures& features);
+
+    // for GATE_CHECK_TOPICS, with the message's embedding. Gives GATE_ASK_PREFILTER or GATE_IGNORE.
+    gateDecision CheckTopics(const std::span<const float> embedding);
+
+private:
+    bool EnsureTopicEmbeddings(void);
+    bool NamesBot(const std::string_view text);
+    void Count(const gateDecision decision);
+
+    std::atomic<bool>    m_enabled             = true;
+    size_t               m_activeMaxMessages   = 6;
+    std::chrono::minutes m_activeMaxAge        = std::chrono::minutes(10);
+
+    std::mutex               m_namesMtx;
+    std::vector<std::string> m_botNames;
+
+    std::mutex               m_topicsMtx;
+    std::vector<std::string> m_topics;
+    std::vector<float>       m_topicEmbeddings;
+    size_t                   m_topicDim           = 0;
+    float                    m_topicMinSimilarity = 0.35f;
+
+    // the topics are embedded without m_topicsMtx held, SetTopics bumps the generation so stale ones aren't kept
+    bool                     m_embeddingTopics    = false;
+    size_t                   m_topicsGeneration   = 0;
+
+    // how often each decision was made, logged every so often to show what the gate saves
+    std::atomic<size_t> m_numRespond  = 0;
+    std::atomic<size_t> m_numIgnore   = 0;
+    std::atomic<size_t> m_numAsk      = 0;
+};
+}
+
+#endif
@@ -0,0 +1,166 @@
+#include "replyscheduler.hpp"
+
+#include "log/log.hpp"
+
+#include <algorithm>
+
+// a burst longer than this only keeps its latest messages, the pipeline reads the channel's context anyway
+static const size_t MAX_BURST_MESSAGES = 25;
+
+namespace discord{
+
+bool replyTicket::Commit(void){
+    replyTicketState expected = REPLY_TICKET_RUNNING;
+    return (m_state.compare_exchange_strong(expected, REPLY_TICKET_COMMITTED) || REPLY_TICKET_COMMITTED == expected);
+}
+
+bool replyTicket::Cancel(void){
+    replyTicketState expected = REPLY_TICKET_RUNNING;
+    return m_state.compare_exchange_strong(expected, REPLY_TICKET_CANCELLED);
+}
+
+replyScheduler::replyScheduler(replyPipeline pipeline) :
+    m_pipeline (std::move(pipeline)){
+    m_scheduler = std::thread(&replyScheduler::HandleChannels, this);
+}
+
+replyScheduler::~replyScheduler(){
+    std::unique_lock lock(m_channelsMtx);
+    m_shutDown = true;
+
+    for(auto& [channelId, channel] : m_channels){
+        if(channel.ticket){
+            channel.ticket->Cancel();
+        }
+    }
+    m_channelsCV.notify_all();
+    lock.unlock();
+
+    if(m_scheduler.joinable()){
+        m_scheduler.join();
+    }
+
+    // pipelines that already committed get to finish their reply
+    lock.lock();
+    m_channelsCV.wait(lock, [&](){ return (0 == m_numRunning); });
+}
+
+void replyScheduler::SetOptions(const std::chrono::milliseconds quietWindow, const std::chrono::milliseconds maxDelay){
+    std::lock_guard lock(m_channelsMtx);
+
+    m_quietWindow = quietWindow;
+    m_maxDelay    = std::max(maxDelay, quietWindow);
+}
+
+void replyScheduler::Schedule(const dpp::message& message){
+    std::lock_guard lock(m_channelsMtx);
+
+    if(m_shutDown){
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    channelState& channel = m_channels[message.channel_id];
+
+    // whatever the running pipeline decided is about an older conversation, start over with its messages.
+    // A burst that has waited maxDelay already is left to finish, or a busy channel would never get a reply.
+    if(channel.ticket && now - channel.runningSince < m_maxDelay && channel.ticket->Cancel()){
+        APATE_LOG_DEBUG("Superseded reply pipeline in channel {}", message.channel_id.str());
+
+        channel.pending.insert(channel.pending.begin(), channel.running.begin(), channel.running.end());
+        channel.running.clear();
+        channel.ticket.reset();
+        channel.firstPending = channel.runningSince;
+    }
+
+    if(channel.pending.empty()){
+        channel.firstPending = now;
+    }
+
+    channel.pending.push_back(message);
+    channel.lastPending = now;
+
+    if(channel.pending.size() > MAX_BURST_MESSAGES){
+        channel.pending.erase(channel.pending.begin(), channel.pending.end() - MAX_BURST_MESSAGES);
+    }
+
+    m_channelsCV.notify_all();
+}
+
+void replyScheduler::HandleChannels(void){
+    std::unique_lock lock(m_channelsMtx);
+
+    while(!m_shutDown){
+        const auto now = std::chrono::steady_clock::now();
+        auto nextDeadline = std::chrono::steady_clock::time_point::max();
+
+        for(auto it = m_channels.begin(); it != m_channels.end();){
+            channelState& channel = it->second;
+
+            if(channel.pending.empty() && !channel.ticket){
+                it = m_channels.erase(it);
+                continue;
+            }
+
+            // a committed pipeline is still replying, its channel waits
+            if(!channel.pending.empty() && !channel.ticket){
+                const auto deadline = std::min(channel.lastPending + m_quietWindow, channel.firstPending + m_maxDelay);
+
+                if(deadline <= now){
+                    Launch(it->first, channel);
+                }
+                else{
+                    nextDeadline = std::min(nextDeadline, deadline);
+                }
+            }
+            ++it;
+        }
+
+        if(nextDeadline == std::chrono::steady_clock::time_point::max()){
+            m_channelsCV.wait(lock);
+        }
+        else{
+            m_channelsCV.wait_until(lock, nextDeadline);
+        }
+    }
+}
+
+void replyScheduler::Launch(const dpp::snowflake channelId, channelState& channel){
+    auto ticket = std::make_shared<replyTicket>();
+
+    channel.ticket       = ticket;
+    channel.running      = std::move(channel.pending);
+    channel.runningSince = channel.firstPending;
+    channel.pending.clear();
+
+    m_numRunning++;
+
+    std::thread pipeline([this, channelId, ticket, burst = channel.running](void){
+        try{
+            m_pipeline(burst, *ticket);
+        } catch(const std::exception& e){
+            APATE_LOG_WARN("Reply pipeline in channel {} failed - {}", channelId.str(), e.what());
+        } catch(...){
+            APATE_LOG_WARN("Reply pipeline in channel {} failed - unknown exception", channelId.str());
+        }
+
+        std::lock_guard lock(m_channelsMtx);
+        Finish(channelId, ticket);
+    });
+
+    pipeline.detach();
+}
+
+void replyScheduler::Finish(const dpp::snowflake channelId, const std::shared_ptr<replyTicket>& ticket){
+    m_numRunning--;
+
+    // a cancelled pipeline was already replaced, the channel isn't its to clear
+    auto it = m_channels.find(channelId);
+    if(it != m_channels.end() && it->second.ticket == ticket){
+        it->second.ticket.reset();
+        it->second.running.clear();
+    }
+
+    m_channelsCV.notify_all();
+}
+}
@@ -0,0 +1,103 @@
+#ifndef REPLYSCHEDULER_HPP
+#define REPLYSCHEDULER_HPP
+
+#include <dpp/dpp.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace discord{
+
+enum replyTicketState{
+    REPLY_TICKET_RUNNING,
+    REPLY_TICKET_CANCELLED,     // a newer message came in, whatever this pipeline was doing is stale
+    REPLY_TICKET_COMMITTED      // the pipeline is replying, it runs to the end
+};
+
+// Handed to a reply pipeline. The scheduler cancels it when the channel moves on, up until the pipeline
+// commits to replying.
+class replyTicket{
+public:
+    replyTicket(void) = default;
+
+    replyTicket(replyTicket&) = delete;
+    replyTicket(replyTicket&&) = delete;
+    replyTicket& operator=(replyTicket&) = delete;
+    replyTicket& operator=(replyTicket&&) = delete;
+
+    bool Cancelled(void) const { return (REPLY_TICKET_CANCELLED == m_state); }
+
+    // false if the ticket was already cancelled, otherwise it can't be anymore
+    bool Commit(void);
+
+private:
+    friend class replyScheduler;
+
+    bool Cancel(void);
+
+    std::atomic<replyTicketState> m_state = REPLY_TICKET_RUNNING;
+};
+
+// the messages that came in since the channel's last pipeline, oldest first
+typedef std::function<void(const std::vector<dpp::message>& burst, replyTicket& ticket)> replyPipeline;
+
+// Runs at most one live reply pipeline per channel. A message starts a quiet window that every further
+// message restarts, up to maxDelay after the first, and the pipeline runs once over the whole burst.
+// A message arriving while a pipeline is still deciding cancels it and its burst is folded into the
+// next one, unless that burst is already maxDelay old. Once a pipeline commits to replying, new messages
+// wait for it to finish.
+class replyScheduler{
+public:
+    replyScheduler(replyPipeline pipeline);
+    ~replyScheduler();
+
+    replyScheduler(replyScheduler&) = delete;
+    replyScheduler(replyScheduler&&) = delete;
+    replyScheduler& operator=(replyScheduler&) = delete;
+    replyScheduler& operator=(replyScheduler&&) = delete;
+
+    void SetOptions(const std::chrono::milliseconds quietWindow, const std::chrono::milliseconds maxDelay);
+
+    void Schedule(const dpp::message& message);
+
+private:
+    struct channelState{
+        std::vector<dpp::message>             pending;
+        std::chrono::steady_clock::time_point firstPending;
+        std::chrono::steady_clock::time_point lastPending;
+
+        // the pipeline currently allowed to reply, and what it was given in case it gets cancelled
+        std::shared_ptr<replyTicket>          ticket;
+        std::vector<dpp::message>             running;
+        std::chrono::steady_clock::time_point runningSince;
+    };
+
+    void HandleChannels(void);
+
+    // these expect m_channelsMtx to be held
+    void Launch(const dpp::snowflake channelId, channelState& channel);
+    void Finish(const dpp::snowflake channelId, const std::shared_ptr<replyTicket>& ticket);
+
+    replyPipeline m_pipeline;
+
+    std::chrono::milliseconds m_quietWindow = std::chrono::milliseconds(2000);
+    std::chrono::milliseconds m_maxDelay    = std::chrono::milliseconds(8000);
+
+    std::mutex                                       m_channelsMtx;
+    std::condition_variable                          m_channelsCV;
+    std::unordered_map<dpp::snowflake, channelState> m_channels;
+    size_t                                           m_numRunning = 0;
+    bool                                             m_shutDown   = false;
+
+    std::thread m_scheduler;
+};
+}
+
+#endif
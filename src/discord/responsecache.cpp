@@ -0,0 +1,103 @@
+#include "responsecache.hpp"
+
+#include "log/log.hpp"
+
+#include <cmath>
+
+static float CosineSimilarity(const std::span<const float> lhs, const std::span<const float> rhs){
+    if(lhs.size() != rhs.size() || lhs.empty()){
+        return 0.0f;
+    }
+
+    float dot     = 0.0f;
+    float lhsNorm = 0.0f;
+    float rhsNorm = 0.0f;
+
+    for(size_t ii = 0; ii < lhs.size(); ii++){
+        dot     += lhs[ii] * rhs[ii];
+        lhsNorm += lhs[ii] * lhs[ii];
+        rhsNorm += rhs[ii] * rhs[ii];
+    }
+
+    if(lhsNorm <= 0.0f || rhsNorm <= 0.0f){
+        return 0.0f;
+    }
+
+    return dot / (std::sqrt(lhsNorm) * std::sqrt(rhsNorm));
+}
+
+namespace discord{
+
+semanticResponseCache::semanticResponseCache(const float                similarityThreshold,
+                                             const std::chrono::minutes ttl,
+                                             const size_t               maxEntriesPerGuild) :
+    m_similarityThreshold (similarityThreshold),
+    m_ttl                 (ttl),
+    m_maxEntriesPerGuild  (maxEntriesPerGuild){
+}
+
+void semanticResponseCache::SetOptions(const float similarityThreshold, const std::chrono::minutes ttl){
+    std::lock_guard lock(m_cacheMtx);
+    m_similarityThreshold = similarityThreshold;
+    m_ttl                 = ttl;
+}
+
+std::optional<cachedResponse> semanticResponseCache::Find(const dpp::snowflake guildId, const dpp::snowflake channelId, const std::span<const float> questionEmbedding){
+    std::lock_guard lock(m_cacheMtx);
+
+    auto it = m_cacheByGuild.find(guildId);
+    if(it == m_cacheByGuild.end()){
+        return std::nullopt;
+    }
+
+    auto& entries = it->second;
+
+    // oldest entries are at the front, drop whatever has expired
+    const auto now = std::chrono::steady_clock::now();
+    while(!entries.empty() && now - entries.front().createdAt > m_ttl){
+        entries.pop_front();
+    }
+
+    const cachedResponse* best = nullptr;
+    float bestSimilarity = m_similarityThreshold;
+
+    for(const auto& entry : entries){
+        // an answer only fits the conversation it was given in
+        if(entry.channelId != channelId){
+            continue;
+        }
+
+        const float similarity = CosineSimilarity(entry.questionEmbedding, questionEmbedding);
+        if(similarity >= bestSimilarity){
+            bestSimilarity = similarity;
+            best           = &entry;
+        }
+    }
+
+    if(!best){
+        return std::nullopt;
+    }
+
+    APATE_LOG_DEBUG("Response cache hit for guild {} - similarity {}",
+                    guildId.str(),
+                    bestSimilarity);
+    return *best;
+}
+
+void semanticResponseCache::Store(const dpp::snowflake guildId, cachedResponse response){
+    if(response.questionEmbedding.empty() || response.answer.empty()){
+        return;
+    }
+
+    response.createdAt = std::chrono::steady_clock::now();
+
+    std::lock_guard lock(m_cacheMtx);
+
+    auto& entries = m_cacheByGuild[guildId];
+    entries.push_back(std::move(response));
+
+    while(entries.size() > m_maxEntriesPerGuild){
+        entries.pop_front();
+    }
+}
+}
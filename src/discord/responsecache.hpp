@@ -0,0 +1,58 @@
+#ifndef RESPONSECACHE_HPP
+#define RESPONSECACHE_HPP
+
+#include <dpp/dpp.h>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace discord{
+
+struct cachedResponse{
+    std::vector<float> questionEmbedding;
+    std::string        answer;
+
+    // where the answer was given and the newest message it had seen at the time
+    dpp::snowflake channelId;
+    dpp::snowflake watermark;
+
+    std::chrono::steady_clock::time_point createdAt;
+};
+
+// Per-guild cache of answers keyed by question embedding. A new question whose embedding is close enough
+// to one already answered in the same channel gets the old answer back instead of another LLM round trip.
+class semanticResponseCache{
+public:
+    semanticResponseCache(const float                similarityThreshold = 0.92f,
+                          const std::chrono::minutes ttl                 = std::chrono::minutes(360),
+                          const size_t               maxEntriesPerGuild  = 256);
+
+    semanticResponseCache(semanticResponseCache&) = delete;
+    semanticResponseCache(semanticResponseCache&&) = delete;
+    semanticResponseCache& operator=(semanticResponseCache&) = delete;
+    semanticResponseCache& operator=(semanticResponseCache&&) = delete;
+
+    void SetOptions(const float similarityThreshold, const std::chrono::minutes ttl);
+
+    // most similar unexpired entry from channelId at or above the threshold
+    std::optional<cachedResponse> Find(const dpp::snowflake guildId, const dpp::snowflake channelId, const std::span<const float> questionEmbedding);
+
+    void Store(const dpp::snowflake guildId, cachedResponse response);
+
+private:
+    std::mutex m_cacheMtx;
+    std::map<dpp::snowflake, std::deque<cachedResponse>> m_cacheByGuild;
+
+    float                m_similarityThreshold;
+    std::chrono::minutes m_ttl;
+    size_t               m_maxEntriesPerGuild;
+};
+}
+
+#endif
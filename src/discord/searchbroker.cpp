@@ -0,0 +1,124 @@
+#include "searchbroker.hpp"
+
+#include "log/log.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace discord{
+
+searchBroker::searchBroker(const size_t                    dim,
+                           batchSearchFunc                 searchFunc,
+                           const std::chrono::microseconds window,
+                           const size_t                    maxBatch) :
+    m_dim        (dim),
+    m_searchFunc (std::move(searchFunc)),
+    m_window     (window),
+    m_maxBatch   (std::max<size_t>(1, maxBatch)){
+}
+
+std::vector<searchHit> searchBroker::Search(const std::span<const float> query, const size_t k){
+    if(query.size() != m_dim){
+        APATE_LOG_WARN_AND_THROW(std::invalid_argument,
+                                 "Query dimension {} does not match index dimension {}",
+                                 query.size(),
+                                 m_dim);
+    }
+
+    if(!k){
+        return {};
+    }
+
+    auto search   = std::make_shared<pendingSearch>();
+    search->query.assign(query.begin(), query.end());
+    search->k     = k;
+    auto future   = search->promise.get_future();
+
+    std::unique_lock lock(m_batchMtx);
+
+    const bool leader = !m_openBatch;
+    if(leader){
+        m_openBatch = std::make_shared<pendingBatch>();
+    }
+
+    std::shared_ptr<pendingBatch> batch = m_openBatch;
+    batch->searches.push_back(search);
+
+    if(batch->searches.size() >= m_maxBatch){
+        // full, close it so the leader can go now
+        m_openBatch.reset();
+        m_batchCV.notify_all();
+    }
+
+    if(!leader){
+        lock.unlock();
+        return future.get();
+    }
+
+    // an idle index is searched right away, queries only pile up behind a search that's running
+    if(m_runningBatches > 0){
+        m_batchCV.wait_for(lock, m_window, [&](){ return m_openBatch != batch || 0 == m_runningBatches; });
+    }
+    if(m_openBatch == batch){
+        m_openBatch.reset();
+    }
+    m_runningBatches++;
+    lock.unlock();
+
+    RunBatch(*batch);
+
+    lock.lock();
+    m_runningBatches--;
+    lock.unlock();
+    m_batchCV.notify_all();
+
+    return future.get();
+}
+
+void searchBroker::RunBatch(pendingBatch& batch){
+    const size_t numQueries = batch.searches.size();
+
+    size_t maxK = 0;
+    for(const auto& search : batch.searches){
+        maxK = std::max(maxK, search->k);
+    }
+
+    std::vector<float>        queries(numQueries * m_dim);
+    std::vector<float>        scores(numQueries * maxK);
+    std::vector<faiss::idx_t> labels(numQueries * maxK, -1);
+
+    for(size_t ii = 0; ii < numQueries; ii++){
+        std::copy(batch.searches[ii]->query.begin(),
+                  batch.searches[ii]->query.end(),
+                  queries.begin() + ii * m_dim);
+    }
+
+    try{
+        m_searchFunc(numQueries, queries.data(), maxK, scores.data(), labels.data());
+    } catch(...){
+        for(auto& search : batch.searches){
+            search->promise.set_exception(std::current_exception());
+        }
+        return;
+    }
+
+    for(size_t ii = 0; ii < numQueries; ii++){
+        auto& search = batch.searches[ii];
+
+        std::vector<searchHit> hits;
+        hits.reserve(search->k);
+
+        for(size_t jj = 0; jj < search->k; jj++){
+            const size_t offset = ii * maxK + jj;
+
+            // faiss pads with -1 when the index has fewer than k entries
+            if(labels[offset] < 0){
+                continue;
+            }
+            hits.push_back({ labels[offset], scores[offset] });
+        }
+
+        search->promise.set_value(std::move(hits));
+    }
+}
+}
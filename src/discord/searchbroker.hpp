@@ -0,0 +1,73 @@
+#ifndef SEARCHBROKER_HPP
+#define SEARCHBROKER_HPP
+
+#include <faiss/Index.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+namespace discord{
+
+struct searchHit{
+    faiss::idx_t label = -1;
+    float        score = 0.0f;
+};
+
+// Coalesces concurrent single-vector queries against one index into a single batched search.
+// The first caller to arrive leads the batch. With no other search running it goes straight away,
+// otherwise it waits for the running one to finish, the window to pass or the batch to fill, then
+// runs the search for everyone that joined and fans the results back out.
+class searchBroker{
+public:
+    // row-major queries [numQueries x dim] in, row-major results [numQueries x k] out
+    typedef std::function<void(const size_t       numQueries,
+                               const float*       queries,
+                               const size_t       k,
+                               float*             scores,
+                               faiss::idx_t*      labels)> batchSearchFunc;
+
+    searchBroker(const size_t                    dim,
+                 batchSearchFunc                 searchFunc,
+                 const std::chrono::microseconds window   = std::chrono::microseconds(2000),
+                 const size_t                    maxBatch = 64);
+
+    searchBroker(searchBroker&) = delete;
+    searchBroker(searchBroker&&) = delete;
+    searchBroker& operator=(searchBroker&) = delete;
+    searchBroker& operator=(searchBroker&&) = delete;
+
+    // best match first. Labels the index couldn't fill are dropped.
+    std::vector<searchHit> Search(const std::span<const float> query, const size_t k);
+
+private:
+    struct pendingSearch{
+        std::vector<float>                     query;
+        size_t                                 k = 0;
+        std::promise<std::vector<searchHit>>   promise;
+    };
+
+    struct pendingBatch{
+        std::vector<std::shared_ptr<pendingSearch>> searches;
+    };
+
+    void RunBatch(pendingBatch& batch);
+
+    size_t                    m_dim;
+    batchSearchFunc           m_searchFunc;
+    std::chrono::microseconds m_window;
+    size_t                    m_maxBatch;
+
+    std::mutex                    m_batchMtx;
+    std::condition_variable       m_batchCV;
+    std::shared_ptr<pendingBatch> m_openBatch;
+    size_t                        m_runningBatches = 0;
+};
+}
+
+#endif
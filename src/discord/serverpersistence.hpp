@@ -1,6 +1,7 @@
 #ifndef SERVER_PERSISTENCE_HPP
 #define SERVER_PERSISTENCE_HPP
 
+#include <embed/embeddingmatrix.hpp>
 #include <log/log.hpp>
 
 #include <dpp/dpp.h>
@@ -18,9 +19,10 @@
 namespace discord
 {
 
-struct embeddingRecord{
-    dpp::snowflake     messageId;
-    std::vector<float> embedding;
+// row ii of embeddings belongs to messageIds[ii]
+struct embeddingRecords{
+    std::vector<dpp::snowflake> messageIds;
+    embeddingMatrix             embeddings;
 };
 
 struct messageRecord{
@@ -74,12 +76,13 @@ public:
     sql_rc GetLatestMessagesByChannel(const dpp::snowflake channelId, const size_t numMessages, std::vector<messageRecord> &message);
     size_t GetContinuousMessages(const dpp::snowflake channelId, const dpp::snowflake since);
     dpp::snowflake GetOldestContinuousTimestamp(const dpp::snowflake channelId, const dpp::snowflake since);
-    sql_rc StoreEmbedding(const dpp::snowflake channelId, const dpp::snowflake messageId, std::vector<float>& embedding);
+    size_t CountMessagesSince(const dpp::snowflake channelId, const dpp::snowflake since);
+    sql_rc StoreEmbeddings(const dpp::snowflake channelId, const std::vector<dpp::snowflake>& messageIds, const embeddingMatrix& embeddings);
     bool HasEmbedding(const dpp::snowflake channelId, const dpp::snowflake messageId);
 
     bool FindMessage(const dpp::snowflake& channelID, const dpp::snowflake messageId, messageRecord& message);
 
-    std::vector<embeddingRecord> GetVectorEmbeddings(const dpp::snowflake channelId);
+    embeddingRecords GetVectorEmbeddings(const dpp::snowflake channelId);
 
     ~persistenceDatabase();
 
@@ -123,8 +126,9 @@ public:
     void RecordOldMessagesContinuous(const dpp::message_map &messages);
 
     size_t CountContinuousMessages(const dpp::snowflake channelId, const dpp::snowflake since);
+    size_t CountMessagesSince(const dpp::snowflake channelId, const dpp::snowflake since);
 
-    void SaveEmbedding (const dpp::snowflake channelId, const dpp::snowflake messageId, std::vector<float>& embedding);
+    void SaveEmbeddings (const dpp::snowflake channelId, const std::vector<dpp::snowflake>& messageIds, const embeddingMatrix& embeddings);
     bool HasEmbedding(const dpp::snowflake channelId, const dpp::snowflake messageId);
 
     dpp::snowflake GetOldestContinuousTimestamp(const dpp::snowflake channelId, const dpp::snowflake since);
@@ -132,7 +136,7 @@ public:
     std::vector<messageRecord> GetContinousMessagesByChannel(const dpp::snowflake& channelID, const size_t numMessages);
     bool FindMessage(const dpp::snowflake& channelID, const dpp::snowflake messageId, messageRecord& message);
 
-    std::vector<embeddingRecord> GetVectorEmbeddings(const dpp::snowflake channelId);
+    embeddingRecords GetVectorEmbeddings(const dpp::snowflake channelId);
 
     serverPersistence& swap(serverPersistence& rhs);
 
@@ -0,0 +1,143 @@
+#include "streamedreply.hpp"
+
+#include "log/log.hpp"
+
+// how long Finish waits on the first post before giving up and posting the final text on its own
+static const std::chrono::seconds FIRST_POST_TIMEOUT = std::chrono::seconds(10);
+
+namespace discord{
+
+streamedReply::streamedReply(dpp::cluster&                   cluster,
+                             const dpp::snowflake            channelId,
+                             const std::chrono::milliseconds editInterval,
+                             const size_t                    firstPostChars) :
+    m_cluster        (cluster),
+    m_channelId      (channelId),
+    m_editInterval   (editInterval),
+    m_firstPostChars (firstPostChars){
+}
+
+void streamedReply::Update(const std::string& text){
+    std::lock_guard lock(m_replyMtx);
+
+    if(m_failed){
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+
+    if(!m_posting){
+        // a word or two on its own just looks like a glitch
+        if(text.size() >= m_firstPostChars){
+            Post(text);
+            m_lastUpdate = now;
+        }
+        return;
+    }
+
+    // still waiting on discord for the first post
+    if(m_messageId.empty() || now - m_lastUpdate < m_editInterval){
+        return;
+    }
+
+    Edit(text);
+    m_lastUpdate = now;
+}
+
+void streamedReply::Finish(const std::string& text){
+    std::unique_lock lock(m_replyMtx);
+
+    if(!m_posting){
+        Post(text);
+        return;
+    }
+
+    m_postedCV.wait_for(lock, FIRST_POST_TIMEOUT, [&](){ return m_postDone; });
+
+    if(m_messageId.empty()){
+        APATE_LOG_WARN("Streamed reply in channel {} never got posted, posting the final text instead",
+                       m_channelId.str());
+
+        dpp::message msg;
+        msg.content    = text;
+        msg.channel_id = m_channelId;
+
+        m_cluster.message_create(msg);
+        return;
+    }
+
+    if(text != m_shownText){
+        Edit(text);
+    }
+}
+
+void streamedReply::Fail(void){
+    std::lock_guard lock(m_replyMtx);
+
+    m_failed = true;
+
+    // nothing posted yet, or the post's callback will see m_failed
+    if(m_messageId.empty()){
+        return;
+    }
+
+    Delete();
+}
+
+void streamedReply::Post(const std::string& text){
+    m_posting   = true;
+    m_shownText = text;
+
+    dpp::message msg;
+    msg.content    = text;
+    msg.channel_id = m_channelId;
+
+    m_cluster.message_create(msg, [self = shared_from_this()](const dpp::confirmation_callback_t& callback){
+        std::lock_guard lock(self->m_replyMtx);
+
+        if(callback.is_error()){
+            APATE_LOG_WARN("Failed to post streamed reply in channel {} - {}",
+                           self->m_channelId.str(),
+                           callback.get_error().message);
+        }
+        else{
+            self->m_messageId = callback.get<dpp::message>().id;
+
+            // the response failed while this was on its way
+            if(self->m_failed){
+                self->Delete();
+            }
+        }
+
+        self->m_postDone = true;
+        self->m_postedCV.notify_all();
+    });
+}
+
+void streamedReply::Edit(const std::string& text){
+    m_shownText = text;
+
+    dpp::message msg;
+    msg.id         = m_messageId;
+    msg.content    = text;
+    msg.channel_id = m_channelId;
+
+    m_cluster.message_edit(msg, [channelId = m_channelId](const dpp::confirmation_callback_t& callback){
+        if(callback.is_error()){
+            APATE_LOG_DEBUG("Failed to edit streamed reply in channel {} - {}",
+                            channelId.str(),
+                            callback.get_error().message);
+        }
+    });
+}
+
+void streamedReply::Delete(void){
+    m_cluster.message_delete(m_messageId, m_channelId, [channelId = m_channelId](const dpp::confirmation_callback_t& callback){
+        if(callback.is_error()){
+            APATE_LOG_WARN("Failed to delete a failed streamed reply in channel {} - {}",
+                           channelId.str(),
+                           callback.get_error().message);
+        }
+    });
+}
+}
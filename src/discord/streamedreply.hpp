@@ -0,0 +1,63 @@
+#ifndef STREAMEDREPLY_HPP
+#define STREAMEDREPLY_HPP
+
+#include <dpp/cluster.h>
+#include <dpp/dpp.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace discord{
+
+// A reply that shows up in the channel while it's still being generated. The first update with enough
+// text posts the message, later ones edit it no more often than editInterval to stay clear of discord's
+// rate limits. Finish puts the final text in place, Fail takes down a reply that won't be finished.
+// Always held by a shared_ptr, discord's callbacks keep it alive until they've run.
+class streamedReply : public std::enable_shared_from_this<streamedReply>{
+public:
+    streamedReply(dpp::cluster&                   cluster,
+                  const dpp::snowflake            channelId,
+                  const std::chrono::milliseconds editInterval   = std::chrono::milliseconds(1000),
+                  const size_t                    firstPostChars = 24);
+
+    streamedReply(streamedReply&) = delete;
+    streamedReply(streamedReply&&) = delete;
+    streamedReply& operator=(streamedReply&) = delete;
+    streamedReply& operator=(streamedReply&&) = delete;
+
+    // text so far, usually straight from a chatGPTStreamCallback
+    void Update(const std::string& text);
+
+    // waits a little for the first post to land if it's still in flight, so the final text is an edit of it
+    void Finish(const std::string& text);
+
+    // the response failed, whatever was posted is deleted rather than left cut off mid sentence.
+    // A first post still in flight is deleted when it lands, later updates are ignored.
+    void Fail(void);
+
+private:
+    // these expect m_replyMtx to be held
+    void Post(const std::string& text);
+    void Edit(const std::string& text);
+    void Delete(void);
+
+    dpp::cluster&             m_cluster;
+    dpp::snowflake            m_channelId;
+    std::chrono::milliseconds m_editInterval;
+    size_t                    m_firstPostChars;
+
+    std::mutex                            m_replyMtx;
+    std::condition_variable               m_postedCV;
+    bool                                  m_posting  = false;
+    bool                                  m_postDone = false;
+    bool                                  m_failed   = false;
+    dpp::snowflake                        m_messageId;
+    std::string                           m_shownText;
+    std::chrono::steady_clock::time_point m_lastUpdate;
+};
+}
+
+#endif
@@ -0,0 +1,141 @@
+#include "transcriptcache.hpp"
+
+#include <algorithm>
+#include <format>
+
+namespace discord{
+
+void transcriptCache::channelTranscript::Push(std::shared_ptr<const transcriptLine> line){
+    if(size < lines.size()){
+        lines[(head + size) % lines.size()] = std::move(line);
+        size++;
+    }
+    else{
+        lines[head] = std::move(line);
+        head        = (head + 1) % lines.size();
+    }
+}
+
+void transcriptCache::channelTranscript::Clear(void){
+    std::fill(lines.begin(), lines.end(), nullptr);
+    head = 0;
+    size = 0;
+}
+
+transcriptCache::transcriptCache(const size_t maxLines) :
+    m_maxLines (std::max<size_t>(1, maxLines)){
+}
+
+void transcriptCache::SetTokenCounter(transcriptTokenCounter counter){
+    m_countTokens = std::move(counter);
+}
+
+void transcriptCache::Append(const messageRecord& record){
+    auto line = MakeLine(record);
+
+    std::lock_guard lock(m_transcriptsMtx);
+    channelTranscript& transcript = GetTranscript(record.channelId);
+
+    if(transcript.size > 0 && transcript.At(transcript.size - 1)->snowflake >= line->snowflake){
+        return;
+    }
+
+    transcript.Push(std::move(line));
+}
+
+transcriptSnapshot transcriptCache::Latest(const dpp::snowflake channelId, const transcriptSeed& seed){
+    std::unique_lock lock(m_transcriptsMtx);
+    channelTranscript* transcript = &GetTranscript(channelId);
+
+    if(!transcript->seeded){
+        const size_t generation = transcript->generation;
+        lock.unlock();
+
+        // the database has everything recorded so far, lines appended while it's being read are kept below
+        std::vector<messageRecord> records = seed();
+
+        std::vector<std::shared_ptr<const transcriptLine>> seeded;
+        seeded.reserve(std::min(records.size(), m_maxLines));
+
+        for(size_t ii = std::min(records.size(), m_maxLines); ii-- > 0;){
+            seeded.push_back(MakeLine(records[ii]));
+        }
+
+        lock.lock();
+        transcript = &GetTranscript(channelId);
+
+        std::vector<std::shared_ptr<const transcriptLine>> newer;
+        for(size_t ii = 0; ii < transcript->size; ii++){
+            if(seeded.empty() || transcript->At(ii)->snowflake > seeded.back()->snowflake){
+                newer.push_back(transcript->At(ii));
+            }
+        }
+
+        transcript->Clear();
+        for(auto& line : seeded){
+            transcript->Push(std::move(line));
+        }
+        for(auto& line : newer){
+            transcript->Push(std::move(line));
+        }
+
+        // invalidated while reading, what was read could already be missing something
+        transcript->seeded = (generation == transcript->generation);
+    }
+
+    transcriptSnapshot snapshot;
+    snapshot.reserve(transcript->size);
+
+    for(size_t ii = transcript->size; ii-- > 0;){
+        snapshot.push_back(transcript->At(ii));
+    }
+
+    return snapshot;
+}
+
+void transcriptCache::Invalidate(const dpp::snowflake channelId, const dpp::snowflake newest){
+    std::lock_guard lock(m_transcriptsMtx);
+
+    auto it = m_transcripts.find(channelId);
+    if(it == m_transcripts.end()){
+        return;
+    }
+
+    channelTranscript& transcript = it->second;
+    if(transcript.size < transcript.lines.size() || newest >= transcript.At(0)->snowflake){
+        transcript.seeded = false;
+        transcript.generation++;
+    }
+}
+
+std::string transcriptCache::FormatLine(const messageRecord& record){
+    return std::format("[{}]: {} (id: {}): {}\n",
+                       record.timeStampFriendly,
+                       record.authorUserName,
+                       record.authorId.str(),
+                       record.message);
+}
+
+std::shared_ptr<const transcriptLine> transcriptCache::MakeLine(const messageRecord& record) const{
+    auto line = std::make_shared<transcriptLine>();
+
+    line->snowflake       = record.snowflake;
+    line->authorId        = record.authorId;
+    line->timeStampUnixMs = record.timeStampUnixMs;
+    line->line            = FormatLine(record);
+    line->messageOffset   = line->line.size() - record.message.size() - 1;
+    line->tokens          = m_countTokens ? m_countTokens(line->line) : 0;
+
+    return line;
+}
+
+transcriptCache::channelTranscript& transcriptCache::GetTranscript(const dpp::snowflake channelId){
+    channelTranscript& transcript = m_transcripts[channelId];
+
+    if(transcript.lines.empty()){
+        transcript.lines.resize(m_maxLines);
+    }
+
+    return transcript;
+}
+}
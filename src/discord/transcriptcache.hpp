@@ -0,0 +1,91 @@
+#ifndef TRANSCRIPTCACHE_HPP
+#define TRANSCRIPTCACHE_HPP
+
+#include "discord/serverpersistence.hpp"
+
+#include <dpp/dpp.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace discord{
+
+// a message as it goes into a prompt, formatted and counted once when it comes in
+struct transcriptLine{
+    dpp::snowflake snowflake;
+    dpp::snowflake authorId;
+    long long      timeStampUnixMs = 0;
+
+    // "[time]: user (id: ...): message\n"
+    std::string line;
+    size_t      messageOffset = 0;
+    size_t      tokens        = 0;
+
+    std::string_view Message(void) const { return std::string_view(line).substr(messageOffset, line.size() - messageOffset - 1); }
+};
+
+// latest first, the lines are shared with the cache and never change
+typedef std::vector<std::shared_ptr<const transcriptLine>> transcriptSnapshot;
+
+typedef std::function<size_t(const std::string_view text)> transcriptTokenCounter;
+typedef std::function<std::vector<messageRecord>(void)>     transcriptSeed;
+
+// The latest maxLines messages of every channel, ready to be concatenated into prompts. Messages are
+// appended as they're recorded and the oldest drops off, a channel is seeded from the database the first
+// time it's read or after messages were recorded out of order.
+class transcriptCache{
+public:
+    transcriptCache(const size_t maxLines = 50);
+
+    transcriptCache(transcriptCache&) = delete;
+    transcriptCache(transcriptCache&&) = delete;
+    transcriptCache& operator=(transcriptCache&) = delete;
+    transcriptCache& operator=(transcriptCache&&) = delete;
+
+    // lines are counted with this as they come in, set it before anything is appended
+    void SetTokenCounter(transcriptTokenCounter counter);
+
+    // older than the channel's latest line is left to the next seed
+    void Append(const messageRecord& record);
+
+    // seed gives the channel's latest messages, latest first, and is only called when it needs seeding
+    transcriptSnapshot Latest(const dpp::snowflake channelId, const transcriptSeed& seed);
+
+    // messages up to newest were recorded behind the cache's back, such as by the archiver's backfill.
+    // The channel is seeded again if they could be in its transcript.
+    void Invalidate(const dpp::snowflake channelId, const dpp::snowflake newest);
+
+    static std::string FormatLine(const messageRecord& record);
+
+private:
+    // ring of the latest lines, oldest at head
+    struct channelTranscript{
+        std::vector<std::shared_ptr<const transcriptLine>> lines;
+        size_t                                             head       = 0;
+        size_t                                             size       = 0;
+        bool                                               seeded     = false;
+        size_t                                             generation = 0;
+
+        const std::shared_ptr<const transcriptLine>& At(const size_t ii) const { return lines[(head + ii) % lines.size()]; }
+
+        void Push(std::shared_ptr<const transcriptLine> line);
+        void Clear(void);
+    };
+
+    std::shared_ptr<const transcriptLine> MakeLine(const messageRecord& record) const;
+    channelTranscript&                    GetTranscript(const dpp::snowflake channelId);
+
+    size_t                 m_maxLines;
+    transcriptTokenCounter m_countTokens;
+
+    std::mutex                                           m_transcriptsMtx;
+    std::unordered_map<dpp::snowflake, channelTranscript> m_transcripts;
+};
+}
+
+#endif
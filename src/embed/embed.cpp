@@ -1,168 +1,347 @@
-#include "embed.hpp"
-
-#include "log/log.hpp"
-
-#include <curl/curl.h>
-#include <nlohmann/json.hpp>
-
-static size_t CurlWriteToString(void* contents, size_t size, size_t nmemb, std::string* response) {
-    const size_t totalSize = size * nmemb;
-    response->append((char*)contents, totalSize);
-    return totalSize;
-}
-
-
-std::future<std::vector<float>> TransformSentence(const std::string_view message, const std::string_view server, int port){
-    std::future<std::vector<float>> future = std::async(std::launch::async,
-
-        [](const std::string &message,
-            const std::string &server,
-            const int port){
-
-            CURL* curl = curl_easy_init();
-
-            // make the embedding request
-            nlohmann::json request;
-            request["text"] = message;
-
-            std::string requestStr = request.dump ();
-
-            struct curl_slist* headers = NULL;
-            headers = curl_slist_append(headers, "Content-Type: application/json");
-
-            std::string embedResponse;
-            std::string url = std::format("http://{}:{}/embed", server, port);
-            curl_easy_setopt(curl, CURLOPT_URL, url.c_str ());
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, requestStr.c_str ());
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, requestStr.size ());
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, CurlWriteToString);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &embedResponse);
-            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-
-            auto HTTPCode = curl_easy_perform(curl);
-
-
-            std::vector<float> result;
-
-            if(HTTPCode != CURLE_OK){
-                APATE_LOG_WARN("Failed to get embedding from server {}:{} - {}",
-                               server,
-                               port,
-                               curl_easy_strerror(HTTPCode));
-            }
-            else{
-                try{
-                    nlohmann::json response = nlohmann::json::parse(embedResponse);
-
-                    if(response.contains("embedding") && response["embedding"].is_array()){
-                        for(const auto& item : response["embedding"]){
-                            result.push_back(item.get<float>());
-                        }
-                    }
-                    else{
-                        APATE_LOG_WARN("Invalid embedding response - {}",
-                                       embedResponse);
-                    }
-                }
-                catch (...){
-                    APATE_LOG_WARN("Failed to parse embedding response - {}",
-                                   embedResponse);
-                }
-            }
-
-
-            if (nullptr != headers){
-                curl_slist_free_all (headers);
-            }
-
-            if (nullptr != curl){
-                curl_easy_cleanup(curl);
-            }
-
-            return result;
-
-            }, std::string (message), std::string (server), port);
-
-
-    return future;
-}
-
-std::future<Embeddings> TransformSentences(const std::vector<std::string> &messages, const std::string_view server, int port){
-    std::future<Embeddings> future = std::async(std::launch::async,
-
-        [](const std::vector<std::string> &messages,
-           const std::string &server,
-           const int port){
-
-            CURL* curl = curl_easy_init();
-
-            // make the embedding request
-            nlohmann::json request;
-            for(const auto& message : messages){
-                request["texts"].push_back(message);
-            }
-
-            std::string requestStr = request.dump ();
-
-            struct curl_slist* headers = NULL;
-            headers = curl_slist_append(headers, "Content-Type: application/json");
-
-            std::string embedResponse;
-            std::string url = std::format("http://{}:{}/embed", server, port);
-            curl_easy_setopt(curl, CURLOPT_URL, url.c_str ());
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, requestStr.c_str ());
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, requestStr.size ());
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, CurlWriteToString);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &embedResponse);
-            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-
-            auto HTTPCode = curl_easy_perform(curl);
-
-            Embeddings result;
-
-            if(HTTPCode != CURLE_OK){
-                APATE_LOG_WARN("Failed to get embedding from server {}:{} - {}",
-                               server,
-                               port,
-                               curl_easy_strerror(HTTPCode));
-            }
-            else{
-                try{
-                    nlohmann::json response = nlohmann::json::parse(embedResponse);
-
-                    if(response.contains("embedding") && response["embedding"].is_array()){
-                        auto& embeddingsArray = response["embedding"];
-
-                        for(const auto& embeddings : embeddingsArray){
-                            result.push_back(embeddings.get<std::vector<float>>());
-                        }
-                    }
-                    else{
-                        APATE_LOG_WARN("Invalid embedding response - {}",
-                                       embedResponse);
-                    }
-                }
-                catch (...){
-                    APATE_LOG_WARN("Failed to parse embedding response - {}",
-                                   embedResponse);
-                }
-            }
-
-
-            if (nullptr != headers){
-                curl_slist_free_all (headers);
-            }
-
-            if (nullptr != curl){
-                curl_easy_cleanup(curl);
-            }
-
-            return result;
-
-            }, messages, std::string (server), port);
-
-
-    return future;
-}
+#include "embed.hpp"
+
+#include "embed/embedbatcher.hpp"
+
+#include "common/halffloat.hpp"
+#include "common/util.hpp"
+#include "log/log.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <bit>
+#include <cstring>
+#include <format>
+
+static_assert(std::endian::native == std::endian::little, "binary embedding responses are decoded in place as little endian");
+
+static const char   BINARY_EMBEDDING_MAGIC[4]    = { 'E', 'M', 'B', '1' };
+static const size_t BINARY_EMBEDDING_HEADER_SIZE = 16;
+
+// must line up with the encoding field the server writes
+enum binaryEmbeddingEncoding : uint32_t{
+    BINARY_EMBEDDING_FP32 = 0,
+    BINARY_EMBEDDING_FP16 = 1
+};
+
+static const long CONNECT_TIMEOUT_MS = 5000;
+static const long REQUEST_TIMEOUT_MS = 60000;
+
+static const char* ACCEPT_HEADERS[EMBEDDING_WIRE_DELIMITER] = {
+    "Accept: application/json",
+    "Accept: application/x-embeddings-f32, application/json;q=0.5",
+    "Accept: application/x-embeddings-f16, application/json;q=0.5"
+};
+
+static size_t CurlWriteToString(void* contents, size_t size, size_t nmemb, std::string* response) {
+    const size_t totalSize = size * nmemb;
+    response->append((char*)contents, totalSize);
+    return totalSize;
+}
+
+static bool IsBinaryResponse(CURL* curl){
+    char* contentType = nullptr;
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &contentType);
+
+    return (nullptr != contentType && std::string_view(contentType).starts_with("application/x-embeddings"));
+}
+
+embeddingWireFormat EmbeddingWireFormatFromString(const std::string_view str){
+    const std::string lower = ToLowercase(str);
+
+    if(lower == "json"){
+        return EMBEDDING_WIRE_JSON;
+    }
+    if(lower == "fp16"){
+        return EMBEDDING_WIRE_FP16;
+    }
+    if(lower != "fp32"){
+        APATE_LOG_WARN("Unknown embedding wire format '{}', using fp32", str);
+    }
+    return EMBEDDING_WIRE_FP32;
+}
+
+static bool DecodeBinaryEmbeddings(const std::string_view response, embeddingMatrix& result){
+    if(response.size() < BINARY_EMBEDDING_HEADER_SIZE || std::memcmp(response.data(), BINARY_EMBEDDING_MAGIC, sizeof(BINARY_EMBEDDING_MAGIC))){
+        return false;
+    }
+
+    uint32_t count    = 0;
+    uint32_t dim      = 0;
+    uint32_t encoding = 0;
+    std::memcpy(&count,    response.data() + 4,  sizeof(count));
+    std::memcpy(&dim,      response.data() + 8,  sizeof(dim));
+    std::memcpy(&encoding, response.data() + 12, sizeof(encoding));
+
+    size_t valueSize = 0;
+    switch(encoding){
+        case BINARY_EMBEDDING_FP32: valueSize = sizeof(float);    break;
+        case BINARY_EMBEDDING_FP16: valueSize = sizeof(uint16_t); break;
+        default:
+            return false;
+    }
+
+    if(response.size() != BINARY_EMBEDDING_HEADER_SIZE + (size_t)count * dim * valueSize){
+        return false;
+    }
+
+    const char* values = response.data() + BINARY_EMBEDDING_HEADER_SIZE;
+
+    result = embeddingMatrix(count, dim);
+
+    if(BINARY_EMBEDDING_FP32 == encoding){
+        std::memcpy(result.Data(), values, (size_t)count * dim * valueSize);
+    }
+    else{
+        float* dest = result.Data();
+        for(size_t ii = 0; ii < (size_t)count * dim; ii++){
+            uint16_t half = 0;
+            std::memcpy(&half, values + ii * valueSize, sizeof(half));
+            dest[ii] = HalfToFloat(half);
+        }
+    }
+    return true;
+}
+
+// Pulls the rows of {"embedding": [[...], ...]} straight into one flat buffer instead of building
+// a DOM and converting every row into its own vector. Anything else in the response is ignored.
+class embeddingResponseSax : public nlohmann::json_sax<nlohmann::json>{
+public:
+    embeddingResponseSax(const size_t expectedRows) : m_expectedRows(expectedRows){
+    }
+
+    bool null() override { return !m_inEmbedding; }
+    bool boolean(bool) override { return !m_inEmbedding; }
+    bool number_integer(number_integer_t val) override { return Value((float)val); }
+    bool number_unsigned(number_unsigned_t val) override { return Value((float)val); }
+    bool number_float(number_float_t val, const string_t&) override { return Value((float)val); }
+    bool string(string_t&) override { return !m_inEmbedding; }
+    bool binary(binary_t&) override { return !m_inEmbedding; }
+
+    bool start_object(std::size_t) override {
+        m_depth++;
+        return !m_inEmbedding;
+    }
+
+    bool end_object() override {
+        m_depth--;
+        return true;
+    }
+
+    bool key(string_t& val) override {
+        m_embeddingKey = (1 == m_depth && "embedding" == val);
+        return true;
+    }
+
+    bool start_array(std::size_t) override {
+        m_depth++;
+
+        if(2 == m_depth && m_embeddingKey){
+            m_inEmbedding = true;
+            m_found       = true;
+        }
+        else if(3 == m_depth && m_inEmbedding){
+            m_rowValues = 0;
+        }
+        else if(m_inEmbedding){
+            return false;
+        }
+        return true;
+    }
+
+    bool end_array() override {
+        if(3 == m_depth && m_inEmbedding){
+            if(!m_rows){
+                m_dim = m_rowValues;
+                m_values.reserve(m_expectedRows * m_dim);
+            }
+            else if(m_rowValues != m_dim){
+                return false;
+            }
+            m_rows++;
+        }
+        else if(2 == m_depth && m_inEmbedding){
+            m_inEmbedding  = false;
+            m_embeddingKey = false;
+        }
+
+        m_depth--;
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) override {
+        return false;
+    }
+
+    bool Found(void) const { return m_found; }
+
+    embeddingMatrix Release(void){
+        return embeddingMatrix(m_rows, m_dim, std::move(m_values));
+    }
+
+private:
+    bool Value(const float val){
+        if(!m_inEmbedding){
+            return true;
+        }
+        if(3 != m_depth){
+            return false;
+        }
+
+        m_values.push_back(val);
+        m_rowValues++;
+        return true;
+    }
+
+    size_t             m_expectedRows = 0;
+    size_t             m_depth        = 0;
+    bool               m_embeddingKey = false;
+    bool               m_inEmbedding  = false;
+    bool               m_found        = false;
+
+    size_t             m_rows      = 0;
+    size_t             m_dim       = 0;
+    size_t             m_rowValues = 0;
+    std::vector<float> m_values;
+};
+
+embeddingClient::embeddingClient(const std::string_view    server,
+                                 const int                 port,
+                                 const embeddingWireFormat wireFormat) :
+    m_server     (server),
+    m_port       (port),
+    m_url        (std::format("http://{}:{}/embed", server, port)),
+    m_wireFormat (wireFormat){
+
+    for(size_t format = 0; format < EMBEDDING_WIRE_DELIMITER; format++){
+        m_headers[format] = curl_slist_append(m_headers[format], "Content-Type: application/json");
+        m_headers[format] = curl_slist_append(m_headers[format], ACCEPT_HEADERS[format]);
+    }
+}
+
+embeddingClient::~embeddingClient(){
+    std::lock_guard lock(m_handlesMtx);
+
+    for(CURL* handle : m_idleHandles){
+        curl_easy_cleanup(handle);
+    }
+    m_idleHandles.clear();
+
+    for(auto& headers : m_headers){
+        if(nullptr != headers){
+            curl_slist_free_all(headers);
+            headers = nullptr;
+        }
+    }
+}
+
+void embeddingClient::SetWireFormat(const embeddingWireFormat wireFormat){
+    m_wireFormat = wireFormat;
+}
+
+std::string embeddingClient::Name(void) const{
+    return std::format("{}:{}", m_server, m_port);
+}
+
+CURL* embeddingClient::AcquireHandle(void){
+    {
+        std::lock_guard lock(m_handlesMtx);
+        if(!m_idleHandles.empty()){
+            CURL* handle = m_idleHandles.back();
+            m_idleHandles.pop_back();
+            return handle;
+        }
+    }
+
+    CURL* handle = curl_easy_init();
+    if(nullptr != handle){
+        curl_easy_setopt(handle, CURLOPT_URL, m_url.c_str ());
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, CurlWriteToString);
+        curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+
+        // a hung server has to show up as a failure, or the batcher can't back off from it
+        curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, CONNECT_TIMEOUT_MS);
+        curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, REQUEST_TIMEOUT_MS);
+    }
+    return handle;
+}
+
+void embeddingClient::ReleaseHandle(CURL* handle){
+    if(nullptr == handle){
+        return;
+    }
+
+    std::lock_guard lock(m_handlesMtx);
+    m_idleHandles.push_back(handle);
+}
+
+embeddingMatrix embeddingClient::TransformSentences(const std::vector<std::string>& messages){
+    embeddingMatrix result;
+
+    CURL* curl = AcquireHandle();
+    if(nullptr == curl){
+        APATE_LOG_WARN("Failed to create a connection to embedding server {}:{}",
+                       m_server,
+                       m_port);
+        return result;
+    }
+
+    // make the embedding request
+    nlohmann::json request;
+    for(const auto& message : messages){
+        request["texts"].push_back(message);
+    }
+
+    std::string requestStr = request.dump ();
+    std::string embedResponse;
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, m_headers[m_wireFormat]);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, requestStr.c_str ());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, requestStr.size ());
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &embedResponse);
+
+    auto HTTPCode = curl_easy_perform(curl);
+
+    if(HTTPCode != CURLE_OK){
+        APATE_LOG_WARN("Failed to get embedding from server {}:{} - {}",
+                       m_server,
+                       m_port,
+                       curl_easy_strerror(HTTPCode));
+
+        // don't hand a broken connection to the next request
+        curl_easy_cleanup(curl);
+        curl = nullptr;
+    }
+    else if(IsBinaryResponse(curl)){
+        if(!DecodeBinaryEmbeddings(embedResponse, result)){
+            APATE_LOG_WARN("Malformed binary embedding response of {} bytes",
+                           embedResponse.size());
+            result.Clear();
+        }
+    }
+    else{
+        embeddingResponseSax sax(messages.size());
+
+        try{
+            if(!nlohmann::json::sax_parse(embedResponse, &sax) || !sax.Found()){
+                APATE_LOG_WARN("Invalid embedding response - {}",
+                               embedResponse);
+            }
+            else{
+                result = sax.Release();
+            }
+        }
+        catch (...){
+            APATE_LOG_WARN("Failed to parse embedding response - {}",
+                           embedResponse);
+        }
+    }
+
+    ReleaseHandle(curl);
+
+    return result;
+}
+
+std::future<embeddingMatrix> TransformSentences(const std::vector<std::string> &messages, const embeddingPriority priority){
+    return embeddingBatcher::GetInstance().Submit(messages, priority);
+}
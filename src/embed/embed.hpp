@@ -1,12 +1,75 @@
 #ifndef EMBED_HPP
 #define EMBED_HPP
 
+#include "embed/embedbatcher.hpp"
+#include "embed/embeddingmatrix.hpp"
+#include "embed/embeddingprovider.hpp"
+
+#include <curl/curl.h>
+
+#include <array>
+#include <atomic>
 #include <future>
+#include <mutex>
+#include <string>
+#include <string_view>
 #include <vector>
-typedef std::vector<std::vector<float>> Embeddings;
 
-std::future<Embeddings> TransformSentences(const std::vector<std::string> &messages,
-                                           const std::string_view server = "127.0.0.1",
-                                           int port = 5000);
+// how the embedding server is asked to encode its response. The binary formats are a 16 byte
+// header (magic, count, dim, encoding as little endian uint32) followed by count * dim values.
+enum embeddingWireFormat{
+    EMBEDDING_WIRE_JSON,
+    EMBEDDING_WIRE_FP32,
+    EMBEDDING_WIRE_FP16,
+    EMBEDDING_WIRE_DELIMITER
+};
+
+embeddingWireFormat EmbeddingWireFormatFromString(const std::string_view str);
+
+// Talks to one embedding server over a pool of keep-alive connections, one per concurrent request.
+class embeddingClient : public embeddingProvider{
+public:
+    embeddingClient(const std::string_view    server     = "127.0.0.1",
+                    const int                 port       = 5000,
+                    const embeddingWireFormat wireFormat = EMBEDDING_WIRE_FP32);
+    ~embeddingClient();
+
+    embeddingClient(embeddingClient&) = delete;
+    embeddingClient(embeddingClient&&) = delete;
+    embeddingClient& operator=(embeddingClient&) = delete;
+    embeddingClient& operator=(embeddingClient&&) = delete;
+
+    // blocks the calling thread. Empty on failure.
+    embeddingMatrix TransformSentences(const std::vector<std::string>& messages);
+
+    embeddingMatrix Embed(const std::vector<std::string>& texts) override { return TransformSentences(texts); }
+    std::string     Name(void) const override;
+
+    // one batch encoding on the server while the next is on the wire
+    size_t Concurrency(void) const override { return 2; }
+
+    // servers that don't know the binary formats keep answering in JSON, which is still understood
+    void SetWireFormat(const embeddingWireFormat wireFormat);
+
+private:
+    CURL* AcquireHandle(void);
+    void  ReleaseHandle(CURL* handle);
+
+    std::string        m_server;
+    int                m_port;
+    std::string        m_url;
+
+    // one header list per wire format, they only differ in what they accept
+    std::array<struct curl_slist*, EMBEDDING_WIRE_DELIMITER> m_headers = {};
+    std::atomic<embeddingWireFormat>                          m_wireFormat;
+
+    // idle handles keep their connection open between requests
+    std::mutex         m_handlesMtx;
+    std::vector<CURL*> m_idleHandles;
+};
+
+// goes through embeddingBatcher::GetInstance(), so whichever provider it was given
+std::future<embeddingMatrix> TransformSentences(const std::vector<std::string> &messages,
+                                                const embeddingPriority         priority = EMBEDDING_PRIORITY_INGEST);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,445 @@
+#include "embedbatcher.hpp"
+
+#include "embed/embed.hpp"
+#include "log/log.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+// smallest batch the limit shrinks to, and how much it grows by after a quick batch
+static const size_t MIN_BATCH_LIMIT  = 4;
+static const size_t BATCH_LIMIT_STEP = 4;
+
+// how often queue depths are logged while anything is waiting
+static const std::chrono::seconds STATS_LOG_INTERVAL = std::chrono::seconds(60);
+
+const char* EmbeddingPriorityName(const embeddingPriority priority){
+    switch(priority){
+    case EMBEDDING_PRIORITY_QUERY:
+        return "query";
+    case EMBEDDING_PRIORITY_INGEST:
+        return "ingest";
+    case EMBEDDING_PRIORITY_BACKFILL:
+        return "backfill";
+    default:
+        return "unknown";
+    }
+}
+
+embeddingBatcher::embeddingBatcher(std::shared_ptr<embeddingProvider> provider,
+                                   const size_t                       maxBatchSize,
+                                   const std::chrono::milliseconds    maxWait,
+                                   const size_t                       numWorkers) :
+    m_provider     (std::move(provider)),
+    m_maxBatchSize (std::max<size_t>(1, maxBatchSize)),
+    m_maxWait      (maxWait),
+    m_batchLimit   (m_maxBatchSize),
+    m_workers      (numWorkers){
+
+    m_maxInFlight = std::clamp<size_t>(m_provider->Concurrency(), 1, m_workers.NumThreads());
+    m_dispatcher  = std::thread(&embeddingBatcher::HandleQueue, this);
+}
+
+embeddingBatcher::~embeddingBatcher(){
+    std::unique_lock lock(m_queueMtx);
+    m_shutDown = true;
+    m_queueCV.notify_all();
+    lock.unlock();
+
+    if(m_dispatcher.joinable()){
+        m_dispatcher.join();
+    }
+}
+
+void embeddingBatcher::SetProvider(std::shared_ptr<embeddingProvider> provider){
+    if(!provider){
+        return;
+    }
+
+    const size_t maxInFlight = std::clamp<size_t>(provider->Concurrency(), 1, m_workers.NumThreads());
+
+    APATE_LOG_INFO("Embedding with {}, up to '{}' batches at once",
+                   provider->Name(),
+                   maxInFlight);
+    {
+        std::lock_guard lock(m_providerMtx);
+        m_provider = std::move(provider);
+    }
+
+    std::lock_guard lock(m_queueMtx);
+    m_maxInFlight = maxInFlight;
+    m_queueCV.notify_all();
+}
+
+void embeddingBatcher::SetBackpressureOptions(const std::chrono::milliseconds targetLatency,
+                                              const size_t                    breakerFailures,
+                                              const std::chrono::seconds      breakerCooldown){
+    std::lock_guard lock(m_breakerMtx);
+    m_targetLatency   = targetLatency;
+    m_breakerFailures = std::max<size_t>(1, breakerFailures);
+    m_breakerCooldown = breakerCooldown;
+}
+
+void embeddingBatcher::SetScheduling(const embeddingScheduling                          scheduling,
+                                     const std::array<size_t, EMBEDDING_PRIORITY_COUNT>& weights){
+    std::lock_guard lock(m_queueMtx);
+    m_scheduling = scheduling;
+    m_credits    = {};
+
+    for(size_t ii = 0; ii < EMBEDDING_PRIORITY_COUNT; ii++){
+        m_weights[ii] = std::max<size_t>(1, weights[ii]);
+    }
+}
+
+bool embeddingBatcher::Available(void){
+    std::lock_guard lock(m_breakerMtx);
+    return Admit(false);
+}
+
+bool embeddingBatcher::Admit(const bool claimProbe){
+    switch(m_breakerState){
+    case BREAKER_CLOSED:
+        return true;
+
+    // one probe at a time, everyone else fails fast until it's back
+    case BREAKER_HALF_OPEN:
+        if(m_probeInFlight){
+            return false;
+        }
+        break;
+
+    case BREAKER_OPEN:
+        if(std::chrono::steady_clock::now() - m_breakerOpenedAt < m_breakerCooldown){
+            return false;
+        }
+        break;
+    }
+
+    // cooled down, let the next batch through to see if the provider is back
+    if(claimProbe){
+        if(BREAKER_OPEN == m_breakerState){
+            APATE_LOG_INFO("Embedding circuit breaker half open, probing");
+        }
+        m_breakerState  = BREAKER_HALF_OPEN;
+        m_probeInFlight = true;
+    }
+    return true;
+}
+
+embeddingBatcher& embeddingBatcher::GetInstance(){
+    static embeddingBatcher batcher(std::make_shared<embeddingClient>());
+    return batcher;
+}
+
+std::array<embeddingBatcher::queueStats, EMBEDDING_PRIORITY_COUNT> embeddingBatcher::GetQueueStats(void){
+    std::lock_guard lock(m_queueMtx);
+    return QueueStats();
+}
+
+std::future<embeddingMatrix> embeddingBatcher::Submit(const std::vector<std::string>& texts, const embeddingPriority priority){
+    auto request = std::make_shared<pendingRequest>();
+    request->texts      = texts;
+    request->enqueuedAt = std::chrono::steady_clock::now();
+    request->priority   = (priority < EMBEDDING_PRIORITY_COUNT) ? priority : EMBEDDING_PRIORITY_BACKFILL;
+
+    auto future = request->promise.get_future();
+
+    bool admitted = false;
+    if(!texts.empty()){
+        std::lock_guard lock(m_breakerMtx);
+        admitted = Admit(true);
+    }
+
+    if(!admitted){
+        request->promise.set_value({});
+        return future;
+    }
+
+    std::lock_guard lock(m_queueMtx);
+
+    m_queuedTexts                                  += request->texts.size();
+    m_queuedTextsByPriority[request->priority]     += request->texts.size();
+    m_queues[request->priority].push_back(std::move(request));
+    m_queueCV.notify_all();
+
+    return future;
+}
+
+void embeddingBatcher::HandleQueue(void){
+    while(true){
+        std::unique_lock lock(m_queueMtx);
+        m_queueCV.wait(lock, [&](){ return (m_shutDown || CanDispatch()); });
+
+        if(m_shutDown && 0 == m_queuedTexts){
+            return;
+        }
+
+        const size_t batchLimit = m_batchLimit;
+
+        // give other callers until the oldest request's deadline to join in
+        const auto deadline = OldestEnqueuedAt() + m_maxWait;
+        m_queueCV.wait_until(lock, deadline, [&](){ return (m_shutDown || m_queuedTexts >= batchLimit); });
+
+        // every regular slot is busy, this batch is going out in the spare one kept for queries
+        const bool queriesOnly = (!m_shutDown && m_inFlight >= m_maxInFlight);
+
+        // fill up to the limit, the request that doesn't fit is split and its remainder stays at the front
+        std::vector<batchSlice> batch;
+        size_t numTexts = 0;
+
+        for(const embeddingPriority priority : FillOrder()){
+            if(queriesOnly && EMBEDDING_PRIORITY_QUERY != priority){
+                continue;
+            }
+
+            auto& queue = m_queues[priority];
+            while(!queue.empty() && numTexts < batchLimit){
+                auto& request = queue.front();
+
+                batchSlice slice;
+                slice.request = request;
+                slice.first   = request->dispatched;
+                slice.count   = std::min(request->texts.size() - request->dispatched, batchLimit - numTexts);
+
+                request->dispatched += slice.count;
+                numTexts            += slice.count;
+
+                m_queuedTextsByPriority[priority] -= slice.count;
+                m_embeddedTexts[priority]         += slice.count;
+
+                if(request->dispatched == request->texts.size()){
+                    queue.pop_front();
+                }
+                batch.push_back(std::move(slice));
+            }
+        }
+
+        m_queuedTexts -= numTexts;
+
+        if(std::chrono::steady_clock::now() - m_lastStatsLog >= STATS_LOG_INTERVAL && m_queuedTexts > 0){
+            m_lastStatsLog = std::chrono::steady_clock::now();
+
+            const auto stats = QueueStats();
+            APATE_LOG_INFO("Embedding queues (requests/texts, oldest wait) - {} {}/{} {}ms, {} {}/{} {}ms, {} {}/{} {}ms",
+                           EmbeddingPriorityName(EMBEDDING_PRIORITY_QUERY),
+                           stats[EMBEDDING_PRIORITY_QUERY].queuedRequests,
+                           stats[EMBEDDING_PRIORITY_QUERY].queuedTexts,
+                           stats[EMBEDDING_PRIORITY_QUERY].oldestWait.count(),
+                           EmbeddingPriorityName(EMBEDDING_PRIORITY_INGEST),
+                           stats[EMBEDDING_PRIORITY_INGEST].queuedRequests,
+                           stats[EMBEDDING_PRIORITY_INGEST].queuedTexts,
+                           stats[EMBEDDING_PRIORITY_INGEST].oldestWait.count(),
+                           EmbeddingPriorityName(EMBEDDING_PRIORITY_BACKFILL),
+                           stats[EMBEDDING_PRIORITY_BACKFILL].queuedRequests,
+                           stats[EMBEDDING_PRIORITY_BACKFILL].queuedTexts,
+                           stats[EMBEDDING_PRIORITY_BACKFILL].oldestWait.count());
+        }
+
+        if(batch.empty()){
+            continue;
+        }
+
+        m_inFlight++;
+        lock.unlock();
+
+        DispatchBatch(std::move(batch));
+    }
+}
+
+bool embeddingBatcher::CanDispatch(void) const{
+    if(0 == m_queuedTexts){
+        return false;
+    }
+
+    if(m_inFlight < m_maxInFlight){
+        return true;
+    }
+
+    // one more in flight than the provider wants, only ever for queries
+    return (m_inFlight == m_maxInFlight && !m_queues[EMBEDDING_PRIORITY_QUERY].empty());
+}
+
+std::chrono::steady_clock::time_point embeddingBatcher::OldestEnqueuedAt(void) const{
+    auto oldest = std::chrono::steady_clock::time_point::max();
+    for(const auto& queue : m_queues){
+        if(!queue.empty()){
+            oldest = std::min(oldest, queue.front()->enqueuedAt);
+        }
+    }
+    return oldest;
+}
+
+embeddingBatcher::priorityOrder embeddingBatcher::FillOrder(void){
+    priorityOrder order = { EMBEDDING_PRIORITY_QUERY, EMBEDDING_PRIORITY_INGEST, EMBEDDING_PRIORITY_BACKFILL };
+
+    if(EMBEDDING_SCHEDULING_STRICT == m_scheduling){
+        return order;
+    }
+
+    // pick which waiting queue leads this batch, the others fill what's left in priority order
+    long long totalWeight = 0;
+    size_t    leader      = EMBEDDING_PRIORITY_COUNT;
+    for(size_t ii = 0; ii < EMBEDDING_PRIORITY_COUNT; ii++){
+        if(m_queues[ii].empty()){
+            continue;
+        }
+
+        m_credits[ii] += (long long)m_weights[ii];
+        totalWeight   += (long long)m_weights[ii];
+
+        if(EMBEDDING_PRIORITY_COUNT == leader || m_credits[ii] > m_credits[leader]){
+            leader = ii;
+        }
+    }
+
+    if(EMBEDDING_PRIORITY_COUNT == leader){
+        return order;
+    }
+
+    m_credits[leader] -= totalWeight;
+    std::rotate(order.begin(), order.begin() + leader, order.begin() + leader + 1);
+    return order;
+}
+
+std::array<embeddingBatcher::queueStats, EMBEDDING_PRIORITY_COUNT> embeddingBatcher::QueueStats(void) const{
+    const auto now = std::chrono::steady_clock::now();
+
+    std::array<queueStats, EMBEDDING_PRIORITY_COUNT> stats;
+    for(size_t ii = 0; ii < EMBEDDING_PRIORITY_COUNT; ii++){
+        stats[ii].queuedRequests = m_queues[ii].size();
+        stats[ii].queuedTexts    = m_queuedTextsByPriority[ii];
+        stats[ii].embeddedTexts  = m_embeddedTexts[ii];
+
+        if(!m_queues[ii].empty()){
+            stats[ii].oldestWait = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_queues[ii].front()->enqueuedAt);
+        }
+    }
+    return stats;
+}
+
+void embeddingBatcher::DispatchBatch(std::vector<batchSlice>&& batch){
+    std::vector<std::string> texts;
+    for(const auto& slice : batch){
+        const auto begin = slice.request->texts.begin() + slice.first;
+        texts.insert(texts.end(), begin, begin + slice.count);
+    }
+
+    std::shared_ptr<embeddingProvider> provider;
+    {
+        std::lock_guard lock(m_providerMtx);
+        provider = m_provider;
+    }
+
+    m_workers.Submit([this, provider, batch = std::move(batch), texts = std::move(texts)]() mutable{
+        const auto start = std::chrono::steady_clock::now();
+
+        embeddingMatrix embeddings;
+        try{
+            embeddings = provider->Embed(texts);
+        } catch(const std::exception& e){
+            APATE_LOG_WARN("Embedding provider {} threw - {}",
+                           provider->Name(),
+                           e.what());
+        }
+
+        const bool success = (embeddings.Rows() == texts.size());
+        if(!success){
+            APATE_LOG_WARN("Embedding batch returned '{}' rows for '{}' texts",
+                           embeddings.Rows(),
+                           texts.size());
+            embeddings.Clear();
+        }
+
+        RecordOutcome(success, std::chrono::steady_clock::now() - start);
+        CompleteBatch(batch, std::move(embeddings));
+
+        std::lock_guard lock(m_queueMtx);
+        m_inFlight--;
+        m_queueCV.notify_all();
+    });
+}
+
+void embeddingBatcher::CompleteBatch(std::vector<batchSlice>& batch, embeddingMatrix&& embeddings){
+    // a lone caller that fit in one batch gets the whole matrix
+    if(1 == batch.size() && batch.front().count == batch.front().request->texts.size()){
+        batch.front().request->promise.set_value(std::move(embeddings));
+        return;
+    }
+
+    size_t offset = 0;
+    for(auto& slice : batch){
+        auto& request = *slice.request;
+        std::lock_guard lock(request.resultMtx);
+
+        if(request.failed){
+            offset += slice.count;
+            continue;
+        }
+
+        // one failed slice fails the whole request
+        if(embeddings.Empty()){
+            request.failed = true;
+            request.promise.set_value({});
+            continue;
+        }
+
+        if(request.result.Empty()){
+            request.result = embeddingMatrix(request.texts.size(), embeddings.Dim());
+        }
+
+        for(size_t ii = 0; ii < slice.count; ii++){
+            const auto row = embeddings.Row(offset + ii);
+            std::copy(row.begin(), row.end(), request.result.Row(slice.first + ii).begin());
+        }
+        offset            += slice.count;
+        request.completed += slice.count;
+
+        if(request.completed == request.texts.size()){
+            request.promise.set_value(std::move(request.result));
+        }
+    }
+}
+
+void embeddingBatcher::RecordOutcome(const bool success, const std::chrono::steady_clock::duration latency){
+    std::lock_guard lock(m_breakerMtx);
+
+    // any outcome ends a half open breaker one way or the other
+    m_probeInFlight = false;
+
+    // additive increase while the provider keeps up, multiplicative decrease when it doesn't
+    const size_t batchLimit = m_batchLimit;
+    if(success && latency <= m_targetLatency){
+        m_batchLimit = std::min(m_maxBatchSize, batchLimit + BATCH_LIMIT_STEP);
+    }
+    else{
+        m_batchLimit = std::max(std::min(MIN_BATCH_LIMIT, m_maxBatchSize), batchLimit / 2);
+
+        if(m_batchLimit != batchLimit){
+            APATE_LOG_DEBUG("Embedding batch limit {} -> {}, last batch took {}ms",
+                            batchLimit,
+                            (size_t)m_batchLimit,
+                            std::chrono::duration_cast<std::chrono::milliseconds>(latency).count());
+        }
+    }
+
+    if(success){
+        if(BREAKER_CLOSED != m_breakerState){
+            APATE_LOG_INFO("Embedding circuit breaker closed");
+        }
+        m_breakerState        = BREAKER_CLOSED;
+        m_consecutiveFailures = 0;
+        return;
+    }
+
+    m_consecutiveFailures++;
+
+    if(BREAKER_HALF_OPEN == m_breakerState || (BREAKER_CLOSED == m_breakerState && m_consecutiveFailures >= m_breakerFailures)){
+        APATE_LOG_WARN("Embedding circuit breaker open after '{}' failures, retrying in {}s",
+                       m_consecutiveFailures,
+                       m_breakerCooldown.count());
+
+        m_breakerState    = BREAKER_OPEN;
+        m_breakerOpenedAt = std::chrono::steady_clock::now();
+    }
+}
@@ -0,0 +1,185 @@
+#ifndef EMBEDBATCHER_HPP
+#define EMBEDBATCHER_HPP
+
+#include "common/threadpool.hpp"
+#include "embed/embeddingmatrix.hpp"
+#include "embed/embeddingprovider.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// highest first
+enum embeddingPriority{
+    EMBEDDING_PRIORITY_QUERY,
+    EMBEDDING_PRIORITY_INGEST,
+    EMBEDDING_PRIORITY_BACKFILL,
+
+    EMBEDDING_PRIORITY_COUNT
+};
+
+enum embeddingScheduling{
+    EMBEDDING_SCHEDULING_STRICT,
+    EMBEDDING_SCHEDULING_WEIGHTED
+};
+
+const char* EmbeddingPriorityName(const embeddingPriority priority);
+
+// Coalesces texts from concurrent callers (live ingest, backfill, retrieval queries) into one request to
+// the embedding provider. A batch goes out once it holds the current batch limit or its oldest caller has
+// waited maxWait, whichever comes first. Each caller gets back only its own rows. As many batches are in
+// flight at once as the provider can take, up to numWorkers. While they're all busy the queue keeps filling,
+// so the next batch goes out bigger.
+//
+// Requests wait in one queue per priority. Strict scheduling fills each batch from the highest priority
+// queue down, weighted scheduling lets the queues take turns leading the batch in proportion to their
+// weights so backfill can't be starved. Either way, queries get one extra batch in flight of their own
+// so a reply never waits behind batches of backfill that are already on the server.
+//
+// The batch limit adapts to the provider: it grows additively while batches come back within the target
+// latency and halves on slow or failed ones. Requests bigger than the limit are split across batches.
+// Enough failures in a row open a circuit breaker, during which Submit fails fast instead of queueing
+// behind a server that isn't answering. After the cooldown the next request goes through as a probe and
+// everything else keeps failing fast until its batch succeeds or fails.
+class embeddingBatcher{
+public:
+    embeddingBatcher(std::shared_ptr<embeddingProvider> provider,
+                     const size_t                       maxBatchSize = 64,
+                     const std::chrono::milliseconds    maxWait      = std::chrono::milliseconds(10),
+                     const size_t                       numWorkers   = 16);
+    ~embeddingBatcher();
+
+    embeddingBatcher(embeddingBatcher&) = delete;
+    embeddingBatcher(embeddingBatcher&&) = delete;
+    embeddingBatcher& operator=(embeddingBatcher&) = delete;
+    embeddingBatcher& operator=(embeddingBatcher&&) = delete;
+
+    struct queueStats{
+        size_t                    queuedRequests = 0;
+        size_t                    queuedTexts    = 0;
+        size_t                    embeddedTexts  = 0;
+        std::chrono::milliseconds oldestWait     = std::chrono::milliseconds(0);
+    };
+
+    // one row per text, or empty if the batch failed or the breaker is open
+    std::future<embeddingMatrix> Submit(const std::vector<std::string>& texts,
+                                        const embeddingPriority         priority = EMBEDDING_PRIORITY_INGEST);
+
+    // batches already in flight finish on the old provider
+    void SetProvider(std::shared_ptr<embeddingProvider> provider);
+
+    void SetBackpressureOptions(const std::chrono::milliseconds targetLatency,
+                                const size_t                    breakerFailures,
+                                const std::chrono::seconds      breakerCooldown);
+
+    // weights are indexed by priority and only used when weighted
+    void SetScheduling(const embeddingScheduling                                    scheduling,
+                       const std::array<size_t, EMBEDDING_PRIORITY_COUNT>& weights);
+
+    // false while the breaker is open or probing and Submit would fail straight away
+    bool Available(void);
+
+    // indexed by priority. Also logged every so often while anything is queued.
+    std::array<queueStats, EMBEDDING_PRIORITY_COUNT> GetQueueStats(void);
+
+    // starts out batching for the local embedding server
+    static embeddingBatcher& GetInstance();
+
+private:
+    enum breakerState{
+        BREAKER_CLOSED,
+        BREAKER_OPEN,
+        BREAKER_HALF_OPEN
+    };
+
+    // filled in piece by piece when it's split across batches
+    struct pendingRequest{
+        std::vector<std::string>              texts;
+        std::promise<embeddingMatrix>         promise;
+        std::chrono::steady_clock::time_point enqueuedAt;
+        embeddingPriority                     priority   = EMBEDDING_PRIORITY_INGEST;
+
+        size_t                                dispatched = 0;
+
+        std::mutex                            resultMtx;
+        embeddingMatrix                       result;
+        size_t                                completed  = 0;
+        bool                                  failed     = false;
+    };
+
+    struct batchSlice{
+        std::shared_ptr<pendingRequest> request;
+        size_t                          first = 0;
+        size_t                          count = 0;
+    };
+
+    typedef std::array<embeddingPriority, EMBEDDING_PRIORITY_COUNT> priorityOrder;
+
+    void HandleQueue(void);
+
+    // these expect m_queueMtx to be held
+    bool                                             CanDispatch(void) const;
+    std::chrono::steady_clock::time_point            OldestEnqueuedAt(void) const;
+    priorityOrder                                    FillOrder(void);
+    std::array<queueStats, EMBEDDING_PRIORITY_COUNT> QueueStats(void) const;
+
+    void DispatchBatch(std::vector<batchSlice>&& batch);
+    void CompleteBatch(std::vector<batchSlice>& batch, embeddingMatrix&& embeddings);
+
+    // expects m_breakerMtx to be held. Only Submit claims the probe, Available just looks.
+    bool Admit(const bool claimProbe);
+
+    // updates the batch limit and the breaker
+    void RecordOutcome(const bool success, const std::chrono::steady_clock::duration latency);
+
+    std::mutex                         m_providerMtx;
+    std::shared_ptr<embeddingProvider> m_provider;
+
+    size_t                    m_maxBatchSize;
+    std::chrono::milliseconds m_maxWait;
+    std::atomic<size_t>       m_batchLimit;
+
+    std::mutex                            m_breakerMtx;
+    breakerState                          m_breakerState        = BREAKER_CLOSED;
+    size_t                                m_consecutiveFailures = 0;
+    std::chrono::steady_clock::time_point m_breakerOpenedAt;
+    bool                                  m_probeInFlight       = false;
+    std::chrono::milliseconds             m_targetLatency       = std::chrono::milliseconds(2000);
+    size_t                                m_breakerFailures     = 5;
+    std::chrono::seconds                  m_breakerCooldown     = std::chrono::seconds(30);
+
+    std::thread                                 m_dispatcher;
+    std::condition_variable                     m_queueCV;
+    size_t                                      m_queuedTexts = 0;
+    size_t                                      m_inFlight    = 0;
+    size_t                                      m_maxInFlight = 1;
+
+    typedef std::deque<std::shared_ptr<pendingRequest>> requestQueue;
+
+    std::array<requestQueue, EMBEDDING_PRIORITY_COUNT> m_queues;
+    std::array<size_t, EMBEDDING_PRIORITY_COUNT>       m_queuedTextsByPriority = {};
+    std::array<size_t, EMBEDDING_PRIORITY_COUNT>       m_embeddedTexts         = {};
+
+    // smooth weighted round robin, each queue's credit grows by its weight and the leader pays the total
+    embeddingScheduling                                m_scheduling = EMBEDDING_SCHEDULING_STRICT;
+    std::array<size_t, EMBEDDING_PRIORITY_COUNT>       m_weights    = { 16, 4, 1 };
+    std::array<long long, EMBEDDING_PRIORITY_COUNT>    m_credits    = {};
+
+    std::chrono::steady_clock::time_point              m_lastStatsLog;
+    std::mutex                                  m_queueMtx;
+
+    std::atomic<bool>          m_shutDown = false;
+
+    // declared last so in-flight batches finish before anything else goes away
+    threadPool                 m_workers;
+};
+
+#endif
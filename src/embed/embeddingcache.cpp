@@ -0,0 +1,243 @@
+#include "embeddingcache.hpp"
+
+#include "log/log.hpp"
+
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+static const char* CREATE_TABLE_SQL = "CREATE TABLE IF NOT EXISTS embedding_cache ("
+                                      "model TEXT NOT NULL,"
+                                      "hash INTEGER NOT NULL,"
+                                      "embedding BLOB NOT NULL,"
+                                      "PRIMARY KEY (model, hash))";
+
+static const char* SELECT_SQL = "SELECT embedding FROM embedding_cache WHERE model = ? AND hash = ?";
+static const char* INSERT_SQL = "INSERT OR IGNORE INTO embedding_cache (model, hash, embedding) VALUES (?, ?, ?)";
+
+embeddingCache::embeddingCache(const size_t memoryEntries) : m_memory(memoryEntries){
+}
+
+embeddingCache::~embeddingCache(){
+    try{
+        Close();
+    } catch(...){
+        APATE_LOG_WARN("Failed to close embedding cache {}",
+                       m_dbFile);
+    }
+}
+
+void embeddingCache::Open(const std::filesystem::path& dbFile){
+    std::lock_guard lock(m_cacheMtx);
+
+    if(nullptr != m_db){
+        sqlite3_close(m_db);
+        m_db = nullptr;
+    }
+
+    std::filesystem::path dbDir = dbFile;
+    std::filesystem::create_directories(dbDir.remove_filename());
+
+    int rc = SQLITE_OK;
+    char* errMsg = nullptr;
+
+    if((rc = sqlite3_open(dbFile.string().c_str(), &m_db)) != SQLITE_OK){
+        APATE_LOG_WARN("Failed to open embedding cache {} - {}",
+                       dbFile.string(),
+                       sqlite3_errstr(rc));
+        sqlite3_close(m_db);
+        m_db = nullptr;
+    }
+    else if((rc = sqlite3_exec(m_db, CREATE_TABLE_SQL, NULL, NULL, &errMsg)) != SQLITE_OK){
+        APATE_LOG_WARN("sqlite3_exec({}) failed - {}",
+                       CREATE_TABLE_SQL,
+                       sqlite3_errmsg(m_db));
+        sqlite3_free(errMsg);
+        sqlite3_close(m_db);
+        m_db = nullptr;
+    }
+    else{
+        m_dbFile = dbFile.string();
+        APATE_LOG_INFO("Opened embedding cache {}", m_dbFile);
+    }
+}
+
+void embeddingCache::Close(void){
+    std::lock_guard lock(m_cacheMtx);
+
+    if(nullptr == m_db){
+        return;
+    }
+
+    if(sqlite3_close(m_db) != SQLITE_OK){
+        APATE_LOG_WARN_AND_THROW(std::runtime_error,
+                                 "sqlite3_close({}) failed - {}",
+                                 m_dbFile,
+                                 sqlite3_errmsg(m_db));
+    }
+    m_db = nullptr;
+}
+
+void embeddingCache::SetModelId(const std::string_view modelId){
+    std::lock_guard lock(m_cacheMtx);
+
+    if(m_modelId != modelId){
+        m_modelId = modelId;
+        m_memory.Clear();
+    }
+}
+
+std::string embeddingCache::NormalizeText(const std::string_view text){
+    std::string normalized;
+    normalized.reserve(text.size());
+
+    bool pendingSpace = false;
+    for(const char c : text){
+        if(std::isspace((unsigned char)c)){
+            pendingSpace = !normalized.empty();
+            continue;
+        }
+
+        if(pendingSpace){
+            normalized.push_back(' ');
+            pendingSpace = false;
+        }
+        normalized.push_back(c);
+    }
+    return normalized;
+}
+
+uint64_t embeddingCache::HashText(const std::string_view text) const{
+    // 64 bit FNV-1a over model id and text, collisions are not a practical concern at this size
+    uint64_t hash = 14695981039346656037ull;
+
+    auto mix = [&hash](const std::string_view bytes){
+        for(const char c : bytes){
+            hash ^= (unsigned char)c;
+            hash *= 1099511628211ull;
+        }
+    };
+
+    mix(m_modelId);
+    mix(std::string_view("\0", 1));
+    mix(text);
+    return hash;
+}
+
+std::vector<size_t> embeddingCache::Lookup(const std::vector<std::string>& texts,
+                                           embeddingMatrix&                hits,
+                                           std::vector<size_t>&            hitIndexes){
+    std::vector<size_t> misses;
+
+    std::lock_guard lock(m_cacheMtx);
+
+    std::vector<float> embedding;
+    for(size_t ii = 0; ii < texts.size(); ii++){
+        const uint64_t hash = HashText(texts[ii]);
+
+        bool found = m_memory.Get(hash, embedding);
+        if(!found && LoadFromDb(hash, embedding)){
+            m_memory.Set(hash, embedding);
+            found = true;
+        }
+
+        if(found && (hits.Empty() || embedding.size() == hits.Dim())){
+            hits.AppendRow(embedding);
+            hitIndexes.push_back(ii);
+        }
+        else{
+            misses.push_back(ii);
+        }
+    }
+
+    return misses;
+}
+
+void embeddingCache::Store(const std::vector<std::string>& texts, const embeddingMatrix& embeddings){
+    if(texts.size() != embeddings.Rows()){
+        APATE_LOG_WARN("'{}' texts for '{}' embeddings, not caching them",
+                       texts.size(),
+                       embeddings.Rows());
+        return;
+    }
+
+    std::lock_guard lock(m_cacheMtx);
+
+    std::vector<uint64_t> hashes;
+    hashes.reserve(texts.size());
+
+    for(size_t ii = 0; ii < texts.size(); ii++){
+        const auto row = embeddings.Row(ii);
+
+        hashes.push_back(HashText(texts[ii]));
+        m_memory.Set(hashes.back(), std::vector<float>(row.begin(), row.end()));
+    }
+
+    StoreToDb(hashes, embeddings);
+}
+
+bool embeddingCache::LoadFromDb(const uint64_t hash, std::vector<float>& embedding){
+    if(nullptr == m_db){
+        return false;
+    }
+
+    bool found = false;
+
+    sqlite3_stmt* stmt = nullptr;
+    if(sqlite3_prepare_v2(m_db, SELECT_SQL, -1, &stmt, NULL) != SQLITE_OK){
+        APATE_LOG_WARN("{} - Failed to prepare statement - {}",
+                       m_dbFile,
+                       sqlite3_errmsg(m_db));
+        return false;
+    }
+
+    sqlite3_bind_text(stmt, 1, m_modelId.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)hash);
+
+    if(sqlite3_step(stmt) == SQLITE_ROW){
+        const void* blob     = sqlite3_column_blob(stmt, 0);
+        const int   blobSize = sqlite3_column_bytes(stmt, 0);
+
+        if(blobSize > 0 && blobSize % sizeof(float) == 0){
+            embedding.resize(blobSize / sizeof(float));
+            std::memcpy(embedding.data(), blob, blobSize);
+            found = true;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+void embeddingCache::StoreToDb(const std::vector<uint64_t>& hashes, const embeddingMatrix& embeddings){
+    if(nullptr == m_db || embeddings.Empty()){
+        return;
+    }
+
+    sqlite3_stmt* stmt = nullptr;
+    if(sqlite3_prepare_v2(m_db, INSERT_SQL, -1, &stmt, NULL) != SQLITE_OK){
+        APATE_LOG_WARN("{} - Failed to prepare statement - {}",
+                       m_dbFile,
+                       sqlite3_errmsg(m_db));
+        return;
+    }
+
+    sqlite3_exec(m_db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+
+    const int blobSize = (int)(embeddings.Dim() * sizeof(float));
+    for(size_t ii = 0; ii < hashes.size(); ii++){
+        sqlite3_bind_text(stmt, 1, m_modelId.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)hashes[ii]);
+        sqlite3_bind_blob(stmt, 3, embeddings.Row(ii).data(), blobSize, SQLITE_STATIC);
+
+        if(sqlite3_step(stmt) != SQLITE_DONE){
+            APATE_LOG_WARN("{} - Failed to cache embedding - {}",
+                           m_dbFile,
+                           sqlite3_errmsg(m_db));
+        }
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_exec(m_db, "COMMIT;", NULL, NULL, NULL);
+    sqlite3_finalize(stmt);
+}
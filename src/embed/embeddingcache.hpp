@@ -0,0 +1,61 @@
+#ifndef EMBEDDINGCACHE_HPP
+#define EMBEDDINGCACHE_HPP
+
+#include "common/lrucache.hpp"
+#include "embed/embeddingmatrix.hpp"
+
+#include <sqlite3.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Embeddings keyed by (model id, hash of the normalized text), so reposts, bot commands and
+// anything already seen before a restart aren't sent to the embedding server again.
+// Recent entries are held in memory, every entry is backed by a sqlite table.
+class embeddingCache{
+public:
+    embeddingCache(const size_t memoryEntries = 4096);
+    ~embeddingCache();
+
+    embeddingCache(embeddingCache&) = delete;
+    embeddingCache(embeddingCache&&) = delete;
+    embeddingCache& operator=(embeddingCache&) = delete;
+    embeddingCache& operator=(embeddingCache&&) = delete;
+
+    // without a database the cache is memory only
+    void Open(const std::filesystem::path& dbFile);
+    void Close(void);
+
+    // entries from another model never match. Changing it drops the in-memory entries.
+    void SetModelId(const std::string_view modelId);
+
+    // texts are expected to be normalized already. Rows for the texts that were found are
+    // appended to hits and their positions to hitIndexes. Returns the positions of the rest.
+    std::vector<size_t> Lookup(const std::vector<std::string>& texts,
+                               embeddingMatrix&                hits,
+                               std::vector<size_t>&            hitIndexes);
+
+    // row ii of embeddings belongs to texts[ii]
+    void Store(const std::vector<std::string>& texts, const embeddingMatrix& embeddings);
+
+    // trims and collapses whitespace runs so trivially different copies hash the same
+    static std::string NormalizeText(const std::string_view text);
+
+private:
+    uint64_t HashText(const std::string_view text) const;
+
+    bool LoadFromDb(const uint64_t hash, std::vector<float>& embedding);
+    void StoreToDb(const std::vector<uint64_t>& hashes, const embeddingMatrix& embeddings);
+
+    std::mutex                             m_cacheMtx;
+    lruCache<uint64_t, std::vector<float>> m_memory;
+    std::string                            m_modelId = "all-mpnet-base-v2";
+    std::string                            m_dbFile;
+    sqlite3*                               m_db = nullptr;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include "embeddingmatrix.hpp"
+
+#include "log/log.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+embeddingMatrix::embeddingMatrix(const size_t rows, const size_t dim) :
+    m_rows   (rows),
+    m_dim    (dim),
+    m_values (rows * dim){
+}
+
+embeddingMatrix::embeddingMatrix(const size_t rows, const size_t dim, std::vector<float>&& values) :
+    m_rows   (rows),
+    m_dim    (dim),
+    m_values (std::move(values)){
+
+    if(m_values.size() != rows * dim){
+        APATE_LOG_WARN_AND_THROW(std::invalid_argument,
+                                 "Expected {} x {} embedding values, got {}",
+                                 rows,
+                                 dim,
+                                 m_values.size());
+    }
+}
+
+std::span<float> embeddingMatrix::Row(const size_t row){
+    return std::span<float>(m_values.data() + row * m_dim, m_dim);
+}
+
+std::span<const float> embeddingMatrix::Row(const size_t row) const{
+    return std::span<const float>(m_values.data() + row * m_dim, m_dim);
+}
+
+embeddingMatrix embeddingMatrix::Slice(const size_t first, const size_t count) const{
+    if(first + count > m_rows){
+        APATE_LOG_WARN_AND_THROW(std::out_of_range,
+                                 "Rows {} to {} are out of range for {} embeddings",
+                                 first,
+                                 first + count,
+                                 m_rows);
+    }
+
+    const auto begin = m_values.begin() + first * m_dim;
+    return embeddingMatrix(count, m_dim, std::vector<float>(begin, begin + count * m_dim));
+}
+
+void embeddingMatrix::Reserve(const size_t rows, const size_t dim){
+    if(!m_rows){
+        m_dim = dim;
+    }
+    m_values.reserve(rows * m_dim);
+}
+
+std::span<float> embeddingMatrix::AppendRow(const size_t dim){
+    if(!m_rows){
+        m_dim = dim;
+    }
+    else if(dim != m_dim){
+        APATE_LOG_WARN_AND_THROW(std::invalid_argument,
+                                 "Embedding of dimension {} doesn't fit a matrix of dimension {}",
+                                 dim,
+                                 m_dim);
+    }
+
+    m_values.resize(m_values.size() + m_dim);
+    m_rows++;
+
+    return Row(m_rows - 1);
+}
+
+void embeddingMatrix::AppendRow(const std::span<const float> row){
+    auto dest = AppendRow(row.size());
+    std::copy(row.begin(), row.end(), dest.begin());
+}
+
+void embeddingMatrix::Clear(void){
+    m_rows = 0;
+    m_dim  = 0;
+    m_values.clear();
+}
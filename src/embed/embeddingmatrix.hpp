@@ -0,0 +1,44 @@
+#ifndef EMBEDDINGMATRIX_HPP
+#define EMBEDDINGMATRIX_HPP
+
+#include <cstddef>
+#include <span>
+#include <vector>
+
+// Row-major [rows x dim] block of embeddings in a single allocation. Rows are handed out as
+// spans so they can go straight to sqlite, the search indexes and back out again without copies.
+class embeddingMatrix{
+public:
+    embeddingMatrix(void) = default;
+    embeddingMatrix(const size_t rows, const size_t dim);
+
+    // takes ownership of rows * dim values
+    embeddingMatrix(const size_t rows, const size_t dim, std::vector<float>&& values);
+
+    size_t Rows(void) const { return m_rows; }
+    size_t Dim(void) const { return m_dim; }
+    bool   Empty(void) const { return (m_rows == 0); }
+
+    float*       Data(void) { return m_values.data(); }
+    const float* Data(void) const { return m_values.data(); }
+
+    std::span<float>       Row(const size_t row);
+    std::span<const float> Row(const size_t row) const;
+
+    // copies rows [first, first + count) into a new matrix
+    embeddingMatrix Slice(const size_t first, const size_t count) const;
+
+    // the first row fixes the dimension of an empty matrix
+    void             Reserve(const size_t rows, const size_t dim);
+    std::span<float> AppendRow(const size_t dim);
+    void             AppendRow(const std::span<const float> row);
+
+    void Clear(void);
+
+private:
+    size_t             m_rows = 0;
+    size_t             m_dim  = 0;
+    std::vector<float> m_values;
+};
+
+#endif
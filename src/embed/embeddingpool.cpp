@@ -0,0 +1,134 @@
+#include "embeddingpool.hpp"
+
+#include "log/log.hpp"
+
+#include <stdexcept>
+
+// consecutive failures before a provider is left out, and for how long
+static const size_t               FAILURES_BEFORE_UNHEALTHY = 2;
+static const std::chrono::seconds UNHEALTHY_COOLDOWN        = std::chrono::seconds(10);
+
+embeddingPool::embeddingPool(std::vector<std::shared_ptr<embeddingProvider>> providers){
+    if(providers.empty()){
+        APATE_LOG_WARN_AND_THROW(std::invalid_argument, "Embedding pool needs at least one provider");
+    }
+
+    m_endpoints.resize(providers.size());
+    for(size_t ii = 0; ii < providers.size(); ii++){
+        m_endpoints[ii].provider = std::move(providers[ii]);
+    }
+}
+
+embeddingMatrix embeddingPool::Embed(const std::vector<std::string>& texts){
+    std::vector<bool> tried(m_endpoints.size(), false);
+
+    embeddingMatrix embeddings;
+    while(endpoint* chosen = Acquire(tried)){
+        try{
+            embeddings = chosen->provider->Embed(texts);
+        } catch(const std::exception& e){
+            APATE_LOG_WARN("Embedding provider {} threw - {}",
+                           chosen->provider->Name(),
+                           e.what());
+            embeddings.Clear();
+        }
+
+        const bool success = (embeddings.Rows() == texts.size());
+        Release(*chosen, success);
+
+        if(success){
+            break;
+        }
+
+        APATE_LOG_WARN("Embedding provider {} failed '{}' texts, trying the next one",
+                       chosen->provider->Name(),
+                       texts.size());
+        embeddings.Clear();
+    }
+    return embeddings;
+}
+
+std::string embeddingPool::Name(void) const{
+    std::string name = "pool(";
+    for(size_t ii = 0; ii < m_endpoints.size(); ii++){
+        name += (ii ? "," : "") + m_endpoints[ii].provider->Name();
+    }
+    return name + ")";
+}
+
+size_t embeddingPool::Concurrency(void) const{
+    size_t concurrency = 0;
+    for(const auto& candidate : m_endpoints){
+        concurrency += candidate.provider->Concurrency();
+    }
+    return concurrency;
+}
+
+embeddingPool::endpoint* embeddingPool::Acquire(std::vector<bool>& tried){
+    std::lock_guard lock(m_poolMtx);
+
+    const auto now = std::chrono::steady_clock::now();
+
+    // least outstanding requests among the healthy ones. Starting the scan somewhere new each
+    // time spreads ties around instead of always landing on the first endpoint.
+    endpoint* best        = nullptr;
+    size_t    bestIdx     = 0;
+    endpoint* fallback    = nullptr;
+    size_t    fallbackIdx = 0;
+
+    const size_t start = m_next++;
+    for(size_t offset = 0; offset < m_endpoints.size(); offset++){
+        const size_t ii        = (start + offset) % m_endpoints.size();
+        endpoint&    candidate = m_endpoints[ii];
+
+        if(tried[ii]){
+            continue;
+        }
+
+        if(candidate.unhealthyUntil <= now){
+            if(nullptr == best || candidate.inFlight < best->inFlight){
+                best    = &candidate;
+                bestIdx = ii;
+            }
+        }
+        // with nothing healthy left, the one that's been out the longest gets a go
+        else if(nullptr == fallback || candidate.unhealthyUntil < fallback->unhealthyUntil){
+            fallback    = &candidate;
+            fallbackIdx = ii;
+        }
+    }
+
+    if(nullptr == best){
+        best    = fallback;
+        bestIdx = fallbackIdx;
+    }
+
+    if(nullptr != best){
+        tried[bestIdx] = true;
+        best->inFlight++;
+    }
+    return best;
+}
+
+void embeddingPool::Release(endpoint& chosen, const bool success){
+    std::lock_guard lock(m_poolMtx);
+
+    chosen.inFlight--;
+
+    if(success){
+        if(chosen.consecutiveFailures >= FAILURES_BEFORE_UNHEALTHY){
+            APATE_LOG_INFO("Embedding provider {} is back", chosen.provider->Name());
+        }
+        chosen.consecutiveFailures = 0;
+        chosen.unhealthyUntil      = {};
+        return;
+    }
+
+    if(++chosen.consecutiveFailures >= FAILURES_BEFORE_UNHEALTHY){
+        APATE_LOG_WARN("Embedding provider {} failed '{}' times in a row, leaving it out for {}s",
+                       chosen.provider->Name(),
+                       chosen.consecutiveFailures,
+                       UNHEALTHY_COOLDOWN.count());
+        chosen.unhealthyUntil = std::chrono::steady_clock::now() + UNHEALTHY_COOLDOWN;
+    }
+}
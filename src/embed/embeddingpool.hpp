@@ -0,0 +1,44 @@
+#ifndef EMBEDDINGPOOL_HPP
+#define EMBEDDINGPOOL_HPP
+
+#include "embed/embeddingprovider.hpp"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Spreads requests over several providers, typically one embeddingClient per embedding_server.py
+// worker. Each request goes to the healthy provider with the fewest requests outstanding, so a
+// worker stuck on a big batch doesn't get more piled on while the others sit idle.
+// A provider that fails a request has it retried on the next best one. Providers that keep
+// failing are left out for a while, then given another request to see if they're back.
+class embeddingPool : public embeddingProvider{
+public:
+    embeddingPool(std::vector<std::shared_ptr<embeddingProvider>> providers);
+
+    embeddingMatrix Embed(const std::vector<std::string>& texts) override;
+    std::string     Name(void) const override;
+
+    // the sum over every provider
+    size_t Concurrency(void) const override;
+
+private:
+    struct endpoint{
+        std::shared_ptr<embeddingProvider>    provider;
+        size_t                                inFlight            = 0;
+        size_t                                consecutiveFailures = 0;
+        std::chrono::steady_clock::time_point unhealthyUntil;
+    };
+
+    // claims the best endpoint not yet in tried, or nullptr once every one has been tried
+    endpoint* Acquire(std::vector<bool>& tried);
+    void      Release(endpoint& chosen, const bool success);
+
+    std::mutex            m_poolMtx;
+    std::vector<endpoint> m_endpoints;
+    size_t                m_next = 0;
+};
+
+#endif
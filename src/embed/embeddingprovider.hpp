@@ -0,0 +1,27 @@
+#ifndef EMBEDDINGPROVIDER_HPP
+#define EMBEDDINGPROVIDER_HPP
+
+#include "embed/embeddingmatrix.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Anything that can turn a batch of texts into embeddings: the HTTP embedding server, a pool of
+// them, or the in-process hashing embedder used when there's no model to talk to.
+class embeddingProvider{
+public:
+    virtual ~embeddingProvider() = default;
+
+    // blocks the calling thread and may be called from several threads at once.
+    // One row per text, empty on failure.
+    virtual embeddingMatrix Embed(const std::vector<std::string>& texts) = 0;
+
+    // for logs
+    virtual std::string Name(void) const = 0;
+
+    // how many Embed calls are worth running at once
+    virtual size_t Concurrency(void) const { return 1; }
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "hashingembedder.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cmath>
+#include <format>
+#include <thread>
+
+static uint64_t Fnv1a(const std::string_view bytes, uint64_t hash = 14695981039346656037ull){
+    for(const char c : bytes){
+        hash ^= (unsigned char)c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+hashingEmbedder::hashingEmbedder(const size_t                    dim,
+                                 const std::chrono::microseconds latency,
+                                 const std::chrono::microseconds latencyPerText) :
+    m_dim            (std::max<size_t>(1, dim)),
+    m_latency        (latency),
+    m_latencyPerText (latencyPerText){
+}
+
+embeddingMatrix hashingEmbedder::Embed(const std::vector<std::string>& texts){
+    const auto delay = m_latency + m_latencyPerText * (long long)texts.size();
+    if(delay.count() > 0){
+        std::this_thread::sleep_for(delay);
+    }
+
+    embeddingMatrix embeddings(texts.size(), m_dim);
+    for(size_t ii = 0; ii < texts.size(); ii++){
+        EmbedText(texts[ii], embeddings.Row(ii));
+    }
+    return embeddings;
+}
+
+std::string hashingEmbedder::Name(void) const{
+    return std::format("hashing-{}", m_dim);
+}
+
+size_t hashingEmbedder::Concurrency(void) const{
+    // cpu bound, or just sleeping when standing in for a slow server
+    return std::max(2u, std::thread::hardware_concurrency());
+}
+
+void hashingEmbedder::EmbedText(const std::string_view text, std::span<float> embedding) const{
+    // lowercased alphanumeric words
+    std::vector<std::string> words;
+    std::string word;
+    for(const char c : text){
+        if(std::isalnum((unsigned char)c)){
+            word.push_back((char)std::tolower((unsigned char)c));
+        }
+        else if(!word.empty()){
+            words.push_back(std::move(word));
+            word.clear();
+        }
+    }
+    if(!word.empty()){
+        words.push_back(std::move(word));
+    }
+
+    // each feature adds +-weight to one bucket, both picked by its hash
+    auto addFeature = [&](const uint64_t hash, const float weight){
+        const size_t bucket = (size_t)(hash % m_dim);
+        embedding[bucket] += (hash >> 63) ? -weight : weight;
+    };
+
+    for(size_t ii = 0; ii < words.size(); ii++){
+        const uint64_t wordHash = Fnv1a(words[ii]);
+        addFeature(wordHash, 1.0f);
+
+        if(ii + 1 < words.size()){
+            addFeature(Fnv1a(words[ii + 1], Fnv1a(" ", wordHash)), 0.5f);
+        }
+    }
+
+    // no words at all still gets a stable vector of its own
+    if(words.empty()){
+        addFeature(Fnv1a(text), 1.0f);
+    }
+
+    float norm = 0.0f;
+    for(const float value : embedding){
+        norm += value * value;
+    }
+
+    if(norm > 0.0f){
+        const float scale = 1.0f / std::sqrt(norm);
+        for(float& value : embedding){
+            value *= scale;
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef HASHINGEMBEDDER_HPP
+#define HASHINGEMBEDDER_HPP
+
+#include "embed/embeddingprovider.hpp"
+
+#include <chrono>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// In-process stand-in for the embedding server. Words and word pairs are feature hashed into a
+// unit vector, so the same text always gives the same vector and texts sharing words land close
+// together. Good enough to drive ingest and retrieval in load tests without a model.
+class hashingEmbedder : public embeddingProvider{
+public:
+    // every Embed call sleeps for latency plus latencyPerText for each text, to stand in for a real server
+    hashingEmbedder(const size_t                    dim            = 768,
+                    const std::chrono::microseconds latency        = std::chrono::microseconds(0),
+                    const std::chrono::microseconds latencyPerText = std::chrono::microseconds(0));
+
+    embeddingMatrix Embed(const std::vector<std::string>& texts) override;
+    std::string     Name(void) const override;
+    size_t          Concurrency(void) const override;
+
+private:
+    void EmbedText(const std::string_view text, std::span<float> embedding) const;
+
+    size_t                    m_dim;
+    std::chrono::microseconds m_latency;
+    std::chrono::microseconds m_latencyPerText;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "textchunker.hpp"
+
+#include "log/log.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <stdexcept>
+
+// wordpiece splits longer or rarer words into several tokens, assume one more for every few characters
+static const size_t CHARS_PER_EXTRA_TOKEN = 6;
+
+namespace{
+
+// a word, a punctuation character or a non-ascii character, each costing some tokens
+struct textPiece{
+    size_t begin  = 0;
+    size_t end    = 0;
+    size_t tokens = 0;
+};
+
+std::vector<textPiece> SplitPieces(const std::string_view text){
+    std::vector<textPiece> pieces;
+
+    size_t ii = 0;
+    while(ii < text.size()){
+        const unsigned char c = (unsigned char)text[ii];
+
+        if(std::isspace(c)){
+            ii++;
+        }
+        else if(std::isalnum(c)){
+            size_t end = ii;
+            while(end < text.size() && std::isalnum((unsigned char)text[end])){
+                end++;
+            }
+
+            pieces.push_back({ ii, end, 1 + (end - ii - 1) / CHARS_PER_EXTRA_TOKEN });
+            ii = end;
+        }
+        else if(c >= 0x80){
+            // one token per code point. Overcounts accented latin, about right for cjk and emoji.
+            size_t end = ii + 1;
+            while(end < text.size() && ((unsigned char)text[end] & 0xC0) == 0x80){
+                end++;
+            }
+
+            pieces.push_back({ ii, end, 1 });
+            ii = end;
+        }
+        else{
+            pieces.push_back({ ii, ii + 1, 1 });
+            ii++;
+        }
+    }
+
+    return pieces;
+}
+
+}
+
+textChunker::textChunker(const size_t maxTokens, const size_t overlapTokens) :
+    m_maxTokens     (std::max<size_t>(1, maxTokens)),
+    m_overlapTokens (std::min(overlapTokens, m_maxTokens / 2)){
+}
+
+std::vector<std::string> textChunker::Chunk(const std::string_view text) const{
+    const std::vector<textPiece> pieces = SplitPieces(text);
+
+    size_t totalTokens = 0;
+    for(const auto& piece : pieces){
+        totalTokens += piece.tokens;
+    }
+
+    if(totalTokens <= m_maxTokens){
+        return { std::string(text) };
+    }
+
+    std::vector<std::string> chunks;
+
+    size_t first = 0;
+    while(first < pieces.size()){
+        size_t last   = first;
+        size_t tokens = 0;
+
+        while(last < pieces.size() && (last == first || tokens + pieces[last].tokens <= m_maxTokens)){
+            tokens += pieces[last].tokens;
+            last++;
+        }
+
+        chunks.emplace_back(text.substr(pieces[first].begin, pieces[last - 1].end - pieces[first].begin));
+
+        if(last == pieces.size()){
+            break;
+        }
+
+        // back up so the next chunk repeats the tail of this one, always moving forward at least one piece
+        size_t next    = last;
+        size_t overlap = 0;
+        while(next > first + 1 && overlap + pieces[next - 1].tokens <= m_overlapTokens){
+            overlap += pieces[next - 1].tokens;
+            next--;
+        }
+        first = next;
+    }
+
+    return chunks;
+}
+
+size_t textChunker::EstimateTokens(const std::string_view text){
+    size_t tokens = 0;
+    for(const auto& piece : SplitPieces(text)){
+        tokens += piece.tokens;
+    }
+    return tokens;
+}
+
+embeddingMatrix textChunker::PoolChunks(const embeddingMatrix& chunkEmbeddings, const std::vector<size_t>& chunkCounts){
+    size_t totalChunks = 0;
+    for(const size_t count : chunkCounts){
+        if(0 == count){
+            APATE_LOG_WARN_AND_THROW(std::invalid_argument, "Every text needs at least one chunk to pool");
+        }
+        totalChunks += count;
+    }
+
+    if(totalChunks != chunkEmbeddings.Rows()){
+        APATE_LOG_WARN_AND_THROW(std::invalid_argument,
+                                 "Expected '{}' chunk embeddings, got '{}'",
+                                 totalChunks,
+                                 chunkEmbeddings.Rows());
+    }
+
+    const size_t dim = chunkEmbeddings.Dim();
+
+    embeddingMatrix pooled;
+    pooled.Reserve(chunkCounts.size(), dim);
+
+    size_t row = 0;
+    for(const size_t count : chunkCounts){
+        auto dest = pooled.AppendRow(dim);
+
+        if(1 == count){
+            const auto src = chunkEmbeddings.Row(row);
+            std::copy(src.begin(), src.end(), dest.begin());
+        }
+        else{
+            for(size_t chunk = row; chunk < row + count; chunk++){
+                const auto src = chunkEmbeddings.Row(chunk);
+                for(size_t ii = 0; ii < dim; ii++){
+                    dest[ii] += src[ii];
+                }
+            }
+
+            // mean then normalize is just normalizing the sum
+            float norm = 0.0f;
+            for(const float value : dest){
+                norm += value * value;
+            }
+            norm = std::sqrt(norm);
+
+            if(norm > 0.0f){
+                for(float& value : dest){
+                    value /= norm;
+                }
+            }
+        }
+
+        row += count;
+    }
+
+    return pooled;
+}
@@ -0,0 +1,31 @@
+#ifndef TEXTCHUNKER_HPP
+#define TEXTCHUNKER_HPP
+
+#include "embed/embeddingmatrix.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Splits text that wouldn't fit the embedding model's window into overlapping chunks, so the end of
+// a long post gets embedded instead of silently truncated. Token counts are a conservative estimate
+// of the model's wordpiece tokenizer, the real one only runs on the embedding server.
+class textChunker{
+public:
+    textChunker(const size_t maxTokens = 320, const size_t overlapTokens = 64);
+
+    // a single chunk holding the whole text if it fits. A word longer than maxTokens gets a chunk to itself.
+    std::vector<std::string> Chunk(const std::string_view text) const;
+
+    static size_t EstimateTokens(const std::string_view text);
+
+    // chunkCounts[ii] consecutive rows of chunkEmbeddings are averaged and normalized into row ii.
+    // A text with one chunk keeps its row as is.
+    static embeddingMatrix PoolChunks(const embeddingMatrix& chunkEmbeddings, const std::vector<size_t>& chunkCounts);
+
+private:
+    size_t m_maxTokens;
+    size_t m_overlapTokens;
+};
+
+#endif
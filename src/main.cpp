@@ -4,12 +4,72 @@
 #include "chatgpt.hpp"
 #include "discord/discordbot.hpp"
 #include "embed/embed.hpp"
+#include "embed/embedbatcher.hpp"
+#include "embed/embeddingpool.hpp"
+#include "embed/hashingembedder.hpp"
 #include "log/log.hpp"
 
+#include <array>
+#include <charconv>
 #include <iostream>
 #include <filesystem>
 #include <memory>
 
+// counts and limits, a negative one would wrap around to unlimited once it's a size_t
+static bool ReadCount(const std::shared_ptr<CfgFile>& cfg, const std::string_view key, size_t& count){
+    const int value = cfg->ReadPpty<int>(key);
+    if(value < 0){
+        APATE_LOG_WARN("Ignoring {}={}, it can't be negative", key, value);
+        return false;
+    }
+
+    count = (size_t)value;
+    return true;
+}
+
+// a count inside a list entry, false if the field isn't one
+static bool ParseCount(const std::string_view field, size_t& count){
+    const std::string_view digits = StripSpaces(field);
+    const auto             result = std::from_chars(digits.data(), digits.data() + digits.size(), count);
+
+    return (!digits.empty() && result.ec == std::errc() && result.ptr == digits.data() + digits.size());
+}
+
+static std::shared_ptr<embeddingProvider> MakeEmbeddingProvider(const std::shared_ptr<CfgFile>& cfg){
+    const std::string providerType = cfg->HasPpty("EMBEDDING_PROVIDER") ? ToLowercase(cfg->ReadPpty<std::string>("EMBEDDING_PROVIDER")) : "http";
+
+    if(providerType == "hashing"){
+        const int latencyMs = cfg->HasPpty("HASHING_EMBEDDER_LATENCY_MS") ? cfg->ReadPpty<int>("HASHING_EMBEDDER_LATENCY_MS") : 0;
+        return std::make_shared<hashingEmbedder>(768, std::chrono::milliseconds(latencyMs));
+    }
+
+    const embeddingWireFormat wireFormat = cfg->HasPpty("EMBEDDING_WIRE_FORMAT") ? EmbeddingWireFormatFromString(cfg->ReadPpty<std::string>("EMBEDDING_WIRE_FORMAT")) : EMBEDDING_WIRE_FP32;
+    const std::string         endpoints  = cfg->HasPpty("EMBEDDING_ENDPOINTS") ? cfg->ReadPpty<std::string>("EMBEDDING_ENDPOINTS") : "127.0.0.1:5000";
+
+    // host:port[,host:port...]
+    std::vector<std::shared_ptr<embeddingProvider>> clients;
+    for(const auto endpoint : Tokenize(endpoints, ",")){
+        const std::string_view hostPort = StripSpaces(endpoint);
+        const size_t           colon    = hostPort.rfind(':');
+        size_t                 port     = 0;
+
+        if(colon == std::string_view::npos || !ParseCount(hostPort.substr(colon + 1), port) || port < 1 || port > 65535){
+            APATE_LOG_WARN("Ignoring embedding endpoint '{}', expected host:port", hostPort);
+            continue;
+        }
+
+        clients.push_back(std::make_shared<embeddingClient>(hostPort.substr(0, colon), (int)port, wireFormat));
+    }
+
+    if(clients.empty()){
+        clients.push_back(std::make_shared<embeddingClient>("127.0.0.1", 5000, wireFormat));
+    }
+    if(clients.size() == 1){
+        return clients.front();
+    }
+    return std::make_shared<embeddingPool>(std::move(clients));
+}
+
 int main(int argc, char* argv[]){
 
     curl_global_init(CURL_GLOBAL_DEFAULT);
@@ -21,10 +81,156 @@ int main(int argc, char* argv[]){
 
     auto cfg = CfgGetFile(CFG_FILE_ENV);
     std::unique_ptr<openai::chatGPT> chatGPT = std::make_unique<openai::chatGPT>(cfg->ReadPpty<std::string>("OPEN_API_KEY"));
+    size_t maxConcurrency = 0;
+    if(cfg->HasPpty("OPENAI_MAX_CONCURRENCY") && ReadCount(cfg, "OPENAI_MAX_CONCURRENCY", maxConcurrency)){
+        chatGPT->SetMaxConcurrency(maxConcurrency);
+    }
+
+    // model:requests per minute:tokens per minute, '|' separated
+    if(cfg->HasPpty("OPENAI_RATE_LIMITS")){
+        for(const auto limit : Tokenize(cfg->ReadPpty<std::string>("OPENAI_RATE_LIMITS"), "|")){
+            const auto fields            = Tokenize(limit, ":");
+            size_t     requestsPerMinute = 0;
+            size_t     tokensPerMinute   = 0;
+
+            if(fields.size() != 3 || !ParseCount(fields[1], requestsPerMinute) || !ParseCount(fields[2], tokensPerMinute)){
+                APATE_LOG_WARN("Ignoring rate limit '{}', expected model:rpm:tpm", limit);
+                continue;
+            }
+
+            chatGPT->SetRateLimits(StripSpaces(fields[0]), requestsPerMinute, tokensPerMinute);
+        }
+    }
+
+    size_t maxRetries  = 0;
+    size_t retryBaseMs = 0;
+    size_t retryMaxMs  = 0;
+    if(cfg->HasPpty("OPENAI_MAX_RETRIES") && cfg->HasPpty("OPENAI_RETRY_BASE_MS") && cfg->HasPpty("OPENAI_RETRY_MAX_MS") &&
+       ReadCount(cfg, "OPENAI_MAX_RETRIES", maxRetries) && ReadCount(cfg, "OPENAI_RETRY_BASE_MS", retryBaseMs) && ReadCount(cfg, "OPENAI_RETRY_MAX_MS", retryMaxMs)){
+        chatGPT->SetRetryPolicy(maxRetries, std::chrono::milliseconds(retryBaseMs), std::chrono::milliseconds(retryMaxMs));
+    }
+
+    if(cfg->HasPpty("OPENAI_HEDGING")){
+        chatGPT->SetHedging(ToLowercase(cfg->ReadPpty<std::string>("OPENAI_HEDGING")) == "true");
+    }
+
+    // found in the cfg directory
+    if(cfg->HasPpty("TOKENIZER_VOCAB")){
+        chatGPT->LoadTokenizer(GetDirectory(DIRECTORY_CFG, cfg->ReadPpty<std::string>("TOKENIZER_VOCAB")));
+    }
     discord::serverPersistence persistence;
     discord::discordBot discordBot(cfg->ReadPpty<std::string>("DISCORD_BOT_KEY"));
     discordBot.SetWorkingDir(GetDirectory(DIRECTORY_PERSISTENCE));
     discordBot.SetChatGPT(std::move(chatGPT));
+
+    size_t warmupChannels = 0;
+    if(cfg->HasPpty("INDEX_WARMUP_CHANNELS") && ReadCount(cfg, "INDEX_WARMUP_CHANNELS", warmupChannels)){
+        discordBot.SetIndexWarmupChannels(warmupChannels);
+    }
+
+    size_t exactSearchMaxVectors = 0;
+    if(cfg->HasPpty("EXACT_SEARCH_MAX_VECTORS") && cfg->HasPpty("EXACT_SEARCH_ENCODING") &&
+       ReadCount(cfg, "EXACT_SEARCH_MAX_VECTORS", exactSearchMaxVectors)){
+        discordBot.SetExactSearchOptions(exactSearchMaxVectors,
+                                         discord::VectorEncodingFromString(cfg->ReadPpty<std::string>("EXACT_SEARCH_ENCODING")));
+    }
+
+    size_t cacheTtlMinutes     = 0;
+    size_t cacheMaxNewMessages = 0;
+    if(cfg->HasPpty("RESPONSE_CACHE_SIMILARITY") && cfg->HasPpty("RESPONSE_CACHE_TTL_MINUTES") && cfg->HasPpty("RESPONSE_CACHE_MAX_NEW_MESSAGES") &&
+       ReadCount(cfg, "RESPONSE_CACHE_TTL_MINUTES", cacheTtlMinutes) && ReadCount(cfg, "RESPONSE_CACHE_MAX_NEW_MESSAGES", cacheMaxNewMessages)){
+        discordBot.SetResponseCacheOptions(std::stof(cfg->ReadPpty<std::string>("RESPONSE_CACHE_SIMILARITY")),
+                                           std::chrono::minutes(cacheTtlMinutes),
+                                           cacheMaxNewMessages);
+    }
+
+    if(cfg->HasPpty("EMBEDDING_MODEL_ID")){
+        discordBot.SetEmbeddingModelId(cfg->ReadPpty<std::string>("EMBEDDING_MODEL_ID"));
+    }
+
+    if(cfg->HasPpty("RECENCY_WEIGHT") && cfg->HasPpty("RECENCY_HALF_LIFE_DAYS")){
+        discordBot.SetRecencyOptions(std::stof(cfg->ReadPpty<std::string>("RECENCY_WEIGHT")),
+                                     std::chrono::hours(24 * cfg->ReadPpty<int>("RECENCY_HALF_LIFE_DAYS")));
+    }
+
+    size_t chunkTokens        = 0;
+    size_t chunkOverlapTokens = 0;
+    if(cfg->HasPpty("EMBEDDING_CHUNK_TOKENS") && cfg->HasPpty("EMBEDDING_CHUNK_OVERLAP_TOKENS") &&
+       ReadCount(cfg, "EMBEDDING_CHUNK_TOKENS", chunkTokens) && ReadCount(cfg, "EMBEDDING_CHUNK_OVERLAP_TOKENS", chunkOverlapTokens)){
+        discordBot.SetChunkingOptions(chunkTokens, chunkOverlapTokens);
+    }
+
+    size_t gateActiveMessages = 0;
+    size_t gateActiveMinutes  = 0;
+    if(cfg->HasPpty("REPLY_GATE_ENABLED") && cfg->HasPpty("REPLY_GATE_ACTIVE_MESSAGES") && cfg->HasPpty("REPLY_GATE_ACTIVE_MINUTES") &&
+       ReadCount(cfg, "REPLY_GATE_ACTIVE_MESSAGES", gateActiveMessages) && ReadCount(cfg, "REPLY_GATE_ACTIVE_MINUTES", gateActiveMinutes)){
+        discordBot.SetReplyGateOptions(ToLowercase(cfg->ReadPpty<std::string>("REPLY_GATE_ENABLED")) == "true",
+                                       gateActiveMessages,
+                                       std::chrono::minutes(gateActiveMinutes));
+    }
+
+    if(cfg->HasPpty("REPLY_GATE_TOPICS") && cfg->HasPpty("REPLY_GATE_TOPIC_SIMILARITY")){
+        std::vector<std::string> topics;
+        for(const auto topic : Tokenize(cfg->ReadPpty<std::string>("REPLY_GATE_TOPICS"), "|")){
+            if(topic.find_first_not_of(' ') != std::string_view::npos){
+                topics.emplace_back(StripSpaces(topic));
+            }
+        }
+
+        discordBot.SetReplyGateTopics(std::move(topics), std::stof(cfg->ReadPpty<std::string>("REPLY_GATE_TOPIC_SIMILARITY")));
+    }
+
+    if(cfg->HasPpty("REPLY_DEBOUNCE_MS") && cfg->HasPpty("REPLY_MAX_DELAY_MS")){
+        discordBot.SetReplyDebounceOptions(std::chrono::milliseconds(cfg->ReadPpty<int>("REPLY_DEBOUNCE_MS")),
+                                           std::chrono::milliseconds(cfg->ReadPpty<int>("REPLY_MAX_DELAY_MS")));
+    }
+
+    // model:tokens, '|' separated
+    if(cfg->HasPpty("PROMPT_TOKEN_BUDGETS")){
+        for(const auto budget : Tokenize(cfg->ReadPpty<std::string>("PROMPT_TOKEN_BUDGETS"), "|")){
+            const auto fields = Tokenize(budget, ":");
+            size_t     tokens = 0;
+
+            if(fields.size() != 2 || !ParseCount(fields[1], tokens)){
+                APATE_LOG_WARN("Ignoring prompt budget '{}', expected model:tokens", budget);
+                continue;
+            }
+
+            discordBot.SetPromptBudget(StripSpaces(fields[0]), tokens);
+        }
+    }
+
+    embeddingBatcher::GetInstance().SetProvider(MakeEmbeddingProvider(cfg));
+
+    if(cfg->HasPpty("EMBEDDING_SCHEDULING")){
+        const bool weighted = (ToLowercase(cfg->ReadPpty<std::string>("EMBEDDING_SCHEDULING")) == "weighted");
+
+        // query,ingest,backfill
+        std::array<size_t, EMBEDDING_PRIORITY_COUNT> weights = { 16, 4, 1 };
+        if(cfg->HasPpty("EMBEDDING_PRIORITY_WEIGHTS")){
+            const auto tokens = Tokenize(cfg->ReadPpty<std::string>("EMBEDDING_PRIORITY_WEIGHTS"), ",");
+            for(size_t ii = 0; ii < tokens.size() && ii < weights.size(); ii++){
+                size_t weight = 0;
+                if(!ParseCount(tokens[ii], weight)){
+                    APATE_LOG_WARN("Ignoring embedding priority weight '{}', keeping {}", tokens[ii], weights[ii]);
+                    continue;
+                }
+
+                weights[ii] = weight;
+            }
+        }
+
+        embeddingBatcher::GetInstance().SetScheduling(weighted ? EMBEDDING_SCHEDULING_WEIGHTED : EMBEDDING_SCHEDULING_STRICT, weights);
+    }
+
+    size_t breakerFailures = 0;
+    if(cfg->HasPpty("EMBED_TARGET_LATENCY_MS") && cfg->HasPpty("EMBED_BREAKER_FAILURES") && cfg->HasPpty("EMBED_BREAKER_COOLDOWN_S") &&
+       ReadCount(cfg, "EMBED_BREAKER_FAILURES", breakerFailures)){
+        embeddingBatcher::GetInstance().SetBackpressureOptions(std::chrono::milliseconds(cfg->ReadPpty<int>("EMBED_TARGET_LATENCY_MS")),
+                                                               breakerFailures,
+                                                               std::chrono::seconds(cfg->ReadPpty<int>("EMBED_BREAKER_COOLDOWN_S")));
+    }
+
     discordBot.Start();
     discordBot.WaitForStart();
 
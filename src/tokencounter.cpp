@@ -0,0 +1,519 @@
+#include "tokencounter.hpp"
+
+#include "log/log.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// close enough for english chat when there's no vocabulary to count with
+static const size_t ESTIMATE_CHARS_PER_TOKEN = 4;
+
+// merging is quadratic in the piece's length, runs without spaces (links, base64) are counted in chunks
+static const size_t MAX_MERGE_PIECE = 256;
+
+static const size_t NO_RANK = std::numeric_limits<size_t>::max();
+
+namespace{
+
+// the unicode categories tiktoken's pattern tells apart
+enum charClass{
+    CHAR_UPPER,     // Lu Lt
+    CHAR_LOWER,     // Ll
+    CHAR_LETTER,    // Lm Lo, they go with either case
+    CHAR_MARK,      // go with either case too, and with punctuation
+    CHAR_NUMBER,
+    CHAR_NEWLINE,   // only \r and \n
+    CHAR_SPACE,
+    CHAR_OTHER
+};
+
+struct codePoint{
+    charClass cls;
+    size_t    length;
+};
+
+// Exact for ascii, latin-1, latin extended-a and additional, modern greek and cyrillic. Elsewhere it goes by
+// block: punctuation, symbols and emoji blocks are other, the rest are caseless letters.
+charClass Classify(const char32_t cp){
+    if(cp < 0x80){
+        if(cp >= 'a' && cp <= 'z') return CHAR_LOWER;
+        if(cp >= 'A' && cp <= 'Z') return CHAR_UPPER;
+        if(cp >= '0' && cp <= '9') return CHAR_NUMBER;
+        if('\n' == cp || '\r' == cp) return CHAR_NEWLINE;
+        if(' ' == cp || (cp >= '\t' && cp <= '\f')) return CHAR_SPACE;
+        return CHAR_OTHER;
+    }
+
+    if(0x85 == cp || 0xA0 == cp || 0x1680 == cp || (cp >= 0x2000 && cp <= 0x200A) ||
+       0x2028 == cp || 0x2029 == cp || 0x202F == cp || 0x205F == cp || 0x3000 == cp){
+        return CHAR_SPACE;
+    }
+
+    if(cp < 0x100){
+        if(0xAA == cp || 0xBA == cp) return CHAR_LETTER;
+        if(0xB5 == cp) return CHAR_LOWER;
+        if(0xB2 == cp || 0xB3 == cp || 0xB9 == cp || (cp >= 0xBC && cp <= 0xBE)) return CHAR_NUMBER;
+        if(cp < 0xC0 || 0xD7 == cp || 0xF7 == cp) return CHAR_OTHER;
+        return (cp < 0xDF) ? CHAR_UPPER : CHAR_LOWER;
+    }
+
+    // latin extended-a pairs upper with lower case, two runs of it are shifted by one
+    if(cp < 0x180){
+        if(0x138 == cp || 0x149 == cp || 0x17F == cp) return CHAR_LOWER;
+        if(0x178 == cp) return CHAR_UPPER;
+
+        const bool shifted = ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E));
+        return ((1 == (cp & 1)) == shifted) ? CHAR_UPPER : CHAR_LOWER;
+    }
+
+    if(cp >= 0x370 && cp < 0x400){
+        if(0x37E == cp || 0x387 == cp || 0x375 == cp || 0x384 == cp || 0x385 == cp || 0x3F6 == cp) return CHAR_OTHER;
+        if(0x390 == cp || (cp >= 0x3AC && cp <= 0x3CE)) return CHAR_LOWER;
+        if(0x386 == cp || (cp >= 0x388 && cp <= 0x3AB)) return CHAR_UPPER;
+        return CHAR_LETTER;
+    }
+
+    if(cp >= 0x400 && cp < 0x460){
+        return (cp < 0x430) ? CHAR_UPPER : CHAR_LOWER;
+    }
+
+    // the rest of cyrillic and latin extended additional pair them the same way
+    if((cp >= 0x460 && cp < 0x482) || (cp >= 0x48A && cp < 0x530) || (cp >= 0x1E00 && cp < 0x1F00)){
+        if(0x4C0 == cp || 0x1E9E == cp) return CHAR_UPPER;
+        if(0x4CF == cp || (cp >= 0x1E96 && cp <= 0x1E9F)) return CHAR_LOWER;
+
+        const bool shifted = (cp >= 0x4C1 && cp <= 0x4CE);
+        return ((1 == (cp & 1)) == shifted) ? CHAR_UPPER : CHAR_LOWER;
+    }
+
+    // digits of other scripts, the ones chat uses
+    if((cp >= 0x660 && cp <= 0x669) || (cp >= 0x6F0 && cp <= 0x6F9) || (cp >= 0x966 && cp <= 0x96F) ||
+       (cp >= 0xE50 && cp <= 0xE59) || (cp >= 0xFF10 && cp <= 0xFF19)){
+        return CHAR_NUMBER;
+    }
+
+    // their punctuation
+    if(0x482 == cp || (cp >= 0x55A && cp <= 0x55F) || 0x589 == cp || 0x5BE == cp || 0x5C0 == cp ||
+       0x5C3 == cp || 0x5C6 == cp || 0x5F3 == cp || 0x5F4 == cp || (cp >= 0x600 && cp <= 0x60F) || 0x61B == cp ||
+       (cp >= 0x61D && cp <= 0x61F) || (cp >= 0x66A && cp <= 0x66D) || 0x6D4 == cp || 0x964 == cp || 0x965 == cp ||
+       0x970 == cp || 0xE3F == cp || 0xE4F == cp || 0xE5A == cp || 0xE5B == cp){
+        return CHAR_OTHER;
+    }
+
+    // general punctuation up to the symbol and dingbat blocks, less the super and subscript digits,
+    // combining marks for symbols and number forms
+    if(cp >= 0x2000 && cp < 0x2C00){
+        if(0x2070 == cp || (cp >= 0x2074 && cp <= 0x2079) || (cp >= 0x2080 && cp <= 0x2089) ||
+           (cp >= 0x2150 && cp <= 0x2189) || (cp >= 0x2460 && cp <= 0x249B) || (cp >= 0x24EA && cp <= 0x24FF) ||
+           (cp >= 0x2776 && cp <= 0x2793)){
+            return CHAR_NUMBER;
+        }
+        if(0x2071 == cp || 0x207F == cp || (cp >= 0x2090 && cp <= 0x209C)){
+            return CHAR_LETTER;
+        }
+        if(cp >= 0x20D0 && cp <= 0x20F0){
+            return CHAR_MARK;
+        }
+        return CHAR_OTHER;
+    }
+
+    // supplemental punctuation, cjk radicals and punctuation, kana punctuation
+    if((cp >= 0x2E00 && cp < 0x3000) || (cp >= 0x3001 && cp <= 0x3004) || (cp >= 0x3008 && cp <= 0x3020) ||
+       0x3030 == cp || 0x303D == cp || 0x303E == cp || 0x303F == cp || 0x309B == cp || 0x309C == cp ||
+       0x30A0 == cp || 0x30FB == cp || (cp >= 0x3200 && cp < 0x3400) || (cp >= 0x4DC0 && cp < 0x4E00)){
+        return CHAR_OTHER;
+    }
+
+    // private use, punctuation forms and the halfwidth and fullwidth forms
+    if(cp >= 0xFF21 && cp <= 0xFF3A) return CHAR_UPPER;
+    if(cp >= 0xFF41 && cp <= 0xFF5A) return CHAR_LOWER;
+    if((cp >= 0xE000 && cp < 0xF900) || (cp >= 0xFE10 && cp < 0xFE20) || (cp >= 0xFE30 && cp < 0xFE70) ||
+       0xFEFF == cp || (cp >= 0xFF00 && cp < 0xFF66) || (cp >= 0xFFE0 && cp < 0x10000)){
+        return CHAR_OTHER;
+    }
+
+    // combining marks, the variation selectors after emoji among them
+    if((cp >= 0x300 && cp < 0x370) || (cp >= 0x483 && cp < 0x48A) || (cp >= 0x1AB0 && cp < 0x1B00) ||
+       (cp >= 0x1DC0 && cp < 0x1E00) || (cp >= 0x20D0 && cp < 0x2100) || (cp >= 0xFE00 && cp < 0xFE10) ||
+       (cp >= 0xFE20 && cp < 0xFE30) || (cp >= 0xE0100 && cp < 0xE01F0)){
+        return CHAR_MARK;
+    }
+
+    // emoji and the other symbol blocks, tags
+    if((cp >= 0x1F000 && cp < 0x1FB00) || (cp >= 0xE0000 && cp < 0xE0080) || cp >= 0xF0000){
+        return CHAR_OTHER;
+    }
+
+    return CHAR_LETTER;
+}
+
+// most of what's counted is ascii
+const std::array<charClass, 0x80> ASCII_CLASSES = [](){
+    std::array<charClass, 0x80> classes;
+    for(char32_t cp = 0; cp < 0x80; cp++){
+        classes[cp] = Classify(cp);
+    }
+    return classes;
+}();
+
+codePoint Decode(const std::string_view text, const size_t pos){
+    const unsigned char lead = (unsigned char)text[pos];
+    if(lead < 0x80){
+        return { ASCII_CLASSES[lead], 1 };
+    }
+
+    size_t   length = 0;
+    char32_t cp     = 0;
+
+    if(0xC0 == (lead & 0xE0)){
+        length = 2;
+        cp     = lead & 0x1F;
+    }
+    else if(0xE0 == (lead & 0xF0)){
+        length = 3;
+        cp     = lead & 0x0F;
+    }
+    else if(0xF0 == (lead & 0xF8)){
+        length = 4;
+        cp     = lead & 0x07;
+    }
+    else{
+        return { CHAR_OTHER, 1 };
+    }
+
+    if(pos + length > text.size()){
+        return { CHAR_OTHER, 1 };
+    }
+
+    for(size_t ii = 1; ii < length; ii++){
+        const unsigned char next = (unsigned char)text[pos + ii];
+        if(0x80 != (next & 0xC0)){
+            return { CHAR_OTHER, 1 };
+        }
+        cp = (cp << 6) | (next & 0x3F);
+    }
+
+    return { Classify(cp), length };
+}
+
+bool IsCaseless(const charClass cls){
+    return (CHAR_LETTER == cls || CHAR_MARK == cls);
+}
+
+bool IsUpperOrCaseless(const charClass cls){
+    return (CHAR_UPPER == cls || IsCaseless(cls));
+}
+
+bool IsLowerOrCaseless(const charClass cls){
+    return (CHAR_LOWER == cls || IsCaseless(cls));
+}
+
+// not whitespace, a letter or a number
+bool IsPunctuation(const charClass cls){
+    return (CHAR_OTHER == cls || CHAR_MARK == cls);
+}
+
+// end of the word at pos, pos when there's none. A word is upper case letters followed by lower case
+// ones, so "CamelCase" and "iPhone" are two words each but "HTTPServer" is one.
+size_t WordEnd(const std::string_view text, const size_t pos){
+    size_t    ii              = pos;
+    size_t    lastCaselessEnd = std::string_view::npos;
+    codePoint c               = { CHAR_OTHER, 0 };
+
+    while(ii < text.size()){
+        c = Decode(text, ii);
+        if(!IsUpperOrCaseless(c.cls)){
+            break;
+        }
+        ii += c.length;
+
+        if(IsCaseless(c.cls)){
+            lastCaselessEnd = ii;
+        }
+    }
+
+    // c is what ended the upper case run
+    const size_t upperEnd = ii;
+    while(ii < text.size() && IsLowerOrCaseless(c.cls)){
+        ii += c.length;
+        if(ii < text.size()){
+            c = Decode(text, ii);
+        }
+    }
+
+    // no lower case after the upper case run, a caseless letter in it ends a word of its own
+    if(ii == upperEnd && lastCaselessEnd != std::string_view::npos){
+        return lastCaselessEnd;
+    }
+
+    return ii;
+}
+
+// english contractions stay with the word in front of them
+size_t ContractionEnd(const std::string_view text, const size_t pos){
+    if(pos + 1 >= text.size() || '\'' != text[pos]){
+        return pos;
+    }
+
+    const char next = (char)std::tolower((unsigned char)text[pos + 1]);
+    const char then = (pos + 2 < text.size()) ? (char)std::tolower((unsigned char)text[pos + 2]) : '\0';
+
+    if(('r' == next && 'e' == then) || ('v' == next && 'e' == then) || ('l' == next && 'l' == then)){
+        return pos + 3;
+    }
+
+    if('s' == next || 't' == next || 'm' == next || 'd' == next){
+        return pos + 2;
+    }
+
+    return pos;
+}
+
+int Base64Value(const char c){
+    if(c >= 'A' && c <= 'Z') return c - 'A';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if(c >= '0' && c <= '9') return c - '0' + 52;
+    if('+' == c) return 62;
+    if('/' == c) return 63;
+    return -1;
+}
+
+bool DecodeBase64(const std::string_view encoded, std::string& decoded){
+    unsigned int bits    = 0;
+    int          numBits = 0;
+
+    for(const char c : encoded){
+        if('=' == c){
+            break;
+        }
+
+        const int value = Base64Value(c);
+        if(value < 0){
+            return false;
+        }
+
+        bits     = (bits << 6) | (unsigned int)value;
+        numBits += 6;
+
+        if(numBits >= 8){
+            numBits -= 8;
+            decoded.push_back((char)((bits >> numBits) & 0xFF));
+        }
+    }
+
+    return true;
+}
+
+}
+
+namespace openai{
+
+bool tokenCounter::Load(const std::filesystem::path& vocabPath){
+    std::ifstream vocab(vocabPath, std::ios::binary);
+    if(!vocab){
+        APATE_LOG_WARN("Couldn't open token vocabulary {}, token counts will be estimates", vocabPath.string());
+        return false;
+    }
+
+    struct tokenEntry{
+        size_t offset;
+        size_t length;
+        size_t rank;
+    };
+
+    std::vector<tokenEntry> entries;
+    std::string             tokenBytes;
+    std::string             line;
+
+    while(std::getline(vocab, line)){
+        if(!line.empty() && '\r' == line.back()){
+            line.pop_back();
+        }
+
+        if(line.empty()){
+            continue;
+        }
+
+        const size_t space = line.find(' ');
+        size_t       rank  = 0;
+
+        const size_t offset = tokenBytes.size();
+        if(space == std::string::npos ||
+           !DecodeBase64(std::string_view(line).substr(0, space), tokenBytes) ||
+           std::from_chars(line.data() + space + 1, line.data() + line.size(), rank).ec != std::errc()){
+            APATE_LOG_WARN("Token vocabulary {} has a malformed line '{}', token counts will be estimates", vocabPath.string(), line);
+            return false;
+        }
+
+        entries.push_back({ offset, tokenBytes.size() - offset, rank });
+    }
+
+    // the keys point into m_tokenBytes, it can't move once they're made
+    m_ranks.clear();
+    m_tokenBytes = std::move(tokenBytes);
+    m_ranks.reserve(entries.size());
+
+    for(const auto& entry : entries){
+        m_ranks.emplace(std::string_view(m_tokenBytes).substr(entry.offset, entry.length), entry.rank);
+    }
+
+    APATE_LOG_INFO("Loaded '{}' tokens from {}", m_ranks.size(), vocabPath.string());
+    return true;
+}
+
+size_t tokenCounter::Count(const std::string_view text) const{
+    if(!Loaded()){
+        return (text.size() + ESTIMATE_CHARS_PER_TOKEN - 1) / ESTIMATE_CHARS_PER_TOKEN;
+    }
+
+    size_t numTokens = 0;
+    size_t start     = 0;
+
+    while(start < text.size()){
+        const size_t end = NextPiece(text, start);
+
+        for(size_t chunk = start; chunk < end; chunk += MAX_MERGE_PIECE){
+            numTokens += CountPiece(text.substr(chunk, std::min(MAX_MERGE_PIECE, end - chunk)));
+        }
+        start = end;
+    }
+
+    return numTokens;
+}
+
+size_t tokenCounter::NextPiece(const std::string_view text, const size_t start){
+    const size_t    size  = text.size();
+    const codePoint first = Decode(text, start);
+
+    // a word, with the space or punctuation in front of it
+    size_t ii = start;
+    if(CHAR_SPACE == first.cls || IsPunctuation(first.cls)){
+        ii += first.length;
+    }
+
+    const size_t wordEnd = WordEnd(text, ii);
+    if(wordEnd > ii){
+        return ContractionEnd(text, wordEnd);
+    }
+
+    // numbers go in groups of up to three digits
+    if(CHAR_NUMBER == first.cls){
+        ii = start;
+        for(size_t digits = 0; digits < 3 && ii < size; digits++){
+            const codePoint c = Decode(text, ii);
+            if(CHAR_NUMBER != c.cls){
+                break;
+            }
+            ii += c.length;
+        }
+        return ii;
+    }
+
+    // punctuation, with a space in front of it and newlines or slashes after it
+    ii = start;
+    if(' ' == text[ii] && ii + 1 < size && IsPunctuation(Decode(text, ii + 1).cls)){
+        ii++;
+    }
+
+    if(IsPunctuation(Decode(text, ii).cls)){
+        while(ii < size){
+            const codePoint c = Decode(text, ii);
+            if(!IsPunctuation(c.cls)){
+                break;
+            }
+            ii += c.length;
+        }
+        while(ii < size && ('\n' == text[ii] || '\r' == text[ii] || '/' == text[ii])){
+            ii++;
+        }
+        return ii;
+    }
+
+    // whitespace up to its last newline, otherwise all but the last space which goes with the next word
+    ii = start;
+    size_t newlineEnd = std::string_view::npos;
+    size_t lastSpace  = start;
+
+    while(ii < size){
+        const codePoint c = Decode(text, ii);
+        if(CHAR_NEWLINE == c.cls){
+            newlineEnd = ii + c.length;
+        }
+        else if(CHAR_SPACE != c.cls){
+            break;
+        }
+        lastSpace  = ii;
+        ii        += c.length;
+    }
+
+    if(newlineEnd != std::string_view::npos){
+        return newlineEnd;
+    }
+
+    if(ii < size && lastSpace > start){
+        return lastSpace;
+    }
+
+    return ii;
+}
+
+size_t tokenCounter::CountPiece(const std::string_view piece) const{
+    if(piece.size() <= 1 || Rank(piece) != NO_RANK){
+        return 1;
+    }
+
+    // where each part starts and the rank of it merged with the part after it. Kept per thread so
+    // counting doesn't allocate once it's warmed up.
+    thread_local std::vector<std::pair<size_t, size_t>> parts;
+
+    parts.clear();
+    for(size_t ii = 0; ii <= piece.size(); ii++){
+        parts.push_back({ ii, NO_RANK });
+    }
+
+    auto pairRank = [&](const size_t part){
+        if(part + 2 >= parts.size()){
+            return NO_RANK;
+        }
+        return Rank(piece.substr(parts[part].first, parts[part + 2].first - parts[part].first));
+    };
+
+    for(size_t ii = 0; ii + 1 < parts.size(); ii++){
+        parts[ii].second = pairRank(ii);
+    }
+
+    // lowest rank merges first, the same order the encoder learned them in
+    while(parts.size() > 2){
+        size_t best = 0;
+        for(size_t ii = 1; ii + 1 < parts.size(); ii++){
+            if(parts[ii].second < parts[best].second){
+                best = ii;
+            }
+        }
+
+        if(NO_RANK == parts[best].second){
+            break;
+        }
+
+        parts.erase(parts.begin() + best + 1);
+
+        parts[best].second = pairRank(best);
+        if(best > 0){
+            parts[best - 1].second = pairRank(best - 1);
+        }
+    }
+
+    return parts.size() - 1;
+}
+
+size_t tokenCounter::Rank(const std::string_view bytes) const{
+    auto it = m_ranks.find(bytes);
+    return (it == m_ranks.end()) ? NO_RANK : it->second;
+}
+}
@@ -0,0 +1,46 @@
+#ifndef TOKENCOUNTER_HPP
+#define TOKENCOUNTER_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace openai{
+
+// Counts tokens with the o200k_base encoding of the gpt-4o family, from its tiktoken vocabulary file
+// (https://openaipublic.blob.core.windows.net/encodings/o200k_base.tiktoken). Counts match tiktoken's for
+// ascii, latin, greek and cyrillic text and emoji. Other scripts' rarer punctuation and letter cases are
+// guessed from their unicode block and can be slightly off. Without the file it falls back to an estimate.
+// Load before any thread counts, counting is safe from any number of threads after that.
+class tokenCounter{
+public:
+    tokenCounter(void) = default;
+
+    tokenCounter(tokenCounter&) = delete;
+    tokenCounter(tokenCounter&&) = delete;
+    tokenCounter& operator=(tokenCounter&) = delete;
+    tokenCounter& operator=(tokenCounter&&) = delete;
+
+    // each line is a base64 encoded token and its merge rank
+    bool Load(const std::filesystem::path& vocabPath);
+    bool Loaded(void) const { return !m_ranks.empty(); }
+
+    size_t Count(const std::string_view text) const;
+
+private:
+    // splits text into the pieces the encoder merges on its own, o200k's pattern with the unicode
+    // categories it needs looked up by block
+    static size_t NextPiece(const std::string_view text, const size_t start);
+
+    size_t CountPiece(const std::string_view piece) const;
+    size_t Rank(const std::string_view bytes) const;
+
+    // every token's bytes back to back, the rank map's keys point into it
+    std::string                                  m_tokenBytes;
+    std::unordered_map<std::string_view, size_t> m_ranks;
+};
+}
+
+#endif